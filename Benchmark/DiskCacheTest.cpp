@@ -0,0 +1,242 @@
+//
+//  DiskCacheTest.cpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/29.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+//Checks of DiskCache in a temporary directory: merging ranges, keeping them across opening, locking entries and trimming the directory.
+//Every failed check is printed to stderr, and it exits non-zero if any check failed.
+//
+//usage: DiskCacheTest
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+#include "DiskCache.hpp"
+
+using namespace tfmpcore;
+
+static int failedCount = 0;
+
+#define TFMPCheck(cond, ...)\
+do{\
+    if (!(cond)) {\
+        failedCount++;\
+        fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__);\
+        fprintf(stderr, __VA_ARGS__);\
+        fprintf(stderr, "\n");\
+    }\
+}while(0)
+
+static const int64_t contentSize = 1024*1024;
+static const int64_t noBudget = INT64_MAX;
+
+static std::vector<uint8_t> makeBytes(int64_t offset, int size){
+    std::vector<uint8_t> bytes(size);
+    for (int i = 0; i<size; i++) {
+        bytes[i] = (uint8_t)((offset+i)*31);
+    }
+    return bytes;
+}
+
+static void writeRange(DiskCache &cache, int64_t start, int64_t end){
+    std::vector<uint8_t> bytes = makeBytes(start, (int)(end-start));
+    cache.write(start, bytes.data(), (int)bytes.size());
+}
+
+static std::vector<std::string> dataFiles(const std::string &dir){
+    std::vector<std::string> files;
+    DIR *dirp = opendir(dir.c_str());
+    struct dirent *item;
+    while (dirp && (item = readdir(dirp)) != nullptr) {
+        std::string name = item->d_name;
+        if (name.size() > 5 && name.compare(name.size()-5, 5, ".data") == 0) {
+            files.push_back(dir+"/"+name);
+        }
+    }
+    if (dirp) closedir(dirp);
+    return files;
+}
+
+static void removeDirectory(const std::string &dir){
+    DIR *dirp = opendir(dir.c_str());
+    struct dirent *item;
+    while (dirp && (item = readdir(dirp)) != nullptr) {
+        std::string name = item->d_name;
+        if (name != "." && name != "..") remove((dir+"/"+name).c_str());
+    }
+    if (dirp) closedir(dirp);
+    rmdir(dir.c_str());
+}
+
+#pragma mark - ranges
+
+static void testMergeRanges(const std::string &dir){
+    DiskCache cache(dir, noBudget);
+    TFMPCheck(cache.open("http://test/merge", contentSize), "open fails");
+    
+    writeRange(cache, 0, 100);
+    writeRange(cache, 200, 300);
+    TFMPCheck(cache.cachedLength(0) == 100, "cached length at 0 is %lld, expect 100", (long long)cache.cachedLength(0));
+    TFMPCheck(cache.cachedLength(150) == 0, "the gap is cached");
+    TFMPCheck(cache.cachedLength(250) == 50, "cached length at 250 is %lld, expect 50", (long long)cache.cachedLength(250));
+    
+    //touching both neighbours joins them into one range.
+    writeRange(cache, 100, 200);
+    TFMPCheck(cache.cachedLength(0) == 300, "touching ranges aren't merged, cached length %lld", (long long)cache.cachedLength(0));
+    
+    //overlapping the end and going on.
+    writeRange(cache, 250, 400);
+    TFMPCheck(cache.cachedLength(0) == 400, "overlapping ranges aren't merged, cached length %lld", (long long)cache.cachedLength(0));
+    
+    //covering several ranges at once.
+    writeRange(cache, 500, 600);
+    writeRange(cache, 700, 800);
+    writeRange(cache, 450, 900);
+    TFMPCheck(cache.cachedLength(450) == 450, "covering ranges aren't merged, cached length %lld", (long long)cache.cachedLength(450));
+    TFMPCheck(cache.cachedLength(420) == 0, "the gap before a merged range is cached");
+    
+    uint8_t buf[400];
+    std::vector<uint8_t> expect = makeBytes(0, 400);
+    TFMPCheck(cache.read(0, buf, 400) == 400 && memcmp(buf, expect.data(), 400) == 0, "cached bytes are wrong");
+}
+
+static void testReopen(const std::string &dir){
+    {
+        DiskCache cache(dir, noBudget);
+        cache.open("http://test/reopen", contentSize);
+        writeRange(cache, 1000, 5000);
+        writeRange(cache, 8000, 9000);
+    }
+    
+    DiskCache cache(dir, noBudget);
+    TFMPCheck(cache.open("http://test/reopen", contentSize), "reopen fails");
+    TFMPCheck(cache.cachedLength(1000) == 4000 && cache.cachedLength(8000) == 1000, "ranges aren't kept by the index");
+    
+    uint8_t buf[1000];
+    std::vector<uint8_t> expect = makeBytes(8000, 1000);
+    TFMPCheck(cache.read(8000, buf, 1000) == 1000 && memcmp(buf, expect.data(), 1000) == 0, "bytes aren't kept after reopening");
+    cache.close();
+    
+    //the media has changed.
+    DiskCache changed(dir, noBudget);
+    TFMPCheck(changed.open("http://test/reopen", contentSize+1), "open with another size fails");
+    TFMPCheck(changed.cachedLength(1000) == 0, "the cache of a changed media is used");
+}
+
+static void testEntryBudget(const std::string &dir){
+    DiskCache cache(dir, 1000);
+    cache.open("http://test/budget", contentSize);
+    writeRange(cache, 0, 800);
+    writeRange(cache, 800, 1600);
+    TFMPCheck(cache.cachedLength(0) == 800, "the entry grows over the budget, cached length %lld", (long long)cache.cachedLength(0));
+}
+
+#pragma mark - locking and trimming
+
+static void testLock(const std::string &dir){
+    DiskCache first(dir, noBudget);
+    DiskCache second(dir, noBudget);
+    TFMPCheck(first.open("http://test/lock", contentSize), "open fails");
+    TFMPCheck(!second.open("http://test/lock", contentSize), "two caches share one entry");
+    
+    first.close();
+    TFMPCheck(second.open("http://test/lock", contentSize), "the entry is still locked after closing");
+}
+
+//Entries are created from the oldest to the newest, and their files are dated back in that order.
+static std::string createEntry(const std::string &dir, const char *url, time_t age){
+    std::vector<std::string> before = dataFiles(dir);
+    {
+        DiskCache cache(dir, noBudget);
+        cache.open(url, contentSize);
+        writeRange(cache, 0, 64*1024);
+    }
+    for (auto &path : dataFiles(dir)) {
+        bool isNew = true;
+        for (auto &old : before) {
+            if (old == path) isNew = false;
+        }
+        if (!isNew) continue;
+        
+        struct timeval times[2];
+        gettimeofday(&times[0], nullptr);
+        times[0].tv_sec -= age;
+        times[1] = times[0];
+        utimes(path.c_str(), times);
+        return path;
+    }
+    return "";
+}
+
+static bool exists(const std::string &path){
+    struct stat fileStat;
+    return stat(path.c_str(), &fileStat) == 0;
+}
+
+static void testTrim(const std::string &dir){
+    std::string oldest = createEntry(dir, "http://test/trim1", 300);
+    std::string older = createEntry(dir, "http://test/trim2", 200);
+    std::string newest = createEntry(dir, "http://test/trim3", 100);
+    TFMPCheck(!oldest.empty() && !older.empty() && !newest.empty(), "entries aren't created");
+    
+    struct stat fileStat;
+    stat(newest.c_str(), &fileStat);
+    int64_t entrySize = (int64_t)fileStat.st_blocks*512;
+    
+    //the oldest entry is in use, the next one goes instead.
+    DiskCache inUse(dir, noBudget);
+    inUse.open("http://test/trim1", contentSize);
+    struct timeval times[2];
+    gettimeofday(&times[0], nullptr);
+    times[0].tv_sec -= 300;
+    times[1] = times[0];
+    utimes(oldest.c_str(), times);
+    
+    DiskCache::trimDirectory(dir, entrySize*2, "");
+    TFMPCheck(exists(oldest), "the entry in use is evicted");
+    TFMPCheck(!exists(older), "the least recently used entry isn't evicted");
+    TFMPCheck(exists(newest), "the newest entry is evicted");
+    inUse.close();
+    
+    //keepPath is never evicted.
+    DiskCache::trimDirectory(dir, 0, newest);
+    TFMPCheck(!exists(oldest), "the entry isn't evicted after closing");
+    TFMPCheck(exists(newest), "the entry of keepPath is evicted");
+}
+
+int main(){
+    
+    char dirTemplate[] = "/tmp/DiskCacheTest.XXXXXX";
+    if (mkdtemp(dirTemplate) == nullptr) {
+        fprintf(stderr, "can't create a temporary directory\n");
+        return 1;
+    }
+    std::string dir = dirTemplate;
+    
+    testMergeRanges(dir);
+    testReopen(dir);
+    testEntryBudget(dir);
+    testLock(dir);
+    
+    removeDirectory(dir);
+    mkdir(dir.c_str(), 0755);
+    testTrim(dir);
+    removeDirectory(dir);
+    
+    if (failedCount > 0) {
+        fprintf(stderr, "%d checks failed\n", failedCount);
+        return 1;
+    }
+    fprintf(stderr, "all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,325 @@
+//
+//  RecycleBufferBenchmark.cpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/15.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+//Throughput and handoff latency of RecycleBuffer with one producer and one consumer.
+//The results are printed to stdout as JSON, and a readable summary is printed to stderr.
+//
+//usage: RecycleBufferBenchmark [--quick] [--items N] [--filter TEXT]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include "RecycleBuffer.hpp"
+
+using namespace tfmpcore;
+
+static inline int64_t nowNanos(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//Simulate the work of a slow producer or consumer, sleeping is too coarse.
+static inline void spinFor(int64_t nanos){
+    if (nanos <= 0) return;
+    int64_t end = nowNanos() + nanos;
+    while (nowNanos() < end) {}
+}
+
+#pragma mark - payloads
+
+//Every payload carries its sequence and the time it's inserted.
+
+typedef struct{
+    int64_t seq;
+    int64_t stamp;
+}SmallPayload;
+
+typedef struct{
+    int64_t seq;
+    int64_t stamp;
+    char data[240];
+}LargePayload;
+
+typedef struct{
+    int64_t seq;
+    int64_t stamp;
+    char data[64];
+}HeapPayloadValue;
+
+typedef HeapPayloadValue * HeapPayload;
+
+template<typename T>
+struct PayloadTraits;
+
+template<>
+struct PayloadTraits<SmallPayload>{
+    static const char *name(){ return "small"; }
+    static SmallPayload make(int64_t seq){ return {seq, 0}; }
+    static void stamp(SmallPayload &val){ val.stamp = nowNanos(); }
+    static int64_t seq(SmallPayload &val){ return val.seq; }
+    static int64_t stampOf(SmallPayload &val){ return val.stamp; }
+    static void release(SmallPayload &){}
+};
+
+template<>
+struct PayloadTraits<LargePayload>{
+    static const char *name(){ return "large"; }
+    static LargePayload make(int64_t seq){
+        LargePayload val;
+        val.seq = seq;
+        val.stamp = 0;
+        memset(val.data, (int)(seq & 0xff), sizeof(val.data));
+        return val;
+    }
+    static void stamp(LargePayload &val){ val.stamp = nowNanos(); }
+    static int64_t seq(LargePayload &val){ return val.seq; }
+    static int64_t stampOf(LargePayload &val){ return val.stamp; }
+    static void release(LargePayload &){}
+};
+
+template<>
+struct PayloadTraits<HeapPayload>{
+    static const char *name(){ return "pointer"; }
+    static HeapPayload make(int64_t seq){
+        HeapPayload val = new HeapPayloadValue();
+        val->seq = seq;
+        val->stamp = 0;
+        return val;
+    }
+    static void stamp(HeapPayload &val){ val->stamp = nowNanos(); }
+    static int64_t seq(HeapPayload &val){ return val->seq; }
+    static int64_t stampOf(HeapPayload &val){ return val->stamp; }
+    static void release(HeapPayload &val){ delete val; }
+};
+
+//Sorted buffers get out the least value first, the sequences increase so every insert walks the sorting path once.
+template<typename T>
+static int compareSeq(T &val1, T &val2){
+    int64_t seq1 = PayloadTraits<T>::seq(val1), seq2 = PayloadTraits<T>::seq(val2);
+    return seq1 < seq2 ? -1 : (seq1 > seq2 ? 1 : 0);
+}
+
+#pragma mark - cases
+
+typedef struct{
+    bool ring;          //single-producer/single-consumer ring or linked nodes.
+    bool blocking;      //blockInsert/blockGetOut or spinning on insert/getOut.
+    bool sorted;        //with valueCompFunc, linked nodes only.
+    int depth;          //limit size of the buffer.
+    int64_t producerWork;  //nanoseconds of work per item.
+    int64_t consumerWork;
+    const char *ratio;
+}BenchmarkCase;
+
+typedef struct{
+    std::string name;
+    BenchmarkCase benchCase;
+    const char *payload;
+    long items;
+    double seconds;
+    double throughput;
+    int64_t p50;
+    int64_t p99;
+    int64_t p999;
+    int64_t maxLatency;
+    bool orderError;
+}BenchmarkResult;
+
+static std::string caseName(BenchmarkCase &benchCase, const char *payload){
+    char name[128];
+    snprintf(name, sizeof(name), "%s/%s/%s/%s/depth%d/%s",
+             benchCase.ring ? "ring" : "linked",
+             benchCase.blocking ? "block" : "spin",
+             benchCase.sorted ? "sorted" : "unsorted",
+             payload, benchCase.depth, benchCase.ratio);
+    return name;
+}
+
+static int64_t percentile(std::vector<int64_t> &sorted, double ratio){
+    if (sorted.empty()) return 0;
+    size_t index = (size_t)(ratio*(sorted.size()-1));
+    return sorted[index];
+}
+
+template<typename T>
+static BenchmarkResult runCase(BenchmarkCase benchCase, long items){
+    typedef PayloadTraits<T> Traits;
+    
+    RecycleBuffer<T> buffer(benchCase.depth, true, benchCase.ring);
+    if (benchCase.sorted) {
+        buffer.valueCompFunc = compareSeq<T>;
+    }
+    
+    //prepare payloads before timing, so allocating isn't measured.
+    std::vector<T> values;
+    values.reserve(items);
+    for (long i = 0; i<items; i++) {
+        values.push_back(Traits::make(i));
+    }
+    
+    std::vector<int64_t> latencies(items);
+    bool orderError = false;
+    
+    int64_t start = nowNanos();
+    
+    std::thread producer([&]{
+        for (long i = 0; i<items; i++) {
+            spinFor(benchCase.producerWork);
+            
+            T val = values[i];
+            Traits::stamp(val);
+            if (benchCase.blocking) {
+                buffer.blockInsert(val);
+            }else{
+                while (!buffer.insert(val)) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    });
+    
+    std::thread consumer([&]{
+        int64_t expectSeq = 0;
+        for (long i = 0; i<items; i++) {
+            T val;
+            if (benchCase.blocking) {
+                buffer.blockGetOut(&val);
+            }else{
+                while (!buffer.getOut(&val)) {
+                    std::this_thread::yield();
+                }
+            }
+            latencies[i] = nowNanos() - Traits::stampOf(val);
+            if (Traits::seq(val) != expectSeq) orderError = true;
+            expectSeq = Traits::seq(val)+1;
+            
+            spinFor(benchCase.consumerWork);
+        }
+    });
+    
+    producer.join();
+    consumer.join();
+    
+    int64_t end = nowNanos();
+    
+    for (long i = 0; i<items; i++) {
+        Traits::release(values[i]);
+    }
+    
+    std::sort(latencies.begin(), latencies.end());
+    
+    BenchmarkResult result;
+    result.benchCase = benchCase;
+    result.payload = Traits::name();
+    result.items = items;
+    result.seconds = (end-start)/1e9;
+    result.throughput = items/result.seconds;
+    result.p50 = percentile(latencies, 0.5);
+    result.p99 = percentile(latencies, 0.99);
+    result.p999 = percentile(latencies, 0.999);
+    result.maxLatency = latencies.empty() ? 0 : latencies.back();
+    result.orderError = orderError;
+    result.name = caseName(benchCase, result.payload);
+    
+    return result;
+}
+
+template<typename T>
+static void runFiltered(BenchmarkCase benchCase, long items, const char *filter, std::vector<BenchmarkResult> &results){
+    if (filter && caseName(benchCase, PayloadTraits<T>::name()).find(filter) == std::string::npos) {
+        return;
+    }
+    
+    BenchmarkResult result = runCase<T>(benchCase, items);
+    fprintf(stderr, "%-48s %12.0f items/s  p50 %8lldns  p99 %8lldns  p999 %9lldns%s\n",
+            result.name.c_str(), result.throughput,
+            (long long)result.p50, (long long)result.p99, (long long)result.p999,
+            result.orderError ? "  ORDER ERROR" : "");
+    results.push_back(result);
+}
+
+static void printJSON(std::vector<BenchmarkResult> &results){
+    printf("{\n  \"benchmark\": \"RecycleBuffer\",\n  \"results\": [\n");
+    for (size_t i = 0; i<results.size(); i++) {
+        BenchmarkResult &r = results[i];
+        printf("    {\"name\": \"%s\", \"queue\": \"%s\", \"blocking\": %s, \"sorted\": %s, \"payload\": \"%s\", "
+               "\"depth\": %d, \"ratio\": \"%s\", \"items\": %ld, \"seconds\": %.6f, \"throughput\": %.1f, "
+               "\"latency_ns\": {\"p50\": %lld, \"p99\": %lld, \"p999\": %lld, \"max\": %lld}, \"order_error\": %s}%s\n",
+               r.name.c_str(), r.benchCase.ring ? "ring" : "linked",
+               r.benchCase.blocking ? "true" : "false", r.benchCase.sorted ? "true" : "false",
+               r.payload, r.benchCase.depth, r.benchCase.ratio, r.items, r.seconds, r.throughput,
+               (long long)r.p50, (long long)r.p99, (long long)r.p999, (long long)r.maxLatency,
+               r.orderError ? "true" : "false", i+1 < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int main(int argc, char *argv[]){
+
+    long items = 200000;
+    bool quick = false;
+    const char *filter = nullptr;
+    
+    for (int i = 1; i<argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+            items = 20000;
+        }else if (strcmp(argv[i], "--items") == 0 && i+1 < argc) {
+            items = atol(argv[++i]);
+        }else if (strcmp(argv[i], "--filter") == 0 && i+1 < argc) {
+            filter = argv[++i];
+        }else{
+            fprintf(stderr, "usage: %s [--quick] [--items N] [--filter TEXT]\n", argv[0]);
+            return 1;
+        }
+    }
+    
+    std::vector<int> depths = quick ? std::vector<int>{16, 1024} : std::vector<int>{4, 16, 256, 2048};
+    
+    //producer:consumer speed, the slow side does 1us of work for every item.
+    struct{ int64_t producerWork; int64_t consumerWork; const char *ratio; } ratios[] = {
+        {0, 0, "1:1"},
+        {1000, 0, "slow-producer"},
+        {0, 1000, "slow-consumer"},
+    };
+    
+    std::vector<BenchmarkCase> cases;
+    for (int ring = 0; ring<2; ring++) {
+        for (int blocking = 1; blocking >= 0; blocking--) {
+            for (int sorted = 0; sorted < (ring ? 1 : 2); sorted++) {
+                for (int depth : depths) {
+                    for (auto &ratio : ratios) {
+                        cases.push_back({(bool)ring, (bool)blocking, (bool)sorted, depth, ratio.producerWork, ratio.consumerWork, ratio.ratio});
+                    }
+                }
+            }
+        }
+    }
+    
+    std::vector<BenchmarkResult> results;
+    for (BenchmarkCase &benchCase : cases) {
+        //slow cases are limited by the work, fewer items are enough.
+        long caseItems = (benchCase.producerWork || benchCase.consumerWork) ? std::max(items/10, 1L) : items;
+        
+        runFiltered<SmallPayload>(benchCase, caseItems, filter, results);
+        runFiltered<LargePayload>(benchCase, caseItems, filter, results);
+        runFiltered<HeapPayload>(benchCase, caseItems, filter, results);
+    }
+    
+    printJSON(results);
+    
+    for (BenchmarkResult &result : results) {
+        if (result.orderError) return 1;
+    }
+    return 0;
+}
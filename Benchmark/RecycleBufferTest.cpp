@@ -0,0 +1,339 @@
+//
+//  RecycleBufferTest.cpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/29.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+//Correctness checks of RecycleBuffer in ring and linked modes: ordered output, flush during a blocked getOut, budget accounting and observers.
+//Every failed check is printed to stderr, and it exits non-zero if any check failed.
+//
+//usage: RecycleBufferTest
+
+#include <stdio.h>
+#include <stdint.h>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include "RecycleBuffer.hpp"
+
+using namespace tfmpcore;
+
+static int failedCount = 0;
+
+#define TFMPCheck(cond, ...)\
+do{\
+    if (!(cond)) {\
+        failedCount++;\
+        fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__);\
+        fprintf(stderr, __VA_ARGS__);\
+        fprintf(stderr, "\n");\
+    }\
+}while(0)
+
+static const char *modeName(bool ring){
+    return ring ? "ring" : "linked";
+}
+
+#pragma mark - ordered output
+
+//The ring grows from its initial size on demand, so it's also resized while the consumer reads.
+static void testOrderedOutput(bool ring){
+    const int64_t items = 100000;
+    RecycleBuffer<int64_t> buffer(256, false, ring);
+    
+    std::thread producer([&]{
+        for (int64_t i = 0; i<items; i++) {
+            buffer.blockInsert(i);
+        }
+    });
+    
+    int64_t expectSeq = 0;
+    bool ordered = true;
+    for (int64_t i = 0; i<items; i++) {
+        int64_t val = -1;
+        buffer.blockGetOut(&val);
+        if (val != expectSeq) ordered = false;
+        expectSeq = val+1;
+    }
+    producer.join();
+    
+    TFMPCheck(ordered, "%s: values come out of order", modeName(ring));
+    TFMPCheck(buffer.isEmpty(), "%s: buffer isn't empty after getting out all values", modeName(ring));
+}
+
+static bool lessThan(int64_t &val, void *context){
+    return val < *(int64_t *)context;
+}
+
+static void testOrderedBatch(bool ring){
+    RecycleBuffer<int64_t> buffer(64, false, ring);
+    int64_t vals[64];
+    for (int64_t i = 0; i<64; i++) vals[i] = i;
+    
+    TFMPCheck(buffer.insertBatch(vals, 40) == 40, "%s: batch isn't inserted", modeName(ring));
+    
+    int64_t out[64];
+    int64_t bound = 10;
+    int count = buffer.drainWhile(out, 64, lessThan, &bound);
+    TFMPCheck(count == 10, "%s: drainWhile got %d values, expect 10", modeName(ring), count);
+    for (int i = 0; i<count; i++) {
+        TFMPCheck(out[i] == i, "%s: drained value %lld at %d", modeName(ring), (long long)out[i], i);
+    }
+    
+    count = buffer.drainUpTo(out, 64);
+    TFMPCheck(count == 30, "%s: drainUpTo got %d values, expect 30", modeName(ring), count);
+    TFMPCheck(count > 0 && out[0] == 10 && out[count-1] == 39, "%s: drainUpTo got the wrong values", modeName(ring));
+    
+    //a full buffer returns the rest to the caller after waiting.
+    TFMPCheck(buffer.insertBatch(vals, 60) == 60, "%s: batch isn't inserted after draining", modeName(ring));
+    count = buffer.blockInsertBatchFor(vals, 10, 0.05);
+    TFMPCheck(count == 4, "%s: timed batch inserted %d values into a full buffer, expect 4", modeName(ring), count);
+}
+
+#pragma mark - flush
+
+static void testFlushDuringBlockedGetOut(bool ring){
+    RecycleBuffer<int64_t> buffer(16, false, ring);
+    std::atomic<bool> returned(false);
+    bool got = true;
+    
+    std::thread consumer([&]{
+        int64_t val;
+        got = buffer.blockGetOutFor(&val, -1);
+        returned = true;
+    });
+    
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    buffer.flush();
+    
+    //give it a second, a hanging consumer is joined after the buffer is disabled.
+    for (int i = 0; i<100 && !returned; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    TFMPCheck(returned, "%s: blocked getOut doesn't return after flush", modeName(ring));
+    if (!returned) buffer.disableIO(true);
+    consumer.join();
+    
+    TFMPCheck(!got, "%s: blocked getOut got a value from the flushed buffer", modeName(ring));
+    
+    //the buffer works again after the flush.
+    int64_t val = -1;
+    TFMPCheck(buffer.insert(7) && buffer.getOut(&val) && val == 7, "%s: buffer doesn't work after flush", modeName(ring));
+}
+
+static std::atomic<int> freedCount(0);
+
+static void freeCounted(int64_t *){
+    freedCount++;
+}
+
+static void testFlushFreesValues(bool ring){
+    RecycleBuffer<int64_t> buffer(16, false, ring);
+    freedCount = 0;
+    buffer.valueFreeFunc = freeCounted;
+    for (int64_t i = 0; i<10; i++) buffer.insert(i);
+    buffer.flush();
+    
+    TFMPCheck(freedCount == 10, "%s: flush freed %d values, expect 10", modeName(ring), freedCount.load());
+    TFMPCheck(buffer.isEmpty(), "%s: buffer isn't empty after flush", modeName(ring));
+}
+
+//The values are marked instead of deleted, so a drain reading a value flush has freed is found.
+typedef struct{
+    std::atomic<bool> freed;
+    int drained;
+}DrainValue;
+
+static void markFreed(DrainValue **val){
+    (*val)->freed = true;
+}
+
+static bool readAlive(DrainValue *&val, void *context){
+    if (val->freed) {
+        ((std::atomic<int> *)context)->fetch_add(1);
+    }
+    return true;
+}
+
+static void testDrainDuringFlush(){
+    const int items = 200000;
+    RecycleBuffer<DrainValue *> buffer(64, false, true);
+    buffer.valueFreeFunc = markFreed;
+    
+    std::vector<DrainValue> values(items);
+    for (auto &value : values) {
+        value.freed = false;
+        value.drained = 0;
+    }
+    
+    std::atomic<bool> producing(true);
+    std::atomic<int> freedRead(0);
+    
+    std::thread producer([&]{
+        for (int i = 0; i<items; i++) {
+            while (!buffer.insert(&values[i])) {
+                std::this_thread::yield();
+            }
+        }
+        producing = false;
+    });
+    std::thread consumer([&]{
+        DrainValue *out[16];
+        while (producing || !buffer.isEmpty()) {
+            int count = buffer.drainWhile(out, 16, readAlive, &freedRead);
+            for (int i = 0; i<count; i++) out[i]->drained++;
+        }
+    });
+    
+    while (producing) {
+        buffer.flush();
+        std::this_thread::yield();
+    }
+    producer.join();
+    consumer.join();
+    
+    TFMPCheck(freedRead == 0, "ring: drain read %d values freed by flush", freedRead.load());
+    
+    //every value is either drained or freed by flush, once.
+    int lostCount = 0;
+    for (auto &value : values) {
+        if (value.drained + (value.freed ? 1 : 0) != 1) lostCount++;
+    }
+    TFMPCheck(lostCount == 0, "ring: %d values are lost or taken twice around flush", lostCount);
+}
+
+#pragma mark - budget
+
+static long measureBytes(int64_t &, void *){
+    return 100;
+}
+
+static void testBudget(bool ring){
+    RecycleBuffer<int64_t> buffer(64, false, ring);
+    buffer.valueBytesFunc = measureBytes;
+    buffer.setBudget({1000, 0});
+    TFMPCheck(buffer.getBudget().maxBytes == 1000, "%s: budget isn't kept", modeName(ring));
+    
+    int insertedCount = 0;
+    while (insertedCount < 20 && buffer.insert(insertedCount)) insertedCount++;
+    TFMPCheck(insertedCount == 10, "%s: %d values are inserted within the budget, expect 10", modeName(ring), insertedCount);
+    
+    buffer.setBudget({2000, 0});
+    TFMPCheck(buffer.insert(10), "%s: raised budget isn't used", modeName(ring));
+    buffer.flush();
+    TFMPCheck(buffer.getUsedBytes() == 0, "%s: used bytes is %ld after flush", modeName(ring), buffer.getUsedBytes());
+}
+
+//Flushing while both sides run mustn't make the measures drift.
+static void testBudgetDuringFlush(bool ring){
+    const int64_t items = 100000;
+    RecycleBuffer<int64_t> buffer(64, false, ring);
+    buffer.valueBytesFunc = measureBytes;
+    std::atomic<bool> producing(true);
+    
+    std::thread producer([&]{
+        for (int64_t i = 0; i<items; i++) {
+            while (!buffer.insert(i)) {
+                std::this_thread::yield();
+            }
+        }
+        producing = false;
+    });
+    std::thread consumer([&]{
+        int64_t val;
+        while (producing || !buffer.isEmpty()) {
+            buffer.getOut(&val);
+        }
+    });
+    
+    while (producing) {
+        buffer.flush();
+        std::this_thread::yield();
+    }
+    producer.join();
+    consumer.join();
+    
+    TFMPCheck(buffer.getUsedBytes() == 0, "%s: used bytes drifts to %ld around flush", modeName(ring), buffer.getUsedBytes());
+}
+
+#pragma mark - observers
+
+typedef struct{
+    int fired;
+    int lastSize;
+}ObserverRecord;
+
+static bool recordObserver(RecycleBuffer<int64_t> *, int curSize, bool, void *context){
+    ObserverRecord *record = (ObserverRecord *)context;
+    record->fired++;
+    record->lastSize = curSize;
+    return false;
+}
+
+static void testObserverFiring(bool ring){
+    RecycleBuffer<int64_t> buffer(64, false, ring);
+    ObserverRecord greater = {0, 0}, less = {0, 0};
+    buffer.addObserver(&greater, 8, true, recordObserver);
+    buffer.addObserver(&less, 4, false, recordObserver);
+    
+    int64_t val;
+    for (int64_t i = 0; i<10; i++) buffer.insert(i);
+    TFMPCheck(greater.fired == 1 && greater.lastSize == 9, "%s: greater observer fired %d times at %d", modeName(ring), greater.fired, greater.lastSize);
+    TFMPCheck(less.fired == 0, "%s: less observer fired %d times while growing", modeName(ring), less.fired);
+    
+    for (int i = 0; i<7; i++) buffer.getOut(&val);
+    TFMPCheck(less.fired == 1 && less.lastSize == 3, "%s: less observer fired %d times at %d", modeName(ring), less.fired, less.lastSize);
+    
+    //both are rearmed and fire again on the next crossing.
+    for (int64_t i = 0; i<6; i++) buffer.insert(i);
+    TFMPCheck(greater.fired == 2, "%s: greater observer isn't rearmed, fired %d times", modeName(ring), greater.fired);
+    for (int i = 0; i<6; i++) buffer.getOut(&val);
+    TFMPCheck(less.fired == 2, "%s: less observer isn't rearmed, fired %d times", modeName(ring), less.fired);
+    
+    buffer.removeObserver(&greater, 8, true);
+    for (int64_t i = 0; i<10; i++) buffer.insert(i);
+    TFMPCheck(greater.fired == 2, "%s: removed observer fired", modeName(ring));
+}
+
+//flush moves usedsize without checking, so an observer added after it can make the quiet range empty.
+static void testObserverAfterEmptyRange(bool ring){
+    RecycleBuffer<int64_t> buffer(64, false, ring);
+    ObserverRecord greater = {0, 0}, less = {0, 0};
+    
+    for (int64_t i = 0; i<10; i++) buffer.insert(i);
+    buffer.addObserver(&greater, 8, true, recordObserver);
+    buffer.flush();
+    buffer.addObserver(&less, 4, false, recordObserver);
+    
+    for (int64_t i = 0; i<10; i++) buffer.insert(i);
+    TFMPCheck(greater.fired == 1 && greater.lastSize == 9, "%s: greater observer fired %d times at %d after the range was empty", modeName(ring), greater.fired, greater.lastSize);
+    
+    int64_t val;
+    for (int i = 0; i<7; i++) buffer.getOut(&val);
+    TFMPCheck(less.fired == 1 && less.lastSize == 3, "%s: less observer fired %d times at %d after the range was empty", modeName(ring), less.fired, less.lastSize);
+}
+
+int main(){
+    
+    for (int ring = 0; ring<2; ring++) {
+        testOrderedOutput(ring);
+        testOrderedBatch(ring);
+        testFlushDuringBlockedGetOut(ring);
+        testFlushFreesValues(ring);
+        testBudget(ring);
+        testBudgetDuringFlush(ring);
+        testObserverFiring(ring);
+        testObserverAfterEmptyRange(ring);
+    }
+    testDrainDuringFlush();
+    
+    if (failedCount > 0) {
+        fprintf(stderr, "%d checks failed\n", failedCount);
+        return 1;
+    }
+    fprintf(stderr, "all checks passed\n");
+    return 0;
+}
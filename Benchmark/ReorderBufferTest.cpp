@@ -0,0 +1,120 @@
+//
+//  ReorderBufferTest.cpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/29.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+//Checks of ReorderBuffer: values in decoding order come out in pts order, and the held ones come out at the end of stream as VTBDecoder does.
+//Every failed check is printed to stderr, and it exits non-zero if any check failed.
+//
+//usage: ReorderBufferTest
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include "ReorderBuffer.hpp"
+
+using namespace tfmpcore;
+
+static int failedCount = 0;
+
+#define TFMPCheck(cond, ...)\
+do{\
+    if (!(cond)) {\
+        failedCount++;\
+        fprintf(stderr, "FAILED %s:%d: ", __FILE__, __LINE__);\
+        fprintf(stderr, __VA_ARGS__);\
+        fprintf(stderr, "\n");\
+    }\
+}while(0)
+
+static int64_t valueKey(int64_t &val){
+    return val;
+}
+
+static int freedCount = 0;
+
+static void freeCounted(int64_t *){
+    freedCount++;
+}
+
+//pts of an IBBP stream in decoding order, video_delay of it is 2.
+static const int64_t decodingOrder[] = {0, 3, 1, 2, 6, 4, 5, 9, 7, 8};
+static const int frameCount = sizeof(decodingOrder)/sizeof(decodingOrder[0]);
+
+#pragma mark - end of stream
+
+static void testHeldFramesAtEnd(){
+    ReorderBuffer<int64_t> buffer;
+    buffer.valueKeyFunc = valueKey;
+    buffer.setReorderDepth(2);
+    
+    std::vector<int64_t> output;
+    for (int i = 0; i<frameCount; i++) {
+        int64_t released;
+        if (buffer.push(decodingOrder[i], &released)) output.push_back(released);
+    }
+    TFMPCheck(buffer.size() == 2, "%d frames are held before the end, expect 2", buffer.size());
+    
+    //the end packet, like releaseReorderedFrames.
+    int64_t frame;
+    while (buffer.pop(&frame)) output.push_back(frame);
+    
+    TFMPCheck((int)output.size() == frameCount, "%d frames come out, expect %d", (int)output.size(), frameCount);
+    bool ordered = true;
+    for (int i = 0; i<(int)output.size(); i++) {
+        if (output[i] != i) ordered = false;
+    }
+    TFMPCheck(ordered, "frames come out of pts order");
+    TFMPCheck(buffer.size() == 0, "frames are left after the end");
+}
+
+//A stream whose video_delay is too small grows the depth, the late frames are still emitted at the end.
+static void testGrownDepthAtEnd(){
+    ReorderBuffer<int64_t> buffer;
+    buffer.valueKeyFunc = valueKey;
+    buffer.setReorderDepth(0);
+    
+    int outputCount = 0;
+    for (int i = 0; i<frameCount; i++) {
+        int64_t released;
+        if (buffer.push(decodingOrder[i], &released)) outputCount++;
+    }
+    TFMPCheck(buffer.getReorderDepth() > 0, "depth doesn't grow for frames out of order");
+    
+    int64_t frame;
+    while (buffer.pop(&frame)) outputCount++;
+    TFMPCheck(outputCount == frameCount, "%d frames come out with a grown depth, expect %d", outputCount, frameCount);
+}
+
+#pragma mark - flush
+
+static void testFlushFreesHeldFrames(){
+    ReorderBuffer<int64_t> buffer;
+    buffer.valueKeyFunc = valueKey;
+    buffer.valueFreeFunc = freeCounted;
+    buffer.setReorderDepth(4);
+    
+    freedCount = 0;
+    int64_t released;
+    for (int i = 0; i<3; i++) buffer.push(decodingOrder[i], &released);
+    buffer.flush();
+    TFMPCheck(freedCount == 3 && buffer.size() == 0, "flush freed %d frames, expect 3", freedCount);
+    TFMPCheck(!buffer.pop(&released), "a frame comes out after flushing");
+}
+
+int main(){
+    
+    testHeldFramesAtEnd();
+    testGrownDepthAtEnd();
+    testFlushFreesHeldFrames();
+    
+    if (failedCount > 0) {
+        fprintf(stderr, "%d checks failed\n", failedCount);
+        return 1;
+    }
+    fprintf(stderr, "all checks passed\n");
+    return 0;
+}
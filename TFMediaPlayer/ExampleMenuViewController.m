@@ -10,7 +10,6 @@
 #import "TFNetMp4PlayViewController.h"
 #import "TFLocalMp4ViewController.h"
 
-#import "UnitTest.h"
 #import "TFDebugStateShower.h"
 
 @interface ExampleMenuViewController (){
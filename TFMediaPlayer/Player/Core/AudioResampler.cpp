@@ -35,6 +35,7 @@ inline bool _isNeedResample(AVFrame *sourceFrame, TFMPAudioStreamDescription *de
 }
 
 bool AudioResampler::isNeedResample(AVFrame *sourceFrame){
+    if (speed.load(std::memory_order_relaxed) != 1 || compensating) return true;
     return _isNeedResample(sourceFrame,&adoptedAudioDesc);
 }
 
@@ -101,6 +102,14 @@ bool AudioResampler::reampleAudioFrame(AVFrame *inFrame, int *outSamples, int *l
         return nullptr;
     }
     
+    double curSpeed = speed.load(std::memory_order_relaxed);
+    if (curSpeed != 1 || compensating) {
+        int frameSamples = (int)av_rescale(inFrame->nb_samples, (int64_t)adoptedAudioDesc.sampleRate, inFrame->sample_rate);
+        int sampleDelta = curSpeed != 1 ? (int)(frameSamples/curSpeed) - frameSamples : 0;
+        swr_set_compensation(swrCtx, sampleDelta, sampleDelta ? frameSamples : 0);
+        compensating = sampleDelta != 0;
+    }
+    
 //    int nb_samples = (int)av_rescale_rnd(swr_get_delay(swrCtx, adoptedAudioDesc.sampleRate) + inFrame->nb_samples,adoptedAudioDesc.sampleRate, inFrame->sample_rate, AV_ROUND_UP);
     int nb_samples = swr_get_out_samples(swrCtx, inFrame->nb_samples);
     
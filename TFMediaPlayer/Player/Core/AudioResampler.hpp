@@ -10,6 +10,7 @@
 #define AudioResampler_hpp
 
 #include <stdio.h>
+#include <atomic>
 #include "TFMPUtilities.h"
 extern "C"{
 #include <libswresample/swresample.h>
@@ -28,6 +29,8 @@ namespace tfmpcore {
         TFMPAudioStreamDescription *lastSourceAudioDesc = nullptr;
         
         uint8_t *resampledBuffers1 = nullptr;
+        
+        bool compensating = false;
     public:
         ~AudioResampler(){
             freeResources();
@@ -38,6 +41,9 @@ namespace tfmpcore {
         
         TFMPAudioStreamDescription adoptedAudioDesc;
         
+        /** Play faster or slower by dropping or stretching samples, the pitch changes a little. Not for reampleAudioFrame2. */
+        std::atomic<double> speed{1};
+        
         bool isNeedResample(AVFrame *sourceFrame);
         
         bool reampleAudioFrame(AVFrame *inFrame, int *outSamples, int *linesize);
@@ -0,0 +1,123 @@
+//
+//  DecodeDegrader.hpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/20.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#ifndef DecodeDegrader_hpp
+#define DecodeDegrader_hpp
+
+#include <atomic>
+#include <stdint.h>
+
+#define TFMPDegradeLevelCount   6
+
+namespace tfmpcore {
+    
+    /** enterCount[i] counts the times level i was entered, frameCount[i] counts the frames decoded at level i. */
+    typedef struct{
+        int currentLevel;
+        uint64_t lateFrameCount;
+        uint64_t enterCount[TFMPDegradeLevelCount];
+        uint64_t frameCount[TFMPDegradeLevelCount];
+    }TFMPDegradeStats;
+    
+    /**
+     * Decide how much decoding work to skip from the lateness of displayed frames.
+     * The display thread reports every frame, the level goes up one step after escalateAfter late frames in a row,
+     * and goes down one step after recoverAfter frames on time in a row. The decode thread reads the level and applies it,
+     * what a level means is up to the decoder, higher levels skip more.
+     */
+    class DecodeDegrader{
+        
+        std::atomic<int> level;
+        std::atomic<bool> resetRequested;
+        
+        //only touched by the reporting thread.
+        int lateStreak = 0;
+        int onTimeStreak = 0;
+        
+        std::atomic<uint64_t> lateFrameCount;
+        std::atomic<uint64_t> enterCount[TFMPDegradeLevelCount];   //written by the reporting thread.
+        std::atomic<uint64_t> frameCount[TFMPDegradeLevelCount];   //written by the decode thread.
+        
+        static inline void addCounter(std::atomic<uint64_t> &counter){
+            counter.store(counter.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+        }
+        
+        void changeLevel(int newLevel){
+            level.store(newLevel, std::memory_order_relaxed);
+            addCounter(enterCount[newLevel]);
+            lateStreak = 0;
+            onTimeStreak = 0;
+        }
+    
+    public:
+    
+        bool enabled = true;
+        int maxLevel = TFMPDegradeLevelCount-1;
+        int escalateAfter = 4;
+        int recoverAfter = 60;
+        
+        DecodeDegrader():level(0),resetRequested(false),lateFrameCount(0){
+            for (int i = 0; i<TFMPDegradeLevelCount; i++) {
+                enterCount[i].store(0, std::memory_order_relaxed);
+                frameCount[i].store(0, std::memory_order_relaxed);
+            }
+        }
+        
+        /** Called by the display thread for every frame. A frame is late when it's dropped, on time when it's displayed before its time. */
+        void reportFrame(bool late, bool onTime){
+            if (resetRequested.exchange(false, std::memory_order_relaxed)) {
+                lateStreak = 0;
+                onTimeStreak = 0;
+            }
+            if (!enabled) {
+                return;
+            }
+            
+            int curLevel = level.load(std::memory_order_relaxed);
+            if (late) {
+                addCounter(lateFrameCount);
+                onTimeStreak = 0;
+                if (++lateStreak >= escalateAfter && curLevel < maxLevel) {
+                    changeLevel(curLevel+1);
+                }
+            }else if (onTime) {
+                lateStreak = 0;
+                if (++onTimeStreak >= recoverAfter && curLevel > 0) {
+                    changeLevel(curLevel-1);
+                }
+            }
+        }
+        
+        /** Forget the streaks, e.g. after seeking the first frames are late for a while but it says nothing about decoding speed. */
+        void resetStreaks(){
+            resetRequested.store(true, std::memory_order_relaxed);
+        }
+        
+        int getLevel(){
+            return level.load(std::memory_order_relaxed);
+        }
+        
+        /** Called by the decode thread for every decoded frame. */
+        void countFrame(int decodedLevel){
+            addCounter(frameCount[decodedLevel]);
+        }
+        
+        TFMPDegradeStats getStats(){
+            TFMPDegradeStats stats;
+            stats.currentLevel = level.load(std::memory_order_relaxed);
+            stats.lateFrameCount = lateFrameCount.load(std::memory_order_relaxed);
+            for (int i = 0; i<TFMPDegradeLevelCount; i++) {
+                stats.enterCount[i] = enterCount[i].load(std::memory_order_relaxed);
+                stats.frameCount[i] = frameCount[i].load(std::memory_order_relaxed);
+            }
+            return stats;
+        }
+    };
+}
+
+#endif /* DecodeDegrader_hpp */
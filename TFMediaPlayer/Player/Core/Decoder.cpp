@@ -7,6 +7,9 @@
 //
 
 #include "Decoder.hpp"
+extern "C"{
+#include <libavutil/pixdesc.h>
+}
 #include "TFMPDebugFuncs.h"
 #include "TFMPUtilities.h"
 #include <vector>
@@ -19,20 +22,65 @@
 
 using namespace tfmpcore;
 
-TFMPVideoFrameBuffer * Decoder::displayBufferFromFrame(TFMPFrame *tfmpFrame){
-    TFMPVideoFrameBuffer *displayFrame = new TFMPVideoFrameBuffer();
+#define TFMPAudioFramesBatchSize    16
+
+long Decoder::packetBytes(AVPacket *&pkt, void *context){
+    return pkt->size;
+}
+
+double Decoder::packetDuration(AVPacket *&pkt, void *context){
+    Decoder *decoder = (Decoder *)context;
+    return pkt->duration * av_q2d(decoder->timebase);
+}
+
+long Decoder::frameBytes(TFMPFrame *&tfmpFrame, void *context){
+    AVFrame *frame = tfmpFrame->frame;
+    
+    long size = 0;
+    for (int i = 0; i<AV_NUM_DATA_POINTERS; i++) {
+        if (frame->buf[i]) size += frame->buf[i]->size;
+    }
+    for (int i = 0; i<frame->nb_extended_buf; i++) {
+        size += frame->extended_buf[i]->size;
+    }
+    
+    return size;
+}
+
+double Decoder::frameDuration(TFMPFrame *&tfmpFrame, void *context){
+    Decoder *decoder = (Decoder *)context;
+    AVFrame *frame = tfmpFrame->frame;
+    
+    if (decoder->type == AVMEDIA_TYPE_AUDIO) {
+        return frame->sample_rate > 0 ? frame->nb_samples/(double)frame->sample_rate : 0;
+    }
+    return frame->pkt_duration * av_q2d(decoder->timebase);
+}
+
+void Decoder::fillDisplayBuffer(TFMPFrame *tfmpFrame){
+    TFMPVideoFrameBuffer *displayFrame = tfmpFrame->displayBuffer;
     
     AVFrame *frame = tfmpFrame->frame;
     displayFrame->width = frame->width;
-    //TODO: when should i cut one line of data to avoid the green data-empty zone in bottom?
-    displayFrame->height = frame->height-1;
+    displayFrame->height = frame->height;
+    displayFrame->planes = av_pix_fmt_count_planes((AVPixelFormat)frame->format);
     
     for (int i = 0; i<AV_NUM_DATA_POINTERS; i++) {
         
-        displayFrame->pixels[i] = frame->data[i]+frame->linesize[i];
+        displayFrame->pixels[i] = frame->data[i];
         displayFrame->linesize[i] = frame->linesize[i];
     }
     
+    //the codec has applied the cropping it could, the rest is left to sinks.
+    displayFrame->cropLeft = (int)frame->crop_left;
+    displayFrame->cropTop = (int)frame->crop_top;
+    displayFrame->cropRight = (int)frame->crop_right;
+    displayFrame->cropBottom = (int)frame->crop_bottom;
+    
+    displayFrame->opaque = frame;
+    displayFrame->retainFunc = retainDisplayBuffer;
+    displayFrame->releaseFunc = releaseDisplayBuffer;
+    
     //TODO: unsupport format
     if (frame->format == AV_PIX_FMT_YUV420P) {
         displayFrame->format = TFMP_VIDEO_PIX_FMT_YUV420P;
@@ -43,22 +91,108 @@ TFMPVideoFrameBuffer * Decoder::displayBufferFromFrame(TFMPFrame *tfmpFrame){
     }else if (frame->format == AV_PIX_FMT_RGB32){
         displayFrame->format = TFMP_VIDEO_PIX_FMT_RGB32;
     }
+}
+
+TFMPVideoFrameBuffer *Decoder::retainDisplayBuffer(TFMPVideoFrameBuffer *frameBuf){
+    AVFrame *frame = av_frame_clone((AVFrame *)frameBuf->opaque);
+    if (frame == nullptr) {
+        return nullptr;
+    }
     
-    return displayFrame;
+    //the clone refers to the same buffers, so the pixel pointers stay valid.
+    TFMPVideoFrameBuffer *retained = new TFMPVideoFrameBuffer(*frameBuf);
+    retained->opaque = frame;
+    return retained;
+}
+
+void Decoder::releaseDisplayBuffer(TFMPVideoFrameBuffer *frameBuf){
+    AVFrame *frame = (AVFrame *)frameBuf->opaque;
+    av_frame_free(&frame);
+    delete frameBuf;
+}
+
+bool Decoder::canPackAudioFrame(AVFrame *frame){
+    if (frame->format != audioChunk->format || frame->sample_rate != audioChunk->sample_rate ||
+        frame->channels != audioChunk->channels || frame->channel_layout != audioChunk->channel_layout) {
+        return false;
+    }
+    if (audioChunkCapacity - audioChunkSamples < frame->nb_samples) {
+        return false;
+    }
+    
+    //the chunk has only one pts, a frame after a gap starts a new chunk to keep its own.
+    if (frame->pts != AV_NOPTS_VALUE && audioChunk->pts != AV_NOPTS_VALUE) {
+        int64_t offset = av_rescale_q(frame->pts - audioChunk->pts, timebase, AVRational{1, frame->sample_rate});
+        if (llabs(offset - audioChunkSamples) > frame->nb_samples/2) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+void Decoder::packAudioFrame(AVFrame *frame){
+    if (audioChunkSamples > 0 && !canPackAudioFrame(frame)) {
+        handOffAudioChunk();
+    }
+    
+    if (audioChunkSamples == 0) {
+        audioChunk->format = frame->format;
+        audioChunk->sample_rate = frame->sample_rate;
+        audioChunk->channels = frame->channels;
+        audioChunk->channel_layout = frame->channel_layout;
+        audioChunk->nb_samples = std::max((int)(decoderConfig.audioChunkDuration*frame->sample_rate), frame->nb_samples);
+        if (av_frame_get_buffer(audioChunk, 0) < 0) {
+            av_frame_unref(audioChunk);
+            frameBuffer.blockInsert(tfmpFrameFromAVFrame(frame, true));
+            return;
+        }
+        audioChunkCapacity = audioChunk->nb_samples;
+        audioChunk->pts = frame->pts;
+    }
+    
+    int frameSamples = frame->nb_samples;
+    av_samples_copy(audioChunk->extended_data, frame->extended_data, audioChunkSamples, 0, frameSamples, frame->channels, (AVSampleFormat)frame->format);
+    audioChunkSamples += frameSamples;
+    av_frame_unref(frame);
+    
+    //the next frame is likely as large as this one.
+    if (audioChunkCapacity - audioChunkSamples < frameSamples) {
+        handOffAudioChunk();
+    }
+}
+
+void Decoder::handOffAudioChunk(){
+    audioChunk->nb_samples = audioChunkSamples;
+    //the buffer is larger than the samples, and the displayer copies packed samples by linesize.
+    av_samples_get_buffer_size(&audioChunk->linesize[0], audioChunk->channels, audioChunkSamples, (AVSampleFormat)audioChunk->format, 1);
+    audioChunkSamples = 0;
+    
+    //the references are moved out, audioChunk is empty for the next chunk.
+    frameBuffer.blockInsert(tfmpFrameFromAVFrame(audioChunk, true));
 }
 
 TFMPFrame * Decoder::tfmpFrameFromAVFrame(AVFrame *frame, bool isAudio){
-    TFMPFrame *tfmpFrame = new TFMPFrame();
+    TFMPFrame *tfmpFrame = framePool->acquire();
     
-    tfmpFrame->frame  = frame;
+    //moving doesn't allocate new buffer refs as av_frame_ref does.
+    av_frame_move_ref(tfmpFrame->frame, frame);
     tfmpFrame->type = isAudio ? TFMPFrameTypeAudio:TFMPFrameTypeVideo;
     tfmpFrame->freeFrameFunc = Decoder::freeFrame;
-    tfmpFrame->pts = frame->pts;
-    tfmpFrame->displayBuffer = displayBufferFromFrame(tfmpFrame);
+    tfmpFrame->pts = tfmpFrame->frame->pts;
+    if (!isAudio) fillDisplayBuffer(tfmpFrame);
     
     return tfmpFrame;
 }
 
+bool Decoder::canDecode(AVStream *stream){
+    return avcodec_find_decoder(stream->codecpar->codec_id) != nullptr;
+}
+
+MediaDecoder *Decoder::create(AVFormatContext *fmtCtx, int streamIndex, AVMediaType type){
+    return new Decoder(fmtCtx, streamIndex, type);
+}
+
 bool Decoder::prepareDecode(){
     AVCodec *codec = avcodec_find_decoder(fmtCtx->streams[steamIndex]->codecpar->codec_id);
     if (codec == nullptr) {
@@ -73,6 +207,9 @@ bool Decoder::prepareDecode(){
     }
     
     avcodec_parameters_to_context(codecCtx, fmtCtx->streams[steamIndex]->codecpar);
+    timebase = fmtCtx->streams[steamIndex]->time_base;
+    
+    applyDecoderConfig();
     
     int retval = avcodec_open2(codecCtx, codec, NULL);
     if (retval < 0) {
@@ -80,6 +217,20 @@ bool Decoder::prepareDecode(){
         return false;
     }
     
+    if (codecCtx->active_thread_type & FF_THREAD_FRAME) {
+        threadInfo.activeType = TFMPDecodeThreadFrame;
+    }else if (codecCtx->active_thread_type & FF_THREAD_SLICE){
+        threadInfo.activeType = TFMPDecodeThreadSlice;
+    }else{
+        threadInfo.activeType = TFMPDecodeThreadNone;
+    }
+    threadInfo.threadCount = threadInfo.activeType == TFMPDecodeThreadNone ? 1 : codecCtx->thread_count;
+    TFMPDLOG_C("%s threads: %d type: %d\n", name.c_str(), threadInfo.threadCount, threadInfo.activeType);
+    
+    if (type == AVMEDIA_TYPE_AUDIO && decoderConfig.audioChunkDuration > 0 && audioChunk == nullptr) {
+        audioChunk = av_frame_alloc();
+    }
+    
 #if DEBUG
     if (type == AVMEDIA_TYPE_AUDIO) {
         strcpy(frameBuffer.name, "audio_frame");
@@ -95,12 +246,127 @@ bool Decoder::prepareDecode(){
     
     shouldDecode = true;
     
+    if (framePool == nullptr) framePool = new TFMPFramePool(true);
+    
     pktBuffer.valueFreeFunc = freePacket;
     frameBuffer.valueFreeFunc = freeFrame;
     
+    pktBuffer.valueBytesFunc = packetBytes;
+    pktBuffer.valueDurationFunc = packetDuration;
+    pktBuffer.measureContext = this;
+    
+    frameBuffer.valueBytesFunc = frameBytes;
+    frameBuffer.valueDurationFunc = frameDuration;
+    frameBuffer.measureContext = this;
+    
+    reserveBuffers();
+    
     return true;
 }
 
+/* Frame threading keeps all cores busy but holds threadCount-1 frames, it suits VOD with large frames.
+ * Live streams and low delay need frames out at once, so they use slice threading.
+ * Other streams let FFmpeg choose, it prefers frame threading when the codec supports it.
+ */
+int Decoder::autoThreadType(AVFormatContext *fmtCtx, AVStream *stream, bool lowDelay){
+    bool isLive = fmtCtx->duration == AV_NOPTS_VALUE || fmtCtx->duration <= 0;
+    if (isLive || lowDelay) {
+        return FF_THREAD_SLICE;
+    }
+    
+    AVCodecParameters *codecpar = stream->codecpar;
+    if (codecpar->codec_type == AVMEDIA_TYPE_VIDEO && codecpar->width*codecpar->height >= 1280*720) {
+        return FF_THREAD_FRAME;
+    }
+    return FF_THREAD_FRAME | FF_THREAD_SLICE;
+}
+
+/* Degrade levels, from skipping deblocking of frames that nothing refers to, to skipping B-frames and
+ * the IDCT of all frames but key frames. Skipping referenced work leaves artifacts until the next key frame.
+ */
+static const struct{
+    AVDiscard loopFilter;
+    AVDiscard frame;
+    AVDiscard idct;
+}degradeLevels[TFMPDegradeLevelCount] = {
+    {AVDISCARD_DEFAULT, AVDISCARD_DEFAULT, AVDISCARD_DEFAULT},
+    {AVDISCARD_NONREF,  AVDISCARD_DEFAULT, AVDISCARD_DEFAULT},
+    {AVDISCARD_ALL,     AVDISCARD_DEFAULT, AVDISCARD_DEFAULT},
+    {AVDISCARD_ALL,     AVDISCARD_NONREF,  AVDISCARD_DEFAULT},
+    {AVDISCARD_ALL,     AVDISCARD_BIDIR,   AVDISCARD_DEFAULT},
+    {AVDISCARD_ALL,     AVDISCARD_BIDIR,   AVDISCARD_NONKEY},
+};
+
+void Decoder::applySkipOptions(int degradeLevel, bool seekSkipping){
+    codecCtx->skip_loop_filter = degradeLevels[degradeLevel].loopFilter;
+    codecCtx->skip_frame = degradeLevels[degradeLevel].frame;
+    codecCtx->skip_idct = degradeLevels[degradeLevel].idct;
+    if (seekSkipping && codecCtx->skip_frame < AVDISCARD_NONREF) {
+        codecCtx->skip_frame = AVDISCARD_NONREF;
+    }
+    
+    if (degradeLevel != appliedDegradeLevel) {
+        TFMPDLOG_C("%s degrade level: %d\n", name.c_str(), degradeLevel);
+    }
+    appliedDegradeLevel = degradeLevel;
+    appliedSeekSkipping = seekSkipping;
+}
+
+void Decoder::applyDecoderConfig(){
+    if (decoderConfig.threadType == TFMPDecodeThreadNone) {
+        codecCtx->thread_count = 1;
+    }else{
+        codecCtx->thread_count = decoderConfig.threadCount;
+        
+        if (decoderConfig.threadType == TFMPDecodeThreadFrame) {
+            codecCtx->thread_type = FF_THREAD_FRAME;
+        }else if (decoderConfig.threadType == TFMPDecodeThreadSlice){
+            codecCtx->thread_type = FF_THREAD_SLICE;
+        }else{
+            codecCtx->thread_type = autoThreadType(fmtCtx, fmtCtx->streams[steamIndex], decoderConfig.lowDelay);
+        }
+    }
+    
+    if (decoderConfig.lowDelay) codecCtx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    if (decoderConfig.fast) codecCtx->flags2 |= AV_CODEC_FLAG2_FAST;
+}
+
+void Decoder::reserveBuffers(){
+    AVStream *stream = fmtCtx->streams[steamIndex];
+    
+    RecycleBufferBudget packetBudget = pktBuffer.getBudget();
+    pktBuffer.reserve(valueCountForDuration(stream, std::max(packetBudget.maxDuration, 1.0)));
+    
+    RecycleBufferBudget frameBudget = frameBuffer.getBudget();
+    long frameCount = 0;
+    if (frameBudget.maxDuration > 0) {
+        frameCount = valueCountForDuration(stream, frameBudget.maxDuration);
+    }else if (frameBudget.maxBytes > 0 && type == AVMEDIA_TYPE_VIDEO){
+        long frameBytes = stream->codecpar->width*stream->codecpar->height*3/2;
+        if (frameBytes > 0) frameCount = frameBudget.maxBytes/frameBytes;
+    }
+    frameBuffer.reserve(frameCount);
+}
+
+void Decoder::setBufferBudget(RecycleBufferBudget packetBudget, RecycleBufferBudget frameBudget){
+    pktBuffer.setBudget(packetBudget);
+    frameBuffer.setBudget(frameBudget);
+}
+
+void Decoder::releaseUnusedMemory(){
+    pktBuffer.releaseUnused();
+    frameBuffer.releaseUnused();
+    if (framePool) framePool->trim();
+}
+
+RecycleBufferAllocStats Decoder::packetAllocStats(){
+    return pktBuffer.getAllocStats();
+}
+
+RecycleBufferAllocStats Decoder::frameAllocStats(){
+    return frameBuffer.getAllocStats();
+}
+
 void Decoder::startDecode(){
     pthread_create(&decodeThread, NULL, decodeLoop, this);
     pthread_detach(decodeThread);
@@ -139,9 +405,14 @@ void Decoder::flush(){
     pthread_mutex_unlock(&waitLoopMutex);
     myStateObserver.mark(stateName, 5);
     
+    degrader.resetStreaks();
+    resetFailures();
+    
     //4. flush all reserved buffers
     pktBuffer.flush();
     myStateObserver.mark(stateName, 6);
+    if (audioChunk) av_frame_unref(audioChunk);
+    audioChunkSamples = 0;
     frameBuffer.flush();
     myStateObserver.mark(stateName, 7);
     
@@ -188,6 +459,14 @@ void Decoder::freeResources(){
     frameBuffer.flush();
     myStateObserver.mark(name+" free", 5);
     if (codecCtx) avcodec_free_context(&codecCtx);
+    if (audioChunk) av_frame_free(&audioChunk);
+    audioChunkSamples = 0;
+    
+    //frames still held by the displayer come back later, the pool is deleted after them.
+    if (framePool) {
+        framePool->close();
+        framePool = nullptr;
+    }
     
     fmtCtx = nullptr;
 }
@@ -196,6 +475,10 @@ void Decoder::insertPacket(AVPacket *packet){
     pktBuffer.blockInsert(packet);
 }
 
+int Decoder::insertPackets(AVPacket **packets, int count, double timeout){
+    return pktBuffer.blockInsertBatchFor(packets, count, timeout);
+}
+
 void *Decoder::decodeLoop(void *context){
     
     Decoder *decoder = (Decoder *)context;
@@ -232,21 +515,33 @@ void *Decoder::decodeLoop(void *context){
         myStateObserver.mark(name, 2);
         decoder->pktBuffer.blockGetOut(&pkt);
         myStateObserver.mark(name, 3);
-
+        
         if (pkt == nullptr) continue;
         
         myStateObserver.mark(name, 4);
+        if (decoder->type == AVMEDIA_TYPE_VIDEO) {
+            int degradeLevel = decoder->degrader.getLevel();
+            bool seekSkipping = decoder->mediaTimeFilter->isBeforeTarget(pkt);
+            if (degradeLevel != decoder->appliedDegradeLevel || seekSkipping != decoder->appliedSeekSkipping) {
+                decoder->applySkipOptions(degradeLevel, seekSkipping);
+            }
+        }
+        
         int retval = avcodec_send_packet(decoder->codecCtx, pkt);
         if (retval < 0) {
             TFCheckRetval("avcodec send packet");
+            if (retval != AVERROR_EOF) decoder->countDecodeResult(false);
             
-            av_packet_free(&pkt);
+            TFMPPacketPool::release(&pkt);
             continue;
         }
         
         if (decoder->type == AVMEDIA_TYPE_AUDIO) {
             
-            //may many frames in one packet.
+            //may many frames in one packet, hand them off together.
+            TFMPFrame *decodedFrames[TFMPAudioFramesBatchSize];
+            int decodedCount = 0;
+            
             while (retval == 0) {
                 myStateObserver.mark(name, 6);
                 retval = avcodec_receive_frame(decoder->codecCtx, frame);
@@ -256,9 +551,11 @@ void *Decoder::decodeLoop(void *context){
                 
                 if (retval != 0 && retval != AVERROR_EOF) {
                     TFCheckRetval("avcodec receive frame");
+                    decoder->countDecodeResult(false);
                     av_frame_unref(frame);
                     continue;
                 }
+                decoder->countDecodeResult(true);
                 if (frame->extended_data == nullptr) {
                     printf("audio frame data is null\n");
                     av_frame_unref(frame);
@@ -271,19 +568,34 @@ void *Decoder::decodeLoop(void *context){
                 }
                 myStateObserver.mark(name, 7);
                 if (decoder->shouldDecode) {
-                    AVFrame *refFrame = av_frame_alloc();
-                    av_frame_ref(refFrame, frame);
 //                    av_usleep(50000);
                     myStateObserver.mark(name, 8);
                     if (decoder->frameBuffer.isEmpty()) {
-                        myStateObserver.labelMark("audio first", to_string(refFrame->pts*av_q2d(decoder->timebase)));
+                        myStateObserver.labelMark("audio first", to_string(frame->pts*av_q2d(decoder->timebase)));
+                    }
+                    if (decoder->audioChunk) {
+                        decoder->packAudioFrame(frame);
+                        continue;
+                    }
+                    
+                    decodedFrames[decodedCount++] = decoder->tfmpFrameFromAVFrame(frame, true);
+                    if (decodedCount == TFMPAudioFramesBatchSize) {
+                        decoder->frameBuffer.blockInsertBatch(decodedFrames, decodedCount);
+                        decodedCount = 0;
                     }
-                    decoder->frameBuffer.blockInsert(tfmpFrameFromAVFrame(refFrame, true));
                     
                 }else{
                     av_frame_unref(frame);
                 }
             }
+            
+            if (decodedCount > 0) {
+                decoder->frameBuffer.blockInsertBatch(decodedFrames, decodedCount);
+            }
+            //don't hold the samples while waiting for packets, e.g. at the end of the stream.
+            if (decoder->audioChunkSamples > 0 && decoder->shouldDecode && decoder->pktBuffer.isEmpty()) {
+                decoder->handOffAudioChunk();
+            }
         }else{
             
             //frame type: i p     b b b b            p                b b              p
@@ -303,6 +615,7 @@ void *Decoder::decodeLoop(void *context){
                     break;
                 }else if (retval != 0) {  //other error
                     TFCheckRetval("avcodec receive frame");
+                    if (retval != AVERROR_EOF) decoder->countDecodeResult(false);
                     delayFramesReleasing = false;
                     av_frame_unref(frame);
                     break;
@@ -313,8 +626,9 @@ void *Decoder::decodeLoop(void *context){
                     delayFramesReleasing = true;
                     frameDelay = false;
                 }
+                decoder->countDecodeResult(true);
+                
                 
-
                 
                 if (frame->extended_data == nullptr) {
                     printf("video frame data is null\n");
@@ -329,13 +643,12 @@ void *Decoder::decodeLoop(void *context){
                 }
                 
                 if (decoder->shouldDecode) {
-                    AVFrame *refFrame = av_frame_alloc();
-                    av_frame_ref(refFrame, frame);
                     if (decoder->frameBuffer.isEmpty()) {
-                        myStateObserver.labelMark("video first", to_string(refFrame->pts*av_q2d(decoder->timebase)));
+                        myStateObserver.labelMark("video first", to_string(frame->pts*av_q2d(decoder->timebase)));
                     }
                     
-                    decoder->frameBuffer.blockInsert(tfmpFrameFromAVFrame(refFrame, false));
+                    decoder->degrader.countFrame(decoder->appliedDegradeLevel);
+                    decoder->frameBuffer.blockInsert(decoder->tfmpFrameFromAVFrame(frame, false));
                     
                 }else{
                     av_frame_unref(frame);
@@ -343,7 +656,7 @@ void *Decoder::decodeLoop(void *context){
             } while (delayFramesReleasing);
         }
         
-        if (pkt != nullptr)  av_packet_free(&pkt);
+        if (pkt != nullptr)  TFMPPacketPool::release(&pkt);
     }
     
     myStateObserver.mark(name, 9);
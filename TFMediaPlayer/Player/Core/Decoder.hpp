@@ -17,24 +17,59 @@ extern "C"{
 }
 
 #include "TFMPFrame.h"
+#include "TFMPFramePool.hpp"
+#include "TFMPPacketPool.hpp"
+#include "DecodeDegrader.hpp"
 #include "RecycleBuffer.hpp"
 #include <pthread.h>
 #include "TFMPAVFormat.h"
 #include <vector>
 #include "MediaTimeFilter.hpp"
+#include "MediaDecoder.hpp"
+#include "DecoderRegistry.hpp"
 
 namespace tfmpcore {
     
-    class Decoder{
+    /** Software decoding by FFmpeg, for any stream FFmpeg supports. */
+    class Decoder : public MediaDecoder{
         
         AVFormatContext *fmtCtx;
         int steamIndex;
         
-        AVCodecContext *codecCtx;
+        AVCodecContext *codecCtx = nullptr;
         
-        RecycleBuffer<AVPacket*> pktBuffer = RecycleBuffer<AVPacket*>(2000, true);
+        AVRational timebase;
         
-        RecycleBuffer<TFMPFrame*> frameBuffer = RecycleBuffer<TFMPFrame *>(30, true);
+        //read thread -> decode loop, decode loop -> display loop or audio callback. Both have one producer and one consumer.
+        //The node counts are only the upper limits, the real limits come from budgets.
+        //Storages are reserved from stream metadata when preparing and grow or shrink with the occupancy.
+        RecycleBuffer<AVPacket*> pktBuffer{2000, false, true};
+        
+        RecycleBuffer<TFMPFrame*> frameBuffer{64, false, true};
+        
+        /** Reserve the buffers for their budgets with the rate and size of the stream. */
+        void reserveBuffers();
+        
+        TFMPDecoderConfig decoderConfig = {0, TFMPDecodeThreadAuto, false, false, 0};
+        TFMPDecodeThreadInfo threadInfo = {TFMPDecodeThreadNone, 1};
+        void applyDecoderConfig();
+        static int autoThreadType(AVFormatContext *fmtCtx, AVStream *stream, bool lowDelay);
+        
+        //Video frames skip decoding work when they are displayed late, the level is applied on the decode thread.
+        DecodeDegrader degrader;
+        int appliedDegradeLevel = 0;
+        //After seeking, frames before the target which nothing refers to are not decoded.
+        bool appliedSeekSkipping = false;
+        void applySkipOptions(int degradeLevel, bool seekSkipping);
+        
+        //Small audio frames, e.g. 1024 samples of AAC, are packed into chunks, so the audio path handles fewer frames.
+        //The chunk is handed off when it's full, when the next frame doesn't follow it or when packets run out.
+        AVFrame *audioChunk = nullptr;
+        int audioChunkSamples = 0;
+        int audioChunkCapacity = 0;
+        bool canPackAudioFrame(AVFrame *frame);
+        void packAudioFrame(AVFrame *frame);
+        void handOffAudioChunk();
         
         pthread_t decodeThread;
         static void *decodeLoop(void *context);
@@ -52,26 +87,40 @@ namespace tfmpcore {
         pthread_mutex_t pauseMutex = PTHREAD_MUTEX_INITIALIZER;
         
         inline static void freePacket(AVPacket **pkt){
-            av_packet_free(pkt);
+            TFMPPacketPool::release(pkt);
         }
         
+        //Decoded frames are acquired from it on the decode thread and go back to it when they are freed.
+        TFMPFramePool *framePool = nullptr;
+        
         inline static void freeFrame(TFMPFrame **tfmpFrameP){
             TFMPFrame *tfmpFrame = *tfmpFrameP;
-            av_frame_free(&tfmpFrame->frame);
-            
-            delete tfmpFrame->displayBuffer;
-            
-            delete tfmpFrame;
+            av_frame_unref(tfmpFrame->frame);
+            TFMPFramePool::recycle(tfmpFrame);
             *tfmpFrameP = nullptr;
         }
         
-        static TFMPVideoFrameBuffer *displayBufferFromFrame(TFMPFrame *tfmpFrame);
-        static TFMPFrame *tfmpFrameFromAVFrame(AVFrame *frame, bool isAudio);
+        static long packetBytes(AVPacket *&pkt, void *context);
+        static double packetDuration(AVPacket *&pkt, void *context);
+        static long frameBytes(TFMPFrame *&tfmpFrame, void *context);
+        static double frameDuration(TFMPFrame *&tfmpFrame, void *context);
+        
+        static void fillDisplayBuffer(TFMPFrame *tfmpFrame);
+        //A retained display buffer holds its own reference of the AVFrame's buffers in opaque.
+        static TFMPVideoFrameBuffer *retainDisplayBuffer(TFMPVideoFrameBuffer *frameBuf);
+        static void releaseDisplayBuffer(TFMPVideoFrameBuffer *frameBuf);
+        /** Get a frame from the pool and move the references of frame into it. */
+        TFMPFrame *tfmpFrameFromAVFrame(AVFrame *frame, bool isAudio);
+        
+        static bool canDecode(AVStream *stream);
+        static MediaDecoder *create(AVFormatContext *fmtCtx, int streamIndex, AVMediaType type);
         
     public:
-        string name;
-        AVMediaType type;
-        Decoder(AVFormatContext *fmtCtx, int steamIndex, AVMediaType type):fmtCtx(fmtCtx),steamIndex(steamIndex),type(type){};
+        Decoder(AVFormatContext *fmtCtx, int steamIndex, AVMediaType type):MediaDecoder(type),fmtCtx(fmtCtx),steamIndex(steamIndex){};
+        
+        static TFMPDecoderBackend backend(){
+            return {"FFmpeg", canDecode, create};
+        }
         
         ~Decoder(){
             freeResources();
@@ -81,7 +130,26 @@ namespace tfmpcore {
             return &frameBuffer;
         };
         
-        MediaTimeFilter *mediaTimeFilter;
+        /** Limit the packet and frame buffers by bytes and media duration. */
+        void setBufferBudget(RecycleBufferBudget packetBudget, RecycleBufferBudget frameBudget);
+        
+        /** Threading and codec flags of software decoding, it takes effect in prepareDecode. */
+        void setDecoderConfig(TFMPDecoderConfig config){
+            decoderConfig = config;
+        }
+        TFMPDecodeThreadInfo getThreadInfo(){
+            return threadInfo;
+        }
+        
+        /** Report the lateness of displayed frames to it. */
+        DecodeDegrader *getDegrader(){
+            return &degrader;
+        }
+        
+        /** Free the unused storages of the buffers, e.g. on memory warning. */
+        void releaseUnusedMemory();
+        RecycleBufferAllocStats packetAllocStats();
+        RecycleBufferAllocStats frameAllocStats();
         
         bool prepareDecode();
         
@@ -89,6 +157,8 @@ namespace tfmpcore {
         void stopDecode();
         
         void insertPacket(AVPacket *packet);
+        /** Insert a run of packets with one synchronisation. */
+        int insertPackets(AVPacket **packets, int count, double timeout);
         
         void activeBlock(bool flag);
         void flush();
@@ -96,11 +166,32 @@ namespace tfmpcore {
         
         bool bufferIsEmpty();
         
+        /** The media duration of packets and frames waiting to display, unit is second. */
+        double bufferedDuration(){
+            return pktBuffer.getUsedDuration() + frameBuffer.getUsedDuration();
+        }
+        
+        /** The reading thread will be blocked by this decoder. */
+        bool packetBufferIsFull(){
+            return pktBuffer.isFull();
+        }
         
+        /** The decode loop is waiting for packets. */
+        bool packetBufferIsEmpty(){
+            return pktBuffer.isEmpty();
+        }
         
-#if DEBUG
-        AVRational timebase;
-#endif
+        RecycleBufferTelemetry packetTelemetry(){
+            return pktBuffer.telemetry();
+        }
+        
+        RecycleBufferTelemetry frameTelemetry(){
+            return frameBuffer.telemetry();
+        }
+        
+        TFMPFramePoolStats framePoolStats(){
+            return framePool ? framePool->getStats() : TFMPFramePoolStats{0, 0};
+        }
         
     };
 }
@@ -0,0 +1,72 @@
+//
+//  DecoderRegistry.cpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/24.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#include "DecoderRegistry.hpp"
+#include "TFMPDebugFuncs.h"
+#include "Decoder.hpp"
+#if EnableVTBDecode
+#include "VTBDecoder.h"
+#endif
+#include <string.h>
+
+using namespace tfmpcore;
+
+pthread_mutex_t DecoderRegistry::mutex = PTHREAD_MUTEX_INITIALIZER;
+
+std::vector<TFMPDecoderBackend> *DecoderRegistry::backends(){
+    static std::vector<TFMPDecoderBackend> *backends = new std::vector<TFMPDecoderBackend>{
+#if EnableVTBDecode
+        VTBDecoder::backend(),
+#endif
+        Decoder::backend(),
+    };
+    return backends;
+}
+
+void DecoderRegistry::registerBackend(TFMPDecoderBackend backend, bool preferred){
+    pthread_mutex_lock(&mutex);
+    
+    std::vector<TFMPDecoderBackend> *list = backends();
+    for (auto iter = list->begin(); iter != list->end(); iter++) {
+        if (strcmp(iter->name, backend.name) == 0) {
+            list->erase(iter);
+            break;
+        }
+    }
+    list->insert(preferred ? list->begin() : list->end(), backend);
+    
+    pthread_mutex_unlock(&mutex);
+}
+
+void DecoderRegistry::unregisterBackend(const char *name){
+    pthread_mutex_lock(&mutex);
+    
+    std::vector<TFMPDecoderBackend> *list = backends();
+    for (auto iter = list->begin(); iter != list->end(); iter++) {
+        if (strcmp(iter->name, name) == 0) {
+            list->erase(iter);
+            break;
+        }
+    }
+    
+    pthread_mutex_unlock(&mutex);
+}
+
+std::vector<TFMPDecoderBackend> DecoderRegistry::backendsForStream(AVStream *stream){
+    std::vector<TFMPDecoderBackend> result;
+    
+    pthread_mutex_lock(&mutex);
+    for (auto &backend : *backends()) {
+        if (backend.canDecode(stream)) {
+            result.push_back(backend);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    
+    return result;
+}
@@ -0,0 +1,52 @@
+//
+//  DecoderRegistry.hpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/24.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#ifndef DecoderRegistry_hpp
+#define DecoderRegistry_hpp
+
+extern "C"{
+#include <libavformat/avformat.h>
+}
+
+#include <pthread.h>
+#include <vector>
+#include "MediaDecoder.hpp"
+
+namespace tfmpcore {
+    
+    /** A way to decode streams. */
+    typedef struct{
+        const char *name;
+        //whether it's able to decode the stream, by its codec, resolution and the capability of the device.
+        bool (*canDecode)(AVStream *stream);
+        MediaDecoder *(*create)(AVFormatContext *fmtCtx, int streamIndex, AVMediaType type);
+    }TFMPDecoderBackend;
+    
+    /**
+     * The backends to decode streams with, in the order of trying. The built-in ones are VideoToolBox, if EnableVTBDecode is on,
+     * and then FFmpeg, which can decode anything FFmpeg supports and is the last resort.
+     * A player asks for the backends of a stream when opening it, and falls back to the next one
+     * when the current one fails to prepare or keeps failing to decode.
+     */
+    class DecoderRegistry{
+        
+        static pthread_mutex_t mutex;
+        static std::vector<TFMPDecoderBackend> *backends();
+    
+    public:
+    
+        /** Add a backend before all registered ones if preferred, or after them. It replaces the one with the same name. */
+        static void registerBackend(TFMPDecoderBackend backend, bool preferred);
+        static void unregisterBackend(const char *name);
+        
+        /** The backends which can decode the stream, in the order of trying. */
+        static std::vector<TFMPDecoderBackend> backendsForStream(AVStream *stream);
+    };
+}
+
+#endif /* DecoderRegistry_hpp */
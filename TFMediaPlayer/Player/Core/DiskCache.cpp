@@ -0,0 +1,321 @@
+//
+//  DiskCache.cpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/27.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#include "DiskCache.hpp"
+#include "TFMPDebugFuncs.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <algorithm>
+
+#define TFMPDiskCacheIndexMagic     "TFDC"
+#define TFMPDiskCacheIndexVersion   1
+#define TFMPDiskCacheDataSuffix     ".data"
+#define TFMPDiskCacheIndexSuffix    ".index"
+//save the index after so many new bytes, so a crash loses little.
+#define TFMPDiskCacheIndexSaveBytes (4*1024*1024)
+
+using namespace tfmpcore;
+
+static inline void writeInt64(std::vector<uint8_t> &bytes, int64_t value){
+    for (int i = 0; i<8; i++) {
+        bytes.push_back((uint8_t)((uint64_t)value >> (i*8)));
+    }
+}
+
+static inline int64_t readInt64(const uint8_t *data){
+    uint64_t value = 0;
+    for (int i = 0; i<8; i++) {
+        value |= (uint64_t)data[i] << (i*8);
+    }
+    return (int64_t)value;
+}
+
+static bool hasSuffix(const std::string &string, const char *suffix){
+    size_t length = strlen(suffix);
+    return string.size() >= length && string.compare(string.size()-length, length, suffix) == 0;
+}
+
+bool DiskCache::open(const std::string &url, int64_t contentSize){
+    //the cache can't be checked against a media of unknown size.
+    if (contentSize <= 0 || dir.empty()) {
+        return false;
+    }
+    this->contentSize = contentSize;
+    
+    uint64_t hash = 14695981039346656037ULL;  //FNV-1a
+    for (char c : url) {
+        hash ^= (uint8_t)c;
+        hash *= 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+    dataPath = dir+"/"+name+TFMPDiskCacheDataSuffix;
+    indexPath = dir+"/"+name+TFMPDiskCacheIndexSuffix;
+    
+    fd = ::open(dataPath.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("open disk cache error: %s\n", dataPath.c_str());
+        return false;
+    }
+    //one player owns an entry, another one playing the same url goes without the cache.
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        printf("disk cache is in use: %s\n", dataPath.c_str());
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    
+    if (!loadIndex()) {
+        ranges.clear();
+        cachedBytes = 0;
+        remove(indexPath.c_str());
+        if (ftruncate(fd, 0) != 0) {
+            printf("truncate disk cache error: %s\n", dataPath.c_str());
+        }
+    }
+    
+    //it's the most recently used now, and the others make room for it.
+    utimes(dataPath.c_str(), NULL);
+    trimDirectory(dir, budget, dataPath);
+    
+    return true;
+}
+
+void DiskCache::close(){
+    if (fd < 0) {
+        return;
+    }
+    if (dirty) saveIndex();
+    //closing releases the lock.
+    ::close(fd);
+    fd = -1;
+    
+    trimDirectory(dir, budget, dataPath);
+}
+
+int64_t DiskCache::cachedLength(int64_t offset){
+    for (auto &range : ranges) {
+        if (range.start <= offset && offset < range.end) {
+            return range.end-offset;
+        }
+        if (range.start > offset) {
+            break;
+        }
+    }
+    return 0;
+}
+
+int DiskCache::read(int64_t offset, uint8_t *buf, int size){
+    int readSize = 0;
+    while (readSize < size) {
+        ssize_t retval = pread(fd, buf+readSize, size-readSize, offset+readSize);
+        if (retval <= 0) {
+            return retval < 0 ? -1 : readSize;
+        }
+        readSize += retval;
+    }
+    return readSize;
+}
+
+void DiskCache::write(int64_t offset, const uint8_t *buf, int size){
+    if (fd < 0 || cachedBytes+size > budget) {
+        return;
+    }
+    
+    int writtenSize = 0;
+    while (writtenSize < size) {
+        ssize_t retval = pwrite(fd, buf+writtenSize, size-writtenSize, offset+writtenSize);
+        if (retval <= 0) {
+            break;
+        }
+        writtenSize += retval;
+    }
+    if (writtenSize == 0) {
+        return;
+    }
+    
+    int64_t oldBytes = cachedBytes;
+    addRange(offset, offset+writtenSize);
+    dirty = true;
+    if (cachedBytes/TFMPDiskCacheIndexSaveBytes != oldBytes/TFMPDiskCacheIndexSaveBytes) {
+        saveIndex();
+    }
+}
+
+void DiskCache::addRange(int64_t start, int64_t end){
+    //merge the ranges which overlap or touch it.
+    auto first = std::lower_bound(ranges.begin(), ranges.end(), start, [](const Range &range, int64_t start){
+        return range.end < start;
+    });
+    auto last = first;
+    while (last != ranges.end() && last->start <= end) {
+        start = std::min(start, last->start);
+        end = std::max(end, last->end);
+        cachedBytes -= last->end-last->start;
+        last++;
+    }
+    first = ranges.erase(first, last);
+    ranges.insert(first, {start, end});
+    cachedBytes += end-start;
+}
+
+#pragma mark - index file
+
+/*
+ * "TFDC", version, content size, count of ranges, then start and end of every range.
+ * Numbers are 8 bytes, little-endian.
+ * The data is synced before, so after a crash the index never covers bytes which aren't on disk.
+ */
+bool DiskCache::saveIndex(){
+    if (fsync(fd) != 0) {
+        printf("sync disk cache error: %s\n", dataPath.c_str());
+        return false;
+    }
+    
+    std::vector<uint8_t> bytes;
+    bytes.insert(bytes.end(), TFMPDiskCacheIndexMagic, TFMPDiskCacheIndexMagic+4);
+    bytes.push_back(TFMPDiskCacheIndexVersion);
+    writeInt64(bytes, contentSize);
+    writeInt64(bytes, ranges.size());
+    for (auto &range : ranges) {
+        writeInt64(bytes, range.start);
+        writeInt64(bytes, range.end);
+    }
+    
+    std::string tempPath = indexPath+".tmp";
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if (file == nullptr) {
+        printf("open disk cache index error: %s\n", tempPath.c_str());
+        return false;
+    }
+    bool succeed = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    succeed = fflush(file) == 0 && fsync(fileno(file)) == 0 && succeed;
+    succeed = fclose(file) == 0 && succeed;
+    if (succeed) {
+        succeed = rename(tempPath.c_str(), indexPath.c_str()) == 0;
+    }
+    if (!succeed) {
+        remove(tempPath.c_str());
+        printf("write disk cache index error: %s\n", indexPath.c_str());
+    }
+    
+    dirty = !succeed;
+    return succeed;
+}
+
+bool DiskCache::loadIndex(){
+    FILE *file = fopen(indexPath.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    
+    std::vector<uint8_t> bytes;
+    uint8_t buffer[4096];
+    size_t readSize = 0;
+    while ((readSize = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        bytes.insert(bytes.end(), buffer, buffer+readSize);
+    }
+    fclose(file);
+    
+    if (bytes.size() < 21 || memcmp(bytes.data(), TFMPDiskCacheIndexMagic, 4) != 0 || bytes[4] != TFMPDiskCacheIndexVersion) {
+        return false;
+    }
+    //the media has changed.
+    if (readInt64(bytes.data()+5) != contentSize) {
+        return false;
+    }
+    int64_t count = readInt64(bytes.data()+13);
+    if (count < 0 || bytes.size() != (size_t)(21+count*16)) {
+        return false;
+    }
+    
+    ranges.clear();
+    cachedBytes = 0;
+    const uint8_t *data = bytes.data()+21;
+    for (int64_t i = 0; i<count; i++, data += 16) {
+        int64_t start = readInt64(data), end = readInt64(data+8);
+        if (start < 0 || end <= start || end > contentSize) {
+            return false;
+        }
+        addRange(start, end);
+    }
+    
+    return true;
+}
+
+#pragma mark - eviction
+
+void DiskCache::trimDirectory(const std::string &dir, int64_t budget, const std::string &keepPath){
+    DIR *dirp = opendir(dir.c_str());
+    if (dirp == nullptr) {
+        return;
+    }
+    
+    typedef struct{
+        std::string dataPath;
+        time_t usedTime;
+        int64_t size;
+    }Entry;
+    std::vector<Entry> entries;
+    int64_t totalSize = 0;
+    
+    struct dirent *item;
+    while ((item = readdir(dirp)) != nullptr) {
+        std::string name = item->d_name;
+        if (!hasSuffix(name, TFMPDiskCacheDataSuffix)) {
+            continue;
+        }
+        std::string path = dir+"/"+name;
+        struct stat fileStat;
+        if (stat(path.c_str(), &fileStat) != 0) {
+            continue;
+        }
+        //the space really used by the sparse file.
+        int64_t size = (int64_t)fileStat.st_blocks*512;
+        totalSize += size;
+        if (path != keepPath) {
+            entries.push_back({path, fileStat.st_mtime, size});
+        }
+    }
+    closedir(dirp);
+    
+    if (totalSize <= budget) {
+        return;
+    }
+    
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b){
+        return a.usedTime < b.usedTime;
+    });
+    for (auto &entry : entries) {
+        if (totalSize <= budget) {
+            break;
+        }
+        //skip the entries other players are using, they hold the lock.
+        int entryFd = ::open(entry.dataPath.c_str(), O_RDWR);
+        if (entryFd < 0) {
+            continue;
+        }
+        if (flock(entryFd, LOCK_EX | LOCK_NB) != 0) {
+            ::close(entryFd);
+            continue;
+        }
+        
+        std::string indexPath = entry.dataPath.substr(0, entry.dataPath.size()-strlen(TFMPDiskCacheDataSuffix))+TFMPDiskCacheIndexSuffix;
+        remove(indexPath.c_str());
+        remove(entry.dataPath.c_str());
+        ::close(entryFd);
+        totalSize -= entry.size;
+        TFMPDLOG_C("evict disk cache: %s\n", entry.dataPath.c_str());
+    }
+}
@@ -0,0 +1,73 @@
+//
+//  DiskCache.hpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/27.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#ifndef DiskCache_hpp
+#define DiskCache_hpp
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace tfmpcore {
+    
+    /**
+     * Bytes of one network media kept on disk, so playing it again or seeking back doesn't download them again.
+     *
+     * The bytes are in a sparse data file at their offsets in the media, and the ranges which have been written
+     * are in an index file beside it. The files are named by the hash of the url, and the cache is dropped when the size
+     * of the media changes. The entries of the directory are evicted by the least recently used, to keep them in a budget.
+     * An open entry is locked, another player of the same url doesn't use the cache and eviction skips it.
+     * It's used by one thread.
+     */
+    class DiskCache{
+        
+        typedef struct{
+            int64_t start;
+            int64_t end;
+        }Range;
+        
+        std::string dir;
+        std::string dataPath;
+        std::string indexPath;
+        int64_t budget;
+        
+        int fd = -1;
+        int64_t contentSize = -1;
+        std::vector<Range> ranges;    //sorted and not touching each other.
+        int64_t cachedBytes = 0;
+        bool dirty = false;
+        
+        void addRange(int64_t start, int64_t end);
+        bool loadIndex();
+        bool saveIndex();
+    
+    public:
+    
+        DiskCache(std::string dir, int64_t budget):dir(dir),budget(budget){};
+        ~DiskCache(){
+            close();
+        }
+        
+        /** Open the entry of url, contentSize is the size of the media, -1 if it's unknown. It fails if the entry is in use. */
+        bool open(const std::string &url, int64_t contentSize);
+        /** Save the index and trim the directory to the budget. */
+        void close();
+        
+        /** The length of bytes cached from offset on without a gap. */
+        int64_t cachedLength(int64_t offset);
+        /** Read cached bytes, the return is the size read, less than 0 for an error. */
+        int read(int64_t offset, uint8_t *buf, int size);
+        /** Keep the bytes fetched from the network, they're dropped when the entry reaches the budget. */
+        void write(int64_t offset, const uint8_t *buf, int size);
+        
+        /** Delete the least recently used entries until the directory is in budget, except the entry of keepPath and those in use. */
+        static void trimDirectory(const std::string &dir, int64_t budget, const std::string &keepPath);
+    };
+}
+
+#endif /* DiskCache_hpp */
@@ -62,12 +62,26 @@ void DisplayController::pause(bool flag){
     }
 }
 
+bool DisplayController::redisplayVideoFrame(){
+    bool displayed = false;
+    
+    pthread_mutex_lock(&lastVideoMutex);
+    if (lastVideoFrame && shouldDisplay) {
+        displayVideoFrame(lastVideoFrame->displayBuffer, displayContext);
+        displayed = true;
+    }
+    pthread_mutex_unlock(&lastVideoMutex);
+    
+    return displayed;
+}
+
 double DisplayController::getPlayTime(){
-    if (videoTimeBase.den == 0 || videoTimeBase.num == 0 || lastPts < 0) {
+    AVRational timeBase = lastIsAudio ? audioTimeBase : videoTimeBase;
+    if (timeBase.den == 0 || timeBase.num == 0 || lastPts < 0) {
         return invalidPlayTime;
     }
     
-    return lastPts * av_q2d(lastIsAudio?audioTimeBase:videoTimeBase);
+    return lastPts * av_q2d(timeBase);
 }
 
 void DisplayController::flush(){
@@ -90,6 +104,7 @@ void DisplayController::flush(){
     
     remainingAudioBuffers.validSize = 0;
     remainingAudioBuffers.readIndex = 0;
+    freeDrainedAudioFrames();
     
     if (handleVideo) {
         shareVideoBuffer->disableIO(false);
@@ -101,6 +116,26 @@ void DisplayController::flush(){
     TFMPCondSignal(video_pause_cond, video_pause_mutex)
 }
 
+void DisplayController::replaceVideoBuffer(RecycleBuffer<TFMPFrame *> *buffer){
+    
+    //park the display loop the same as flushing.
+    bool wasPaused = paused;
+    paused = true;
+    
+    if (processingVideo) {
+        shareVideoBuffer->disableIO(true);
+        sem_wait(wait_display_sem);
+        shareVideoBuffer->disableIO(false);
+    }
+    
+    shareVideoBuffer = buffer;
+    
+    paused = wasPaused;
+    if (!paused) {
+        TFMPCondSignal(video_pause_cond, video_pause_mutex)
+    }
+}
+
 void DisplayController::freeResources(){
     
     shouldDisplay = false;
@@ -118,6 +153,11 @@ void DisplayController::freeResources(){
     free(remainingAudioBuffers.head);
     remainingAudioBuffers.validSize = 0;
     remainingAudioBuffers.readIndex = 0;
+    freeDrainedAudioFrames();
+    
+    pthread_mutex_lock(&lastVideoMutex);
+    if (lastVideoFrame) lastVideoFrame->freeFrameFunc(&lastVideoFrame);
+    pthread_mutex_unlock(&lastVideoMutex);
     
     displayContext = nullptr;
     shareVideoBuffer = nullptr;
@@ -164,6 +204,10 @@ void *DisplayController::displayLoop(void *context){
         
         double remainTime = displayer->syncClock->remainTimeForVideo(videoFrame->pts, displayer->videoTimeBase);
         
+        if (displayer->videoFrameTimingFunc) {
+            displayer->videoFrameTimingFunc(remainTime < -minExeTime, remainTime >= 0, displayer->eventContext);
+        }
+        
         if (remainTime < -minExeTime){
             videoFrame->freeFrameFunc(&videoFrame);
             
@@ -180,9 +224,14 @@ void *DisplayController::displayLoop(void *context){
         myStateObserver.mark("video display", 6);
         if (displayer->shouldDisplay){
             myStateObserver.mark("video display", 7);
+            pthread_mutex_lock(&displayer->lastVideoMutex);
             displayer->displayVideoFrame(displayBuffer, displayer->displayContext);
+            
+            TFMPFrame *replacedFrame = displayer->lastVideoFrame;
+            displayer->lastVideoFrame = videoFrame;
+            pthread_mutex_unlock(&displayer->lastVideoMutex);
             myStateObserver.mark("video show6", 1, true);
-
+            
             myStateObserver.mark("video display", 8);
             if(!displayer->paused) {
                 if (!displayer->syncClock->isAudioMajor) {
@@ -190,10 +239,13 @@ void *DisplayController::displayLoop(void *context){
                     displayer->lastIsAudio = false;
                 }
                 displayer->syncClock->presentVideo(videoFrame->pts, displayer->videoTimeBase);
+                displayer->checkFirstFramePresented();
             }
+            
+            videoFrame = replacedFrame;
         }
         
-        videoFrame->freeFrameFunc(&videoFrame);
+        if (videoFrame) videoFrame->freeFrameFunc(&videoFrame);
     }
     
     return 0;
@@ -247,14 +299,12 @@ int DisplayController::fillAudioBuffer(uint8_t **buffersList, int lineCount, int
             audioFrame = nullptr;
             displayer->displayingAudio = nullptr;
             
-            if (displayer->shareAudioBuffer->isEmpty() || displayer->paused) {
+            if (displayer->paused || (audioFrame = displayer->nextAudioFrame(needReadSize)) == nullptr) {
                 //fill remain buffer to 0.
                 memset(buffer+(oneLineSize - needReadSize), 0, needReadSize);
                 break;
             }else{
                 myStateObserver.mark("display audio", 6);
-                displayer->shareAudioBuffer->blockGetOut(&audioFrame);
-                
                 displayer->displayingAudio = audioFrame;
                 
             }
@@ -285,6 +335,7 @@ int DisplayController::fillAudioBuffer(uint8_t **buffersList, int lineCount, int
                 linesize = frame->linesize[0];
             }
             myStateObserver.mark("display audio", 9);
+            if (linesize > 0) displayer->lastAudioLinesize = linesize;
             if (dataBuffer == nullptr) {
                 audioFrame->freeFrameFunc(&audioFrame);
                 continue;
@@ -303,6 +354,9 @@ int DisplayController::fillAudioBuffer(uint8_t **buffersList, int lineCount, int
                     displayer->lastIsAudio = true;
                 }
                 displayer->syncClock->presentAudio(frame->pts, displayer->audioTimeBase, preBufferDuration);
+                if (!(displayer->displayMediaType & TFMP_MEDIA_TYPE_VIDEO)) {
+                    displayer->checkFirstFramePresented();
+                }
             }
             
             if (needReadSize >= linesize) {
@@ -353,6 +407,34 @@ int DisplayController::fillAudioBuffer(uint8_t **buffersList, int lineCount, int
     return 0;
 }
 
+TFMPFrame *DisplayController::nextAudioFrame(int needReadSize){
+    if (drainedAudioIndex < drainedAudioCount) {
+        return drainedAudioFrames[drainedAudioIndex++];
+    }
+    
+    //estimate the count of frames by the last frame's size, drain them with one synchronisation.
+    int count = 1;
+    if (lastAudioLinesize > 0) {
+        count = std::min(needReadSize/lastAudioLinesize + 1, TFMP_AUDIO_DRAIN_MAX_COUNT);
+    }
+    
+    drainedAudioCount = shareAudioBuffer->drainUpTo(drainedAudioFrames, count);
+    drainedAudioIndex = 0;
+    if (drainedAudioCount == 0) {
+        return nullptr;
+    }
+    
+    return drainedAudioFrames[drainedAudioIndex++];
+}
+
+void DisplayController::freeDrainedAudioFrames(){
+    for (int i = drainedAudioIndex; i<drainedAudioCount; i++) {
+        drainedAudioFrames[i]->freeFrameFunc(&drainedAudioFrames[i]);
+    }
+    drainedAudioCount = 0;
+    drainedAudioIndex = 0;
+}
+
 TFMPFillAudioBufferStruct DisplayController::getFillAudioBufferStruct(){
     return {fillAudioBuffer, this};
 }
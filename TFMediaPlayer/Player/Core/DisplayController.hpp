@@ -17,8 +17,8 @@
 #include "AudioResampler.hpp"
 #include <functional>
 #include <semaphore.h>
+#include <atomic>
 #include "TFMPDebugFuncs.h"
-#include "VTBDecoder.h"
 #include "TFMPFrame.h"
 
 extern "C"{
@@ -27,6 +27,7 @@ extern "C"{
 }
 
 #define TFMP_MAX_AUDIO_CHANNEL 8
+#define TFMP_AUDIO_DRAIN_MAX_COUNT 8
 
 namespace tfmpcore {
     
@@ -62,8 +63,20 @@ namespace tfmpcore {
         TFMPFrame *displayingVideo = nullptr;
         TFMPFrame *displayingAudio = nullptr;
         
+        //The last displayed video frame is kept until the next one, to display it again on redrawing.
+        TFMPFrame *lastVideoFrame = nullptr;
+        pthread_mutex_t lastVideoMutex = PTHREAD_MUTEX_INITIALIZER;
+        
         TFMPRemainingBuffer remainingAudioBuffers;
         
+        //Frames are drained from shareAudioBuffer together, as many as one callback needs.
+        TFMPFrame *drainedAudioFrames[TFMP_AUDIO_DRAIN_MAX_COUNT];
+        int drainedAudioCount = 0;
+        int drainedAudioIndex = 0;
+        int lastAudioLinesize = 0;
+        TFMPFrame *nextAudioFrame(int needReadSize);
+        void freeDrainedAudioFrames();
+        
         static int fillAudioBuffer(uint8_t **buffer, int lineCount,int oneLineSize, void *context);
         
         AudioResampler *audioResampler = nullptr;
@@ -71,6 +84,13 @@ namespace tfmpcore {
         int64_t lastPts = 0;
         bool lastIsAudio = true;
         
+        std::atomic<bool> waitingFirstFrame{false};
+        inline void checkFirstFramePresented(){
+            if (waitingFirstFrame.load(std::memory_order_relaxed) && waitingFirstFrame.exchange(false)) {
+                if (firstFramePresentedFunc) firstFramePresentedFunc(eventContext);
+            }
+        }
+        
     public:
         
         ~DisplayController(){
@@ -85,6 +105,14 @@ namespace tfmpcore {
         
         //the real display function different with different platform
         TFMPVideoFrameDisplayFunc displayVideoFrame;
+        
+        /** Called for every video frame, late means it's dropped, onTime means it's displayed before its time. */
+        void (*videoFrameTimingFunc)(bool late, bool onTime, void *context) = nullptr;
+        /** Called once for the first frame presented after resetPlayTime, the video frame if video is displayed. */
+        void (*firstFramePresentedFunc)(void *context) = nullptr;
+        //context of videoFrameTimingFunc and firstFramePresentedFunc.
+        void *eventContext = nullptr;
+        
         TFMPFillAudioBufferStruct getFillAudioBufferStruct();
         
         void setAudioResampler(AudioResampler *audioResampler){
@@ -93,6 +121,8 @@ namespace tfmpcore {
         
         RecycleBuffer<TFMPFrame*> *shareVideoBuffer;
         RecycleBuffer<TFMPFrame*> *shareAudioBuffer;
+        /** Change the video buffer while displaying, e.g. the video decoder is replaced. It doesn't return until the display loop leaves the old one. */
+        void replaceVideoBuffer(RecycleBuffer<TFMPFrame*> *buffer);
         
         AVRational videoTimeBase;
         AVRational audioTimeBase;
@@ -104,6 +134,7 @@ namespace tfmpcore {
         void resetPlayTime(){
             lastPts = -1;
             lastIsAudio = false;
+            waitingFirstFrame.store(true);
         }
 
         //controls
@@ -113,6 +144,18 @@ namespace tfmpcore {
         void pause(bool flag);
         bool isPaused(){ return paused;};
         
+        /** Play faster or slower than the media time, audio is stretched by the resampler. */
+        void setPlaybackSpeed(double speed){
+            syncClock->setSpeed(speed);
+            if (audioResampler) audioResampler->speed.store(speed, std::memory_order_relaxed);
+        }
+        double getPlaybackSpeed(){
+            return syncClock->getSpeed();
+        }
+        
+        /** Display the last video frame again without decoding, e.g. the view is redrawn while paused. */
+        bool redisplayVideoFrame();
+        
         //release
         void flush();
         void freeResources();
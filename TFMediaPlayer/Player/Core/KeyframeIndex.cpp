@@ -0,0 +1,364 @@
+//
+//  KeyframeIndex.cpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/22.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#include "KeyframeIndex.hpp"
+#include "TFMPDebugFuncs.h"
+#include <stdio.h>
+#include <string.h>
+
+using namespace tfmpcore;
+
+#define TFMPKeyframeIndexMagic      "TFKI"
+#define TFMPKeyframeIndexVersion    1
+
+size_t KeyframeIndex::upperBound(int64_t pts){
+    size_t low = 0, high = entries.size();
+    while (low < high) {
+        size_t mid = (low+high)/2;
+        if (entries[mid].pts <= pts) {
+            low = mid+1;
+        }else{
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static inline void hashBytes(uint64_t *hash, const void *bytes, size_t size){
+    const uint8_t *data = (const uint8_t *)bytes;
+    for (size_t i = 0; i<size; i++) {
+        *hash ^= data[i];
+        *hash *= 1099511628211ULL;
+    }
+}
+
+uint64_t KeyframeIndex::mediaIdentity(AVFormatContext *fmtCtx){
+    uint64_t hash = 14695981039346656037ULL;  //FNV-1a
+    
+    hashBytes(&hash, fmtCtx->filename, strlen(fmtCtx->filename));
+    int64_t size = fmtCtx->pb ? avio_size(fmtCtx->pb) : -1;
+    hashBytes(&hash, &size, sizeof(size));
+    hashBytes(&hash, &fmtCtx->duration, sizeof(fmtCtx->duration));
+    hashBytes(&hash, &fmtCtx->nb_streams, sizeof(fmtCtx->nb_streams));
+    
+    for (int i = 0; i<fmtCtx->nb_streams; i++) {
+        AVCodecParameters *codecpar = fmtCtx->streams[i]->codecpar;
+        hashBytes(&hash, &codecpar->codec_id, sizeof(codecpar->codec_id));
+        if (codecpar->extradata) hashBytes(&hash, codecpar->extradata, codecpar->extradata_size);
+    }
+    
+    return hash;
+}
+
+void KeyframeIndex::addKeyframe(int64_t pts, int64_t pos, Cursor *cursor){
+    if (pts == AV_NOPTS_VALUE || pos < 0) {
+        cursor->lastPts = CursorBroken;
+        return;
+    }
+    
+    pthread_mutex_lock(&mutex);
+    
+    size_t index = upperBound(pts);
+    if (index > 0 && entries[index-1].pts == pts) {
+        index--;
+    }else{
+        entries.insert(entries.begin()+index, {pts, pos, false});
+        //a keyframe appears in a gap which was taken as empty, don't trust the gap anymore.
+        if (index+1 < entries.size()) {
+            entries[index+1].linked = false;
+        }else{
+            endLinked = false;
+        }
+        dirty = true;
+    }
+    
+    if (!entries[index].linked) {
+        bool linked = false;
+        if (index == 0) {
+            linked = cursor->lastPts == CursorStart;
+        }else{
+            linked = cursor->lastPts == entries[index-1].pts;
+        }
+        if (linked) {
+            entries[index].linked = true;
+            dirty = true;
+        }
+    }
+    
+    pthread_mutex_unlock(&mutex);
+    
+    cursor->lastPts = pts;
+}
+
+void KeyframeIndex::markEnd(Cursor *cursor){
+    pthread_mutex_lock(&mutex);
+    if (!endLinked && !entries.empty() && entries.back().pts == cursor->lastPts) {
+        endLinked = true;
+        dirty = true;
+    }
+    pthread_mutex_unlock(&mutex);
+    
+    cursor->lastPts = CursorBroken;
+}
+
+bool KeyframeIndex::lookup(int64_t pts, TFMPKeyframeEntry *entry){
+    bool found = false;
+    
+    pthread_mutex_lock(&mutex);
+    size_t index = upperBound(pts);
+    if (index == 0) {
+        //before the first keyframe, nothing can be decoded before it anyway.
+        if (!entries.empty() && entries[0].linked) {
+            *entry = entries[0];
+            found = true;
+        }
+    }else{
+        bool gapLinked = index < entries.size() ? entries[index].linked : endLinked;
+        if (gapLinked) {
+            *entry = entries[index-1];
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    
+    return found;
+}
+
+bool KeyframeIndex::isComplete(){
+    pthread_mutex_lock(&mutex);
+    bool complete = endLinked && !entries.empty();
+    for (size_t i = 0; complete && i<entries.size(); i++) {
+        complete = entries[i].linked;
+    }
+    pthread_mutex_unlock(&mutex);
+    
+    return complete;
+}
+
+size_t KeyframeIndex::count(){
+    pthread_mutex_lock(&mutex);
+    size_t count = entries.size();
+    pthread_mutex_unlock(&mutex);
+    
+    return count;
+}
+
+#pragma mark - background scan
+
+int KeyframeIndex::scanInterrupted(void *context){
+    KeyframeIndex *index = (KeyframeIndex *)context;
+    return index->stopScanning ? 1 : 0;
+}
+
+void KeyframeIndex::startScan(std::string path, std::string savePath){
+    if (scanning || isComplete()) {
+        return;
+    }
+    
+    scanPath = path;
+    scanSavePath = savePath;
+    stopScanning = false;
+    scanning = true;
+    pthread_create(&scanThread, nullptr, scanLoop, this);
+}
+
+void KeyframeIndex::stopScan(){
+    if (!scanning) {
+        return;
+    }
+    
+    stopScanning = true;
+    pthread_join(scanThread, nullptr);
+    scanning = false;
+}
+
+void *KeyframeIndex::scanLoop(void *context){
+    KeyframeIndex *index = (KeyframeIndex *)context;
+    
+    AVFormatContext *fmtCtx = avformat_alloc_context();
+    if (fmtCtx == nullptr) {
+        return 0;
+    }
+    fmtCtx->interrupt_callback = {scanInterrupted, index};
+    
+    if (avformat_open_input(&fmtCtx, index->scanPath.c_str(), NULL, NULL) < 0) {
+        TFMPDLOG_C("keyframe scan open failed: %s\n", index->scanPath.c_str());
+        return 0;
+    }
+    
+    //packets need parsing to get keyframe flags in some containers, e.g. MPEG-TS.
+    if (avformat_find_stream_info(fmtCtx, NULL) < 0 || index->streamIndex >= fmtCtx->nb_streams) {
+        avformat_close_input(&fmtCtx);
+        return 0;
+    }
+    
+    for (int i = 0; i<fmtCtx->nb_streams; i++) {
+        if (i != index->streamIndex) fmtCtx->streams[i]->discard = AVDISCARD_ALL;
+    }
+    
+    Cursor cursor = {CursorStart};
+    AVPacket *packet = av_packet_alloc();
+    int retval = 0;
+    while (!index->stopScanning) {
+        retval = av_read_frame(fmtCtx, packet);
+        if (retval < 0) {
+            break;
+        }
+        if (packet->stream_index == index->streamIndex && (packet->flags & AV_PKT_FLAG_KEY)) {
+            index->addKeyframe(packet->pts, packet->pos, &cursor);
+        }
+        av_packet_unref(packet);
+    }
+    
+    if (retval == AVERROR_EOF) {
+        index->markEnd(&cursor);
+        TFMPDLOG_C("keyframe scan done: %zu keyframes\n", index->count());
+        if (!index->scanSavePath.empty()) index->save(index->scanSavePath);
+    }
+    
+    av_packet_free(&packet);
+    avformat_close_input(&fmtCtx);
+    
+    return 0;
+}
+
+#pragma mark - sidecar file
+
+static inline void writeVarint(std::vector<uint8_t> &bytes, uint64_t value){
+    while (value >= 0x80) {
+        bytes.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    bytes.push_back((uint8_t)value);
+}
+
+static inline bool readVarint(const uint8_t *&data, const uint8_t *end, uint64_t *value){
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && data < end; shift += 7) {
+        uint8_t byte = *data++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline uint64_t zigzag(int64_t value){
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value){
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/*
+ * "TFKI", version, identity(8 bytes, little-endian), endLinked, count, then entries.
+ * Entries are deltas from the former one in varints: (zigzag(pts delta) << 1 | linked), zigzag(pos delta).
+ */
+bool KeyframeIndex::save(std::string path){
+    std::vector<uint8_t> bytes;
+    
+    pthread_mutex_lock(&mutex);
+    if (!dirty) {
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+    
+    bytes.insert(bytes.end(), TFMPKeyframeIndexMagic, TFMPKeyframeIndexMagic+4);
+    bytes.push_back(TFMPKeyframeIndexVersion);
+    for (int i = 0; i<8; i++) {
+        bytes.push_back((uint8_t)(identity >> (i*8)));
+    }
+    bytes.push_back(endLinked ? 1 : 0);
+    writeVarint(bytes, entries.size());
+    
+    int64_t lastPts = 0, lastPos = 0;
+    for (auto &entry : entries) {
+        writeVarint(bytes, (zigzag(entry.pts-lastPts) << 1) | (entry.linked ? 1 : 0));
+        writeVarint(bytes, zigzag(entry.pos-lastPos));
+        lastPts = entry.pts;
+        lastPos = entry.pos;
+    }
+    dirty = false;
+    pthread_mutex_unlock(&mutex);
+    
+    std::string tempPath = path+".tmp";
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if (file == nullptr) {
+        printf("open keyframe index file error: %s\n", tempPath.c_str());
+        return false;
+    }
+    bool succeed = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    succeed = fclose(file) == 0 && succeed;
+    if (succeed) {
+        succeed = rename(tempPath.c_str(), path.c_str()) == 0;
+    }
+    if (!succeed) {
+        remove(tempPath.c_str());
+        printf("write keyframe index file error: %s\n", path.c_str());
+    }
+    
+    return succeed;
+}
+
+bool KeyframeIndex::load(std::string path){
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    
+    std::vector<uint8_t> bytes;
+    uint8_t buffer[4096];
+    size_t readSize = 0;
+    while ((readSize = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        bytes.insert(bytes.end(), buffer, buffer+readSize);
+    }
+    fclose(file);
+    
+    const uint8_t *data = bytes.data(), *end = data+bytes.size();
+    if (bytes.size() < 15 || memcmp(data, TFMPKeyframeIndexMagic, 4) != 0 || data[4] != TFMPKeyframeIndexVersion) {
+        return false;
+    }
+    uint64_t fileIdentity = 0;
+    for (int i = 0; i<8; i++) {
+        fileIdentity |= (uint64_t)data[5+i] << (i*8);
+    }
+    if (fileIdentity != identity) {
+        return false;
+    }
+    bool fileEndLinked = data[13] != 0;
+    data += 14;
+    
+    uint64_t count = 0;
+    if (!readVarint(data, end, &count) || count > (uint64_t)(end-data)) {
+        return false;
+    }
+    
+    std::vector<TFMPKeyframeEntry> fileEntries;
+    fileEntries.reserve(count);
+    int64_t lastPts = 0, lastPos = 0;
+    for (uint64_t i = 0; i<count; i++) {
+        uint64_t ptsValue = 0, posValue = 0;
+        if (!readVarint(data, end, &ptsValue) || !readVarint(data, end, &posValue)) {
+            return false;
+        }
+        lastPts += unzigzag(ptsValue >> 1);
+        lastPos += unzigzag(posValue);
+        fileEntries.push_back({lastPts, lastPos, (ptsValue & 1) != 0});
+    }
+    
+    pthread_mutex_lock(&mutex);
+    entries.swap(fileEntries);
+    endLinked = fileEndLinked;
+    dirty = false;
+    pthread_mutex_unlock(&mutex);
+    
+    return true;
+}
@@ -0,0 +1,99 @@
+//
+//  KeyframeIndex.hpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/22.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#ifndef KeyframeIndex_hpp
+#define KeyframeIndex_hpp
+
+extern "C"{
+#include <libavformat/avformat.h>
+}
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+namespace tfmpcore {
+    
+    typedef struct{
+        int64_t pts;    //in the time base of the indexed stream.
+        int64_t pos;    //byte offset of the packet in the file.
+        bool linked;    //no other keyframe between the former entry and this one, or before it for the first entry.
+    }TFMPKeyframeEntry;
+    
+    /**
+     * Keyframes of one stream, mapping pts to byte offset, so seeking can jump to the right keyframe without bisecting the file.
+     *
+     * It's built from packets read in order, by playing or by a background scan. An entry is only trusted for seeking when
+     * the gap after it has been read through, so a half-built index never sends a seek to a keyframe far before the target.
+     * It can be saved to and loaded from a sidecar file, which is keyed by the identity of the media.
+     */
+    class KeyframeIndex{
+        
+        std::vector<TFMPKeyframeEntry> entries;
+        bool endLinked = false;   //no keyframe after the last entry.
+        bool dirty = false;
+        
+        uint64_t identity;
+        int streamIndex;
+        
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        
+        //first entry whose pts is greater than pts.
+        size_t upperBound(int64_t pts);
+        
+        //background scan
+        pthread_t scanThread;
+        bool scanning = false;
+        bool stopScanning = false;
+        std::string scanPath;
+        std::string scanSavePath;
+        static void *scanLoop(void *context);
+        static int scanInterrupted(void *context);
+    
+    public:
+    
+        /** The reading position of a reader, which links the keyframes it reads in order. */
+        typedef struct{
+            int64_t lastPts;
+        }Cursor;
+        //neither of them is a real pts.
+        static const int64_t CursorBroken = AV_NOPTS_VALUE;   //reading from an unknown position, e.g. after seeking.
+        static const int64_t CursorStart = AV_NOPTS_VALUE+1;  //reading from the start of the file.
+        
+        KeyframeIndex(uint64_t identity, int streamIndex):identity(identity),streamIndex(streamIndex){};
+        ~KeyframeIndex(){
+            stopScan();
+        }
+        
+        /** An identity of the media from its url, size and streams, used to name its sidecar file. */
+        static uint64_t mediaIdentity(AVFormatContext *fmtCtx);
+        
+        /** Record a keyframe read after the one of cursor, called by the reading threads. */
+        void addKeyframe(int64_t pts, int64_t pos, Cursor *cursor);
+        /** The reader of cursor reached the end of the file. */
+        void markEnd(Cursor *cursor);
+        
+        /** The keyframe to start decoding from for a frame at pts, false if the index doesn't cover pts for sure. */
+        bool lookup(int64_t pts, TFMPKeyframeEntry *entry);
+        
+        /** Every gap is linked from the start to the end. */
+        bool isComplete();
+        size_t count();
+        
+        /** Read the file from the start in a background thread with its own format context, and save the index to savePath when done. */
+        void startScan(std::string path, std::string savePath);
+        void stopScan();
+        
+        bool load(std::string path);
+        /** Save it if it changed since loading or saving. The file is written aside and renamed, so it's never half written. */
+        bool save(std::string path);
+    };
+}
+
+#endif /* KeyframeIndex_hpp */
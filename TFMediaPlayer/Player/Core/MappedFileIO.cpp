@@ -0,0 +1,151 @@
+//
+//  MappedFileIO.cpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/26.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#include "MappedFileIO.hpp"
+#include "TFMPDebugFuncs.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#define TFMPMappedFileIOBufferSize      (64*1024)
+//seeking within it is taken as reading in order, e.g. skipping a box or a few packets.
+#define TFMPMappedFileNearSeekSize      (1024*1024)
+//read so many bytes in order after a far seek to read ahead again.
+#define TFMPMappedFileSequentialSize    (4*1024*1024)
+
+using namespace tfmpcore;
+
+bool MappedFileIO::isLocalPath(const std::string &url){
+    return url.compare(0, 1, "/") == 0 || url.compare(0, 5, "file:") == 0;
+}
+
+bool MappedFileIO::open(const char *url){
+    
+    const char *path = strncmp(url, "file:", 5) == 0 ? url+5 : url;
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("mapped file open %s error: %d\n", path, errno);
+        return false;
+    }
+    
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0 || (uint64_t)fileStat.st_size > SIZE_MAX) {
+        ::close(fd);
+        return false;
+    }
+    size = fileStat.st_size;
+    
+    void *mapped = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+    //the mapping holds the file by itself.
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        printf("mapped file mmap %s error: %d\n", path, errno);
+        size = 0;
+        return false;
+    }
+    data = (uint8_t *)mapped;
+    advise(0, size, MADV_SEQUENTIAL);
+    
+    uint8_t *buffer = (uint8_t *)av_malloc(TFMPMappedFileIOBufferSize);
+    ioCtx = avio_alloc_context(buffer, TFMPMappedFileIOBufferSize, 0, this, readPacket, NULL, seek);
+    if (ioCtx == nullptr) {
+        av_free(buffer);
+        close();
+        return false;
+    }
+    ioCtx->seekable = AVIO_SEEKABLE_NORMAL;
+    //reading costs only a copy, don't copy again through the buffer.
+    ioCtx->direct = 1;
+    
+    pos = 0;
+    randomAccess = false;
+    
+    return true;
+}
+
+void MappedFileIO::close(){
+    if (ioCtx) {
+        av_freep(&ioCtx->buffer);
+        avio_context_free(&ioCtx);
+    }
+    if (data) {
+        munmap(data, (size_t)size);
+        data = nullptr;
+    }
+    size = 0;
+    pos = 0;
+}
+
+void MappedFileIO::advise(int64_t offset, int64_t length, int advice){
+    //madvise takes page aligned addresses, the mapping starts at a page.
+    int64_t pageSize = getpagesize();
+    int64_t start = offset/pageSize*pageSize;
+    int64_t end = std::min(offset+length, size);
+    if (end > start) {
+        madvise(data+start, (size_t)(end-start), advice);
+    }
+}
+
+int MappedFileIO::readPacket(void *opaque, uint8_t *buf, int buf_size){
+    
+    MappedFileIO *io = (MappedFileIO *)opaque;
+    if (io->pos >= io->size) {
+        return AVERROR_EOF;
+    }
+    
+    int readSize = (int)std::min((int64_t)buf_size, io->size-io->pos);
+    memcpy(buf, io->data+io->pos, readSize);
+    io->pos += readSize;
+    
+    if (io->randomAccess) {
+        io->sequentialBytes += readSize;
+        if (io->sequentialBytes >= TFMPMappedFileSequentialSize) {
+            io->advise(0, io->size, MADV_SEQUENTIAL);
+            io->randomAccess = false;
+        }
+    }
+    
+    return readSize;
+}
+
+int64_t MappedFileIO::seek(void *opaque, int64_t offset, int whence){
+    
+    MappedFileIO *io = (MappedFileIO *)opaque;
+    whence &= ~AVSEEK_FORCE;
+    
+    int64_t newPos = -1;
+    if (whence == AVSEEK_SIZE) {
+        return io->size;
+    }else if (whence == SEEK_SET){
+        newPos = offset;
+    }else if (whence == SEEK_CUR){
+        newPos = io->pos+offset;
+    }else if (whence == SEEK_END){
+        newPos = io->size+offset;
+    }
+    if (newPos < 0) {
+        return AVERROR(EINVAL);
+    }
+    
+    //reading ahead from the old position is wasted, fetch only around the new one.
+    if (llabs(newPos-io->pos) > TFMPMappedFileNearSeekSize) {
+        io->advise(0, io->size, MADV_RANDOM);
+        io->advise(newPos, TFMPMappedFileNearSeekSize, MADV_WILLNEED);
+        io->randomAccess = true;
+        io->sequentialBytes = 0;
+    }
+    io->pos = newPos;
+    
+    return newPos;
+}
@@ -0,0 +1,64 @@
+//
+//  MappedFileIO.hpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/26.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#ifndef MappedFileIO_hpp
+#define MappedFileIO_hpp
+
+extern "C"{
+#include <libavformat/avformat.h>
+}
+
+#include <stdint.h>
+#include <string>
+
+namespace tfmpcore {
+    
+    /**
+     * An AVIOContext reading a local file through a memory mapping, so reading is a copy from the mapped pages
+     * straight into what the demuxer asks for, without read() syscalls and the buffer of FFmpeg's file protocol.
+     *
+     * The kernel is told to read ahead while the demuxer reads in order, and only around the position after
+     * a seek far away, until reading goes on in order for a while.
+     * The file mustn't be truncated while it's mapped, reading the lost pages would crash.
+     */
+    class MappedFileIO{
+        
+        uint8_t *data = nullptr;
+        int64_t size = 0;
+        int64_t pos = 0;
+        
+        AVIOContext *ioCtx = nullptr;
+        
+        bool randomAccess = false;    //a far seek happened and reading in order hasn't been long enough since.
+        int64_t sequentialBytes = 0;  //bytes read since the far seek.
+        void advise(int64_t offset, int64_t length, int advice);
+        
+        static int readPacket(void *opaque, uint8_t *buf, int buf_size);
+        static int64_t seek(void *opaque, int64_t offset, int whence);
+    
+    public:
+    
+        ~MappedFileIO(){
+            close();
+        }
+        
+        /** A path of the file system or a file: url. */
+        static bool isLocalPath(const std::string &url);
+        
+        /** Map the whole file, false if it can't be mapped, e.g. it's empty or too large for the address space. */
+        bool open(const char *url);
+        void close();
+        
+        /** Set it to the pb of the format context before avformat_open_input. */
+        AVIOContext *ioContext(){
+            return ioCtx;
+        }
+    };
+}
+
+#endif /* MappedFileIO_hpp */
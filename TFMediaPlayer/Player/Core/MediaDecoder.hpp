@@ -0,0 +1,138 @@
+//
+//  MediaDecoder.hpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/24.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#ifndef MediaDecoder_hpp
+#define MediaDecoder_hpp
+
+extern "C"{
+#include <libavformat/avformat.h>
+}
+
+#include <atomic>
+#include <string>
+#include "RecycleBuffer.hpp"
+#include "MediaTimeFilter.hpp"
+#include "TFMPFrame.h"
+#include "TFMPFramePool.hpp"
+#include "DecodeDegrader.hpp"
+
+//Decoding fails so many times in a row, the decoder is taken as broken.
+#define TFMPDecodeFailureLimit  8
+
+namespace tfmpcore {
+    
+    typedef enum{
+        TFMPDecodeThreadAuto,   //chosen by the stream when preparing, see Decoder::autoThreadType.
+        TFMPDecodeThreadFrame,  //decode frames in parallel, fastest but delays every frame by threadCount-1 frames.
+        TFMPDecodeThreadSlice,  //decode slices of one frame in parallel, no delay but only for streams coded with many slices.
+        TFMPDecodeThreadNone,   //one thread.
+    }TFMPDecodeThreadType;
+    
+    /** Options of software decoding, set them before preparing. */
+    typedef struct{
+        int threadCount;                  //0 means one thread for every core.
+        TFMPDecodeThreadType threadType;
+        bool lowDelay;                    //AV_CODEC_FLAG_LOW_DELAY, output frames as soon as possible.
+        bool fast;                        //AV_CODEC_FLAG2_FAST, allow speedups which aren't spec compliant.
+        double audioChunkDuration;        //pack decoded audio frames into chunks of it, unit is second, 0 means no packing.
+    }TFMPDecoderConfig;
+    
+    /** The threading which the codec really uses after opening. */
+    typedef struct{
+        TFMPDecodeThreadType activeType;
+        int threadCount;
+    }TFMPDecodeThreadInfo;
+    
+    /**
+     * What the player needs from a decoder of one stream. Packets go in from the read thread,
+     * frames come out of sharedFrameBuffer to the displayer, and decoding runs on the decoder's own thread.
+     * The implementations are created by the backends in DecoderRegistry.
+     */
+    class MediaDecoder{
+        
+        std::atomic<int> failureCount;
+    
+    protected:
+    
+        /** Called by the decoding side for every packet or frame, failures in a row make it failing. */
+        inline void countDecodeResult(bool succeeded){
+            if (succeeded) {
+                if (failureCount.load(std::memory_order_relaxed) != 0) failureCount.store(0, std::memory_order_relaxed);
+            }else{
+                failureCount.store(failureCount.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+            }
+        }
+    
+    public:
+    
+        std::string name;
+        AVMediaType type;
+        MediaTimeFilter *mediaTimeFilter = nullptr;
+        //the name of the backend which created it.
+        const char *backendName = "";
+        
+        MediaDecoder(AVMediaType type):failureCount(0),type(type){};
+        virtual ~MediaDecoder(){};
+        
+        /** Limit the packet and frame buffers by bytes and media duration. */
+        virtual void setBufferBudget(RecycleBufferBudget packetBudget, RecycleBufferBudget frameBudget) = 0;
+        /** Options of software decoding, others ignore it. It takes effect in prepareDecode. */
+        virtual void setDecoderConfig(TFMPDecoderConfig config){};
+        virtual TFMPDecodeThreadInfo getThreadInfo(){
+            return {TFMPDecodeThreadNone, 0};
+        }
+        
+        /** False if the stream can't be decoded by it, then it's freed and another backend is tried. */
+        virtual bool prepareDecode() = 0;
+        virtual void startDecode() = 0;
+        virtual void stopDecode() = 0;
+        
+        virtual void insertPacket(AVPacket *packet) = 0;
+        /** Insert a run of packets with one synchronisation, every wait for free space lasts timeout seconds at most.
+         * @return the count of packets taken over, the rest still belong to the caller.
+         */
+        virtual int insertPackets(AVPacket **packets, int count, double timeout) = 0;
+        /** The stream ends, output the frames which are held. */
+        virtual void insertEndPacket(){};
+        
+        virtual RecycleBuffer<TFMPFrame*> *sharedFrameBuffer() = 0;
+        
+        virtual void activeBlock(bool flag) = 0;
+        virtual void flush() = 0;
+        virtual void freeResources() = 0;
+        
+        virtual bool bufferIsEmpty() = 0;
+        /** The media duration of waiting packets and frames, unit is second. */
+        virtual double bufferedDuration() = 0;
+        /** The reading thread will be blocked by this decoder. */
+        virtual bool packetBufferIsFull() = 0;
+        /** The decode loop is waiting for packets. */
+        virtual bool packetBufferIsEmpty() = 0;
+        
+        /** Report the lateness of displayed frames to it. */
+        virtual DecodeDegrader *getDegrader() = 0;
+        
+        /** Free the unused storages of the buffers, e.g. on memory warning. */
+        virtual void releaseUnusedMemory() = 0;
+        virtual RecycleBufferAllocStats packetAllocStats() = 0;
+        virtual RecycleBufferAllocStats frameAllocStats() = 0;
+        virtual RecycleBufferTelemetry packetTelemetry() = 0;
+        virtual RecycleBufferTelemetry frameTelemetry() = 0;
+        virtual TFMPFramePoolStats framePoolStats() = 0;
+        
+        /** Decoding has failed TFMPDecodeFailureLimit times in a row, another backend may do better. */
+        bool isFailing(){
+            return failureCount.load(std::memory_order_relaxed) >= TFMPDecodeFailureLimit;
+        }
+        void resetFailures(){
+            failureCount.store(0, std::memory_order_relaxed);
+        }
+    };
+}
+
+#endif /* MediaDecoder_hpp */
@@ -29,9 +29,20 @@ namespace tfmpcore {
         double minMediaTime = 0;
         
         inline bool checkFrame(AVFrame *frame, bool isVideo){
+            return checkPts(frame->pts);
+        };
+        
+        inline bool checkPts(int64_t pts){
             if (!enable) return true;
             
-            return (frame->pts * av_q2d(timeBase)) > minMediaTime;
+            return (pts * av_q2d(timeBase)) > minMediaTime;
+        };
+        
+        /** The frame of this packet will be filtered, so it needn't be decoded unless other frames refer to it. */
+        inline bool isBeforeTarget(AVPacket *pkt){
+            if (!enable || pkt->pts == AV_NOPTS_VALUE) return false;
+            
+            return !checkPts(pkt->pts);
         };
     };
 }
@@ -31,15 +31,36 @@ typedef struct{
 bool PlayController::connectAndOpenMedia(std::string mediaPath){
     
     this->mediaPath = mediaPath;
+    int64_t stepStartTime = av_gettime_relative(), connectStartTime = stepStartTime;
+    startupStats = {0, 0, 0, 0, false, 0};
     
     av_register_all();
     avformat_network_init();
     
+    streamDecoderConfig = decoderConfig;
+    streamPacketBudget = packetBufferBudget;
+    if (liveConfig.enabled) {
+        streamDecoderConfig.lowDelay = true;
+        //packets beyond dropLatency would be dropped anyway, don't block reading before it.
+        streamPacketBudget.maxDuration = liveConfig.dropLatency+1;
+    }
+    liveEdgeTime = -1;
+    liveStats = {-1, 1, 0};
+    
     fmtCtx = avformat_alloc_context();
     if (!fmtCtx) {
         return false;
     }
     
+    if (liveConfig.enabled) {
+        //probing a live stream waits for new data, start with what comes first.
+        fmtCtx->probesize = 32*1024;
+        fmtCtx->max_analyze_duration = 0.5*AV_TIME_BASE;
+        fmtCtx->flags |= AVFMT_FLAG_NOBUFFER;
+    }
+    
+    openCustomIO();
+    
 //    fmtCtx->interrupt_callback = {connectFail, this};
     int retval = avformat_open_input(&fmtCtx, mediaPath.c_str(), NULL, NULL);
     TFCheckRetvalAndGotoFail("avformat_open_input");
@@ -48,30 +69,39 @@ bool PlayController::connectAndOpenMedia(std::string mediaPath){
         goto fail;
     }
     abortConnecting = false;
+    startupStats.openTime = (av_gettime_relative()-stepStartTime)/1000000.0;
     
-    //configure options to get faster
-    retval = avformat_find_stream_info(fmtCtx, NULL);
+    retval = probeStreams();
     TFCheckRetvalAndGotoFail("avformat_find_stream_info");
     
+    stepStartTime = av_gettime_relative();
     for (int i = 0; i<fmtCtx->nb_streams; i++) {
         
         AVMediaType type = fmtCtx->streams[i]->codecpar->codec_type;
         if (type == AVMEDIA_TYPE_VIDEO) {
-#if EnableVTBDecode
-            videoDecoder = new VTBDecoder(fmtCtx, i, type);
-#else
-            videoDecoder = new Decoder(fmtCtx, i, type);
-#endif
-            videoDecoder->mediaTimeFilter = new MediaTimeFilter(fmtCtx->streams[i]->time_base);
-            videoDecoder->name = "videoDecoder";
+            videoBackends = DecoderRegistry::backendsForStream(fmtCtx->streams[i]);
+            videoFallbackCount = 0;
+            videoFallbackRequested = false;
+            videoDecoder = openDecoder(i, videoBackends, 0, &videoBackendIndex);
+            if (videoDecoder == nullptr) {
+                goto fail;
+            }
             videoStrem = i;
         }else if (type == AVMEDIA_TYPE_AUDIO){
-            audioDecoder = new Decoder(fmtCtx, i, type);
-            audioDecoder->name = "audioDecoder";
-            audioDecoder->mediaTimeFilter = new MediaTimeFilter(fmtCtx->streams[i]->time_base);
+            std::vector<TFMPDecoderBackend> backends = DecoderRegistry::backendsForStream(fmtCtx->streams[i]);
+            int usedBackend = -1;
+            audioDecoder = openDecoder(i, backends, 0, &usedBackend);
+            if (audioDecoder == nullptr) {
+                goto fail;
+            }
             audioStream = i;
         }else if (type == AVMEDIA_TYPE_SUBTITLE){
-            subtitleDecoder = new Decoder(fmtCtx, i, type);
+            std::vector<TFMPDecoderBackend> backends = DecoderRegistry::backendsForStream(fmtCtx->streams[i]);
+            int usedBackend = -1;
+            subtitleDecoder = openDecoder(i, backends, 0, &usedBackend);
+            if (subtitleDecoder == nullptr) {
+                goto fail;
+            }
             subTitleStream = i;
         }
     }
@@ -79,18 +109,7 @@ bool PlayController::connectAndOpenMedia(std::string mediaPath){
     if (videoStrem < 0 && audioStream < 0) {
         goto fail;
     }
-    
-    if (videoDecoder && !videoDecoder->prepareDecode()) {
-        goto fail;
-    }
-    
-    if (audioDecoder && !audioDecoder->prepareDecode()) {
-        goto fail;
-    }
-    
-    if (subtitleDecoder && !subtitleDecoder->prepareDecode()) {
-        goto fail;
-    }
+    startupStats.decoderTime = (av_gettime_relative()-stepStartTime)/1000000.0;
     
     displayer = new DisplayController();
     
@@ -109,17 +128,28 @@ bool PlayController::connectAndOpenMedia(std::string mediaPath){
     if (videoStrem >= 0) {
         displayer->shareVideoBuffer = videoDecoder->sharedFrameBuffer();
         displayer->videoTimeBase = fmtCtx->streams[videoStrem]->time_base;
+        displayer->videoFrameTimingFunc = videoFrameTimed;
     }
     if (audioStream >= 0) {
         displayer->shareAudioBuffer = audioDecoder->sharedFrameBuffer();
         displayer->audioTimeBase = fmtCtx->streams[audioStream]->time_base;
     }
     
+    displayer->firstFramePresentedFunc = firstFramePresentedAfterSeek;
+    displayer->eventContext = this;
+    
     calculateRealDisplayMediaType();
+    updateStreamDiscard();
     setupSyncClock();
     
     duration = fmtCtx->duration/(double)AV_TIME_BASE;
     
+    setupKeyframeIndex();
+    
+    startupStats.totalTime = (av_gettime_relative()-connectStartTime)/1000000.0;
+    TFMPDLOG_C("startup open: %.3f probe: %.3f(cached: %d) decoder: %.3f total: %.3f\n", startupStats.openTime, startupStats.probeTime,
+               startupStats.probeCacheHit, startupStats.decoderTime, startupStats.totalTime);
+    
     prapareOK = true;
     
     return true;
@@ -127,12 +157,186 @@ bool PlayController::connectAndOpenMedia(std::string mediaPath){
 fail:
     avformat_close_input(&fmtCtx);
     avformat_free_context(fmtCtx);
-    if (videoDecoder) free(videoDecoder);
-    if (audioDecoder) free(audioDecoder);
-    if (subtitleDecoder) free(subtitleDecoder);
+    freeCustomIO();
+    delete videoDecoder;
+    delete audioDecoder;
+    delete subtitleDecoder;
+    videoDecoder = nullptr;
+    audioDecoder = nullptr;
+    subtitleDecoder = nullptr;
     return false;
 }
 
+MediaDecoder *PlayController::openDecoder(int streamIndex, std::vector<TFMPDecoderBackend> &backends, int firstBackend, int *usedBackend){
+    
+    AVMediaType type = fmtCtx->streams[streamIndex]->codecpar->codec_type;
+    
+    for (int i = firstBackend; i<backends.size(); i++) {
+        MediaDecoder *decoder = backends[i].create(fmtCtx, streamIndex, type);
+        decoder->backendName = backends[i].name;
+        
+        if (type == AVMEDIA_TYPE_VIDEO) {
+            decoder->name = "videoDecoder";
+            decoder->mediaTimeFilter = new MediaTimeFilter(fmtCtx->streams[streamIndex]->time_base);
+            decoder->setBufferBudget(streamPacketBudget, videoFrameBufferBudget);
+            decoder->getDegrader()->enabled = decodeDegradeEnabled;
+        }else if (type == AVMEDIA_TYPE_AUDIO){
+            decoder->name = "audioDecoder";
+            decoder->mediaTimeFilter = new MediaTimeFilter(fmtCtx->streams[streamIndex]->time_base);
+            decoder->setBufferBudget(streamPacketBudget, audioFrameBufferBudget);
+        }
+        decoder->setDecoderConfig(streamDecoderConfig);
+        
+        if (decoder->prepareDecode()) {
+            TFMPDLOG_C("%s uses backend %s\n", decoder->name.c_str(), decoder->backendName);
+            *usedBackend = i;
+            return decoder;
+        }
+        
+        printf("backend %s failed to prepare stream %d\n", backends[i].name, streamIndex);
+        decoder->freeResources();
+        delete decoder->mediaTimeFilter;
+        delete decoder;
+    }
+    
+    return nullptr;
+}
+
+//It's called in seeking when the reading is stopped and the decoders are flushed.
+bool PlayController::fallbackVideoDecoder(){
+    
+    MediaDecoder *oldDecoder = videoDecoder;
+    int usedBackend = -1;
+    MediaDecoder *newDecoder = openDecoder(videoStrem, videoBackends, videoBackendIndex+1, &usedBackend);
+    if (newDecoder == nullptr) {
+        oldDecoder->resetFailures();
+        return false;
+    }
+    printf("video decoder falls back from %s to %s\n", oldDecoder->backendName, newDecoder->backendName);
+    
+    videoDecoder = newDecoder;
+    videoBackendIndex = usedBackend;
+    videoFallbackCount++;
+    
+    //the displayer leaves the old frames before they're freed.
+    displayer->replaceVideoBuffer(newDecoder->sharedFrameBuffer());
+    if ((realDisplayMediaType & TFMP_MEDIA_TYPE_VIDEO) && !(realDisplayMediaType & TFMP_MEDIA_TYPE_AUDIO)) {
+        newDecoder->sharedFrameBuffer()->addObserver(this, 1, false, videoFrameSizeNotified);
+    }
+    
+    oldDecoder->stopDecode();
+    oldDecoder->freeResources();
+    delete oldDecoder->mediaTimeFilter;
+    delete oldDecoder;
+    
+    newDecoder->startDecode();
+    
+    return true;
+}
+
+int PlayController::probeStreams(){
+    
+    std::string cachePath;
+    ProbeCache cache;
+    if (!probeCacheDir.empty()) {
+        char fileName[32];
+        snprintf(fileName, sizeof(fileName), "%016llx.tfpc", (unsigned long long)ProbeCache::mediaIdentity(fmtCtx));
+        cachePath = probeCacheDir+"/"+fileName;
+    }
+    
+    int retval = 0;
+    int64_t startTime = av_gettime_relative();
+    if (!cachePath.empty() && cache.load(cachePath)) {
+        //the short probe reads only the start, the cache fills what it misses.
+        int64_t probesize = fmtCtx->probesize, analyzeDuration = fmtCtx->max_analyze_duration;
+        fmtCtx->probesize = TFMPProbeCacheProbeSize;
+        fmtCtx->max_analyze_duration = TFMPProbeCacheAnalyzeDuration;
+        retval = avformat_find_stream_info(fmtCtx, NULL);
+        fmtCtx->probesize = probesize;
+        fmtCtx->max_analyze_duration = analyzeDuration;
+        
+        if (retval >= 0 && cache.restore(fmtCtx)) {
+            startupStats.probeCacheHit = true;
+            startupStats.probeTime = (av_gettime_relative()-startTime)/1000000.0;
+            startupStats.probeTimeSaved = fmax(cache.probeTime-startupStats.probeTime, 0);
+            return retval;
+        }
+        //the media has changed, probe again from where the short probe stopped.
+        TFMPDLOG_C("probe cache mismatch: %s\n", cachePath.c_str());
+    }
+    
+    int64_t fullStartTime = av_gettime_relative();
+    retval = avformat_find_stream_info(fmtCtx, NULL);
+    startupStats.probeTime = (av_gettime_relative()-startTime)/1000000.0;
+    if (retval >= 0 && !cachePath.empty()) {
+        ProbeCache::save(cachePath, fmtCtx, (av_gettime_relative()-fullStartTime)/1000000.0);
+    }
+    
+    return retval;
+}
+
+void PlayController::setupKeyframeIndex(){
+    //audio packets are all keyframes, only video needs the index.
+    if (!keyframeIndexEnabled || videoStrem < 0 || fmtCtx->pb == nullptr ||
+        (fmtCtx->iformat->flags & AVFMT_NO_BYTE_SEEK) || !(fmtCtx->pb->seekable & AVIO_SEEKABLE_NORMAL)) {
+        return;
+    }
+    
+    uint64_t identity = KeyframeIndex::mediaIdentity(fmtCtx);
+    keyframeIndex = new KeyframeIndex(identity, videoStrem);
+    readCursor = {KeyframeIndex::CursorStart};
+    
+    if (!keyframeIndexDir.empty()) {
+        char fileName[32];
+        snprintf(fileName, sizeof(fileName), "%016llx.tfki", (unsigned long long)identity);
+        keyframeIndexPath = keyframeIndexDir+"/"+fileName;
+        if (keyframeIndex->load(keyframeIndexPath)) {
+            TFMPDLOG_C("load keyframe index: %zu keyframes\n", keyframeIndex->count());
+        }
+    }
+}
+
+void PlayController::openCustomIO(){
+    //a custom pb isn't closed by avformat_close_input, it's freed by freeCustomIO.
+    if (mappedFileEnabled && MappedFileIO::isLocalPath(mediaPath)) {
+        mappedFileIO = new MappedFileIO();
+        if (mappedFileIO->open(mediaPath.c_str())) {
+            fmtCtx->pb = mappedFileIO->ioContext();
+            return;
+        }
+        delete mappedFileIO;
+        mappedFileIO = nullptr;
+    }
+    
+    //a live stream is read as it comes, buffering ahead only adds latency, and it has nothing to play again.
+    if (readAheadEnabled && !liveConfig.enabled) {
+        readAheadIO = new ReadAheadIO(readAheadCacheSize);
+        DiskCache *diskCache = nullptr;
+        if (!diskCacheDir.empty() && !MappedFileIO::isLocalPath(mediaPath)) {
+            diskCache = new DiskCache(diskCacheDir, diskCacheBudget);
+        }
+        if (readAheadIO->open(mediaPath.c_str(), diskCache)) {
+            fmtCtx->pb = readAheadIO->ioContext();
+            return;
+        }
+        delete readAheadIO;
+        readAheadIO = nullptr;
+    }
+    
+    //FFmpeg opens it, with its own error.
+}
+
+void PlayController::freeCustomIO(){
+    if (mappedFileIO) {
+        delete mappedFileIO;
+        mappedFileIO = nullptr;
+    }
+    if (readAheadIO) {
+        delete readAheadIO;
+        readAheadIO = nullptr;
+    }
+}
+
 #pragma mark - controls
 
 void PlayController::cancelConnecting(){
@@ -147,6 +351,9 @@ void PlayController::play(){
     readable = true;
     
     startReadingFrames();
+    if (keyframeIndex && keyframeIndexScan) {
+        keyframeIndex->startScan(mediaPath, keyframeIndexPath);
+    }
     if (videoDecoder) {
         videoDecoder->startDecode();
     }
@@ -157,18 +364,15 @@ void PlayController::play(){
         subtitleDecoder->startDecode();
     }
     
+    //hold displaying until there is enough data.
+    startBuffering(true);
     displayer->startDisplay();
     
-    
-    //observe the exhaustion of buffers.
-    Decoder *checkDecoder = nullptr;
-    
+    //observe the exhaustion of frames.
     if (realDisplayMediaType & TFMP_MEDIA_TYPE_AUDIO) {
-        audioDecoder->sharedFrameBuffer()->addObserver(this, bufferEmptySize, false, videoFrameSizeNotified);
-        audioDecoder->sharedFrameBuffer()->addObserver(this, playResumeSize, true, videoFrameSizeNotified);
+        audioDecoder->sharedFrameBuffer()->addObserver(this, 1, false, videoFrameSizeNotified);
     }else if(realDisplayMediaType & TFMP_MEDIA_TYPE_VIDEO){
-//        videoDecoder->sharedFrameBuffer()->addObserver(this, bufferEmptySize, false, videoFrameSizeNotified);
-//        videoDecoder->sharedFrameBuffer()->addObserver(this, playResumeSize, true, videoFrameSizeNotified);
+        videoDecoder->sharedFrameBuffer()->addObserver(this, 1, false, videoFrameSizeNotified);
     }
     
 }
@@ -182,6 +386,11 @@ void PlayController::pause(bool flag){
     
     paused = flag;
     
+    //the displaying will be resumed when buffering is done.
+    if (!flag && buffering) {
+        return;
+    }
+    
     //just change state of displaying, don't change state of reading.
     displayer->pause(flag);
     //TODO: resume readable if paused is false.
@@ -255,6 +464,12 @@ void *PlayController::seekOperation(void *context){
         playController->subtitleDecoder->flush();
     }
     
+    //a video decoder which keeps failing is replaced now, nothing is flowing through it.
+    if (playController->videoFallbackRequested) {
+        playController->fallbackVideoDecoder();
+        playController->videoFallbackRequested = false;
+    }
+    
     playController->displayer->flush();
     
     //3. enable mediaTimeFilter to filter unqualified frames whose pts is earlier than seeking time.
@@ -282,14 +497,29 @@ void *PlayController::seekOperation(void *context){
     
     
     
-    //4. seek stream to new position
+    //4. seek stream to new position, straight to the keyframe if it's indexed.
     int retval = -1;
-    if (playController->videoStrem >= 0) {
-        retval = av_seek_frame(playController->fmtCtx, playController->videoStrem, time/av_q2d(playController->fmtCtx->streams[playController->videoStrem]->time_base), AVSEEK_FLAG_BACKWARD);
-        TFCheckRetval("seek video");
-    }else if (playController->audioStream >= 0){
-        retval = av_seek_frame(playController->fmtCtx, playController->audioStream, time/av_q2d(playController->fmtCtx->streams[playController->audioStream]->time_base), AVSEEK_FLAG_BACKWARD);
-        TFCheckRetval("seek audio");
+    if (playController->keyframeIndex) {
+        playController->readCursor = {KeyframeIndex::CursorBroken};
+        
+        TFMPKeyframeEntry keyframe;
+        AVRational timeBase = playController->fmtCtx->streams[playController->videoStrem]->time_base;
+        if (playController->keyframeIndex->lookup(time/av_q2d(timeBase), &keyframe)) {
+            retval = av_seek_frame(playController->fmtCtx, playController->videoStrem, keyframe.pos, AVSEEK_FLAG_BYTE);
+            TFCheckRetval("seek by keyframe index");
+        }
+    }
+    if (retval < 0) {
+        //a discarded stream has no packets to find the timestamp in, seek by the displayed one.
+        bool seekVideo = playController->videoStrem >= 0 &&
+            ((playController->realDisplayMediaType & TFMP_MEDIA_TYPE_VIDEO) || playController->audioStream < 0);
+        if (seekVideo) {
+            retval = av_seek_frame(playController->fmtCtx, playController->videoStrem, time/av_q2d(playController->fmtCtx->streams[playController->videoStrem]->time_base), AVSEEK_FLAG_BACKWARD);
+            TFCheckRetval("seek video");
+        }else if (playController->audioStream >= 0){
+            retval = av_seek_frame(playController->fmtCtx, playController->audioStream, time/av_q2d(playController->fmtCtx->streams[playController->audioStream]->time_base), AVSEEK_FLAG_BACKWARD);
+            TFCheckRetval("seek audio");
+        }
     }
     
     if (retval < 0) { //seek failed
@@ -308,13 +538,17 @@ void *PlayController::seekOperation(void *context){
         }
     }
     
-    //5. turn on inlet
+    //5. turn on inlet, and keep displaying paused until there is enough data.
+    playController->prepareForSeeking = false;
+    if (retval >= 0) {
+        playController->startBuffering(true);
+    }else{
+        playController->displayer->pause(false);
+    }
+    
     playController->readable = true;
     TFMPCondSignal(playController->read_cond, playController->read_mutex);
     
-    playController->prepareForSeeking = false;
-    playController->displayer->pause(false);
-    
     
     free(context);
     
@@ -324,6 +558,14 @@ void *PlayController::seekOperation(void *context){
 
 void PlayController::seekTo(double time){
     
+    pthread_mutex_lock(&buffering_mutex);
+    if (seekStartTime < 0) seekStartTime = av_gettime_relative()/1000000.0;
+    pthread_mutex_unlock(&buffering_mutex);
+    
+    startSeekOperation(time);
+}
+
+void PlayController::startSeekOperation(double time){
     auto param = new TFMPSeekOpParams();
     param->playController = this;
     param->seekTime = time;
@@ -339,6 +581,178 @@ void PlayController::seekByForward(double interval){
     seekTo(seekTime);
 }
 
+void PlayController::startBuffering(bool startup){
+    
+    pthread_mutex_lock(&buffering_mutex);
+    bool changed = !buffering;
+    if (changed) {
+        bufferingStartTime = av_gettime_relative()/1000000.0;
+        if (!startup) bufferingStats.rebufferCount++;
+    }
+    buffering = true;
+    startupBuffering = startup;
+    bufferingStats.isBuffering = true;
+    displayer->pause(true);
+    pthread_mutex_unlock(&buffering_mutex);
+    
+    if (changed && bufferingStateChanged) {
+        bufferingStateChanged(this, true);
+    }
+}
+
+void PlayController::checkBuffering(){
+    
+    if (prepareForSeeking || stoping) {
+        return;
+    }
+    
+    bool start = false, done = false;
+    TFMPBufferingConfig config = activeBufferingConfig();
+    
+    pthread_mutex_lock(&buffering_mutex);
+    double bufferedDuration = majorBufferedDuration();
+    
+    if (buffering) {
+        
+        //packet buffer is full means the reading is blocked, we can't wait for more.
+        double target = startupBuffering ? config.startupDuration : config.rebufferDuration;
+        done = bufferedDuration >= target || checkingEnd || anyPacketBufferFull();
+        
+        if (!done && startupBuffering && config.fastStartup) {
+            MediaDecoder *majorDecoder = isAudioMajor ? audioDecoder : nullptr;
+            if (majorDecoder) {
+                done = !majorDecoder->sharedFrameBuffer()->isEmpty();
+            }else if (videoDecoder){
+                done = !videoDecoder->sharedFrameBuffer()->isEmpty();
+            }
+        }
+        
+        if (done) {
+            double bufferingTime = av_gettime_relative()/1000000.0 - bufferingStartTime;
+            if (startupBuffering) {
+                bufferingStats.lastStartupTime = bufferingTime;
+            }else{
+                bufferingStats.rebufferTime += bufferingTime;
+            }
+            
+            buffering = false;
+            bufferingStats.isBuffering = false;
+            if (!paused) displayer->pause(false);
+        }
+        
+    }else if (!checkingEnd && bufferedDuration < config.lowDuration){
+        start = true;
+    }
+    pthread_mutex_unlock(&buffering_mutex);
+    
+    if (start) {
+        startBuffering(false);
+    }else if (done){
+        bufferDone();
+    }
+}
+
+TFMPBufferingConfig PlayController::activeBufferingConfig(){
+    if (liveConfig.enabled) {
+        //buffering more than the target only adds latency.
+        return {liveConfig.targetLatency/2, liveConfig.targetLatency, 0, true};
+    }
+    return bufferingConfig;
+}
+
+double PlayController::majorBufferedDuration(){
+    if (isAudioMajor && audioDecoder) {
+        return audioDecoder->bufferedDuration();
+    }else if (videoDecoder){
+        return videoDecoder->bufferedDuration();
+    }
+    return 0;
+}
+
+bool PlayController::anyPacketBufferFull(){
+    return (videoDecoder && videoDecoder->packetBufferIsFull()) ||
+           (audioDecoder && audioDecoder->packetBufferIsFull()) ||
+           (subtitleDecoder && subtitleDecoder->packetBufferIsFull());
+}
+
+TFMPBufferingStats PlayController::getBufferingStats(){
+    pthread_mutex_lock(&buffering_mutex);
+    TFMPBufferingStats stats = bufferingStats;
+    pthread_mutex_unlock(&buffering_mutex);
+    return stats;
+}
+
+TFMPSeekStats PlayController::getSeekStats(){
+    pthread_mutex_lock(&buffering_mutex);
+    TFMPSeekStats stats = seekStats;
+    pthread_mutex_unlock(&buffering_mutex);
+    return stats;
+}
+
+TFMPLiveStats PlayController::getLiveStats(){
+    pthread_mutex_lock(&buffering_mutex);
+    TFMPLiveStats stats = liveStats;
+    pthread_mutex_unlock(&buffering_mutex);
+    return stats;
+}
+
+TFMPDecodeThreadInfo PlayController::getDecodeThreadInfo(TFMPMediaType mediaType){
+    if (mediaType == TFMP_MEDIA_TYPE_VIDEO && videoDecoder) {
+        return videoDecoder->getThreadInfo();
+    }
+    if (mediaType == TFMP_MEDIA_TYPE_AUDIO && audioDecoder) {
+        return audioDecoder->getThreadInfo();
+    }
+    return {TFMPDecodeThreadNone, 0};
+}
+
+TFMPDecoderBackendInfo PlayController::getDecoderBackendInfo(TFMPMediaType mediaType){
+    if (mediaType == TFMP_MEDIA_TYPE_VIDEO && videoDecoder) {
+        return {videoDecoder->backendName, videoFallbackCount};
+    }
+    if (mediaType == TFMP_MEDIA_TYPE_AUDIO && audioDecoder) {
+        return {audioDecoder->backendName, 0};
+    }
+    return {"", 0};
+}
+
+TFMPStartupStats PlayController::getStartupStats(){
+    return startupStats;
+}
+
+TFMPReadAheadStats PlayController::getReadAheadStats(){
+    if (readAheadIO) {
+        return readAheadIO->getStats();
+    }
+    return {0, 0, 0, 0, 0, 0, 0};
+}
+
+TFMPQueueTelemetry PlayController::getQueueTelemetry(){
+    TFMPQueueTelemetry telemetry = {};
+    
+    if (videoDecoder) {
+        telemetry.videoPacket = videoDecoder->packetTelemetry();
+        telemetry.videoFrame = videoDecoder->frameTelemetry();
+        telemetry.videoFramePool = videoDecoder->framePoolStats();
+    }
+    if (audioDecoder) {
+        telemetry.audioPacket = audioDecoder->packetTelemetry();
+        telemetry.audioFrame = audioDecoder->frameTelemetry();
+        telemetry.audioFramePool = audioDecoder->framePoolStats();
+    }
+    telemetry.packetPool = TFMPPacketPool::getStats();
+    if (videoDecoder) telemetry.videoDegrade = videoDecoder->getDegrader()->getStats();
+    
+    return telemetry;
+}
+
+void PlayController::releaseUnusedMemory(){
+    if (videoDecoder) videoDecoder->releaseUnusedMemory();
+    if (audioDecoder) audioDecoder->releaseUnusedMemory();
+    if (subtitleDecoder) subtitleDecoder->releaseUnusedMemory();
+    TFMPPacketPool::trim();
+}
+
 void PlayController::bufferDone(){
     
     if (prepareForSeeking) {
@@ -376,28 +790,44 @@ void *PlayController::freeResources(void *context){
     //read thread
     myStateObserver.labelMark("freeResources", "read thread");
     TFMPCondSignal(playController->read_cond, playController->read_mutex);
+    //reading frames may be waiting for the I/O thread.
+    if (playController->readAheadIO) {
+        playController->readAheadIO->abort();
+    }
     pthread_mutex_lock(&playController->waitLoopMutex);
     if (playController->reading) {
         pthread_cond_wait(&playController->waitLoopCond, &playController->waitLoopMutex);
     }
     pthread_mutex_unlock(&playController->waitLoopMutex);
     
+    playController->clearGOPCache();
+    
+    if (playController->keyframeIndex) {
+        playController->keyframeIndex->stopScan();
+        if (!playController->keyframeIndexPath.empty()) {
+            playController->keyframeIndex->save(playController->keyframeIndexPath);
+        }
+        delete playController->keyframeIndex;
+        playController->keyframeIndex = nullptr;
+        playController->keyframeIndexPath.clear();
+    }
+    
     //decodes
     if (playController->videoDecoder) {
         myStateObserver.labelMark("freeResources", "videoDecoder");
         playController->videoDecoder->freeResources();
-        free(playController->videoDecoder);
+        delete playController->videoDecoder;
         playController->videoDecoder = nullptr;
     }
     if (playController->audioDecoder) {
         myStateObserver.labelMark("freeResources", "audioDecoder");
         playController->audioDecoder->freeResources();
-        free(playController->audioDecoder);
+        delete playController->audioDecoder;
         playController->audioDecoder = nullptr;
     }
     if (playController->subtitleDecoder) {
         playController->subtitleDecoder->freeResources();
-        free(playController->subtitleDecoder);
+        delete playController->subtitleDecoder;
         playController->subtitleDecoder = nullptr;
     }
     
@@ -412,6 +842,7 @@ void *PlayController::freeResources(void *context){
         avformat_close_input(&playController->fmtCtx);
         avformat_free_context(playController->fmtCtx);
     }
+    playController->freeCustomIO();
     
     playController->resetStatus();
     
@@ -437,6 +868,18 @@ void PlayController::resetStatus(){
     prepareForSeeking = false;
     markTime = 0;
     
+    buffering = false;
+    startupBuffering = false;
+    bufferingStats = {0, 0, 0, false};
+    seekStartTime = -1;
+    seekStats = {0, 0, 0, 0};
+    
+    videoBackends.clear();
+    videoBackendIndex = -1;
+    videoFallbackRequested = false;
+    
+    liveEdgeTime = -1;
+    liveStats = {-1, 1, 0};
 }
 
 #pragma mark - properties
@@ -444,6 +887,9 @@ void PlayController::resetStatus(){
 TFMPFillAudioBufferStruct PlayController::getFillAudioBufferStruct(){
     return displayer->getFillAudioBufferStruct();
 }
+bool PlayController::redisplayVideoFrame(){
+    return displayer && displayer->redisplayVideoFrame();
+}
 DisplayController *PlayController::getDisplayer(){
     return displayer;
 }
@@ -453,7 +899,7 @@ double PlayController::getDuration(){
 }
 
 double PlayController::getCurrentTime(){
-
+    
     
     double playTime = displayer->getPlayTime();
     if (seeking || paused || playTime < 0) {  //invalid time
@@ -485,12 +931,28 @@ void PlayController::setDesiredDisplayMediaType(TFMPMediaType desiredDisplayMedi
     this->desiredDisplayMediaType = desiredDisplayMediaType;
     if (prapareOK) {
         calculateRealDisplayMediaType();
+        streamDiscardChanged = true;
         
         //media type may changed, sync clock need to change.
         setupSyncClock();
     }
 }
 
+void PlayController::updateStreamDiscard(){
+    for (int i = 0; i<fmtCtx->nb_streams; i++) {
+        bool consumed = ((realDisplayMediaType & TFMP_MEDIA_TYPE_VIDEO) && i == videoStrem) ||
+                        ((realDisplayMediaType & TFMP_MEDIA_TYPE_AUDIO) && i == audioStream) ||
+                        ((realDisplayMediaType & TFMP_MEDIA_TYPE_SUBTITLE) && i == subTitleStream);
+        AVDiscard discard = consumed ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+        
+        //keyframes are skipped while video is discarded, the next one read can't be linked to the former.
+        if (i == videoStrem && discard == AVDISCARD_ALL && fmtCtx->streams[i]->discard != AVDISCARD_ALL) {
+            readCursor = {KeyframeIndex::CursorBroken};
+        }
+        fmtCtx->streams[i]->discard = discard;
+    }
+}
+
 void PlayController::setupSyncClock(){
     if (!(realDisplayMediaType & TFMP_MEDIA_TYPE_AUDIO) && isAudioMajor) isAudioMajor = false;
     if (!(realDisplayMediaType & TFMP_MEDIA_TYPE_VIDEO) && !isAudioMajor) isAudioMajor = true;
@@ -548,6 +1010,9 @@ void * PlayController::readFrame(void *context){
             TFMPCondSignal(controller->waitLoopCond, controller->waitLoopMutex);
             myStateObserver.mark("reading", 2);
             
+            //stop reading for seeking or stopping, the packets read before are useless.
+            controller->freePacketRun();
+            
             pthread_mutex_lock(&controller->read_mutex);
             if (!controller->readable) {
                 pthread_cond_wait(&controller->read_cond, &controller->read_mutex);
@@ -561,44 +1026,69 @@ void * PlayController::readFrame(void *context){
             controller->reading = true;
         }
         
+        if (controller->streamDiscardChanged.exchange(false)) controller->updateStreamDiscard();
+        
         myStateObserver.mark("reading", 5);
-        packet = av_packet_alloc();
+        packet = TFMPPacketPool::acquire();
         int retval = av_read_frame(controller->fmtCtx, packet);
-
+        
         if(retval < 0){
             if (retval == AVERROR_EOF) {
                 endFile = true;
+                if (controller->keyframeIndex) {
+                    controller->keyframeIndex->markEnd(&controller->readCursor);
+                }
+                controller->handOffPacketRun();
+                
+                if (controller->videoDecoder && (controller->realDisplayMediaType & TFMP_MEDIA_TYPE_VIDEO)) {
+                    controller->videoDecoder->insertEndPacket();
+                }
                 
                 controller->startCheckPlayFinish();
+                //no more data is coming, stop buffering.
+                if (controller->buffering) controller->checkBuffering();
                 myStateObserver.mark("reading", 6);
                 TFMPCondWait(controller->read_cond, controller->read_mutex)
             }else{
-                av_packet_free(&packet);
+                TFMPPacketPool::release(&packet);
                 continue;
             }
         }
         myStateObserver.mark("reading", 7);
         
-        if ((controller->realDisplayMediaType & TFMP_MEDIA_TYPE_VIDEO) &&
-            packet->stream_index == controller->videoStrem) {
-            
-            controller->videoDecoder->insertPacket(packet);
-            myStateObserver.timeMark("video frame in");
-            
-        }else if ((controller->realDisplayMediaType & TFMP_MEDIA_TYPE_AUDIO) &&
-                  packet->stream_index == controller->audioStream){
-            
-            controller->audioDecoder->insertPacket(packet);
-            myStateObserver.timeMark("audio frame in");
-            
-        }else if ((controller->realDisplayMediaType & TFMP_MEDIA_TYPE_SUBTITLE) &&
-                  packet->stream_index == controller->subTitleStream){
+        if (retval >= 0 && controller->keyframeIndex &&
+            packet->stream_index == controller->videoStrem && (packet->flags & AV_PKT_FLAG_KEY)) {
+            controller->keyframeIndex->addKeyframe(packet->pts, packet->pos, &controller->readCursor);
+        }
+        
+        if (((controller->realDisplayMediaType & TFMP_MEDIA_TYPE_VIDEO) &&
+             packet->stream_index == controller->videoStrem) ||
+            ((controller->realDisplayMediaType & TFMP_MEDIA_TYPE_AUDIO) &&
+             packet->stream_index == controller->audioStream) ||
+            ((controller->realDisplayMediaType & TFMP_MEDIA_TYPE_SUBTITLE) &&
+             packet->stream_index == controller->subTitleStream)) {
             
-            controller->subtitleDecoder->insertPacket(packet);
+            if (controller->liveConfig.enabled) controller->trackLivePacket(packet);
+            controller->appendPacketRun(packet);
+            //after appending, dropping frees the packet run and inserts the cached copy of this packet.
+            if (controller->liveConfig.enabled) controller->checkLiveLatency();
+        }else{
+            //packets read before discarding is applied, or from demuxers ignoring it.
+            TFMPPacketPool::release(&packet);
+        }
+        
+        if (controller->buffering) controller->checkBuffering();
+        
+        //read the stream again from the keyframe with the next backend, as seeking does.
+        if (controller->videoDecoder && controller->videoDecoder->isFailing() && !controller->videoFallbackRequested &&
+            controller->videoBackendIndex+1 < controller->videoBackends.size()) {
+            controller->videoFallbackRequested = true;
+            controller->startSeekOperation(controller->getCurrentTime());
         }
         myStateObserver.mark("reading", 8);
     }
     myStateObserver.mark("reading", 9);
+    controller->freePacketRun();
     
     controller->reading = false;
     TFMPCondSignal(controller->waitLoopCond, controller->waitLoopMutex);
@@ -606,6 +1096,216 @@ void * PlayController::readFrame(void *context){
     return 0;
 }
 
+void PlayController::appendPacketRun(AVPacket *packet){
+    if (packetRunSize > 0 && packet->stream_index != packetRunStream) {
+        handOffPacketRun();
+    }
+    
+    packetRun[packetRunSize++] = packet;
+    packetRunStream = packet->stream_index;
+    
+    //don't hold packets when the decoder is waiting for them.
+    bool decoderWaiting = false;
+    if (packetRunStream == videoStrem) {
+        decoderWaiting = videoDecoder->packetBufferIsEmpty();
+    }else if (packetRunStream == audioStream){
+        decoderWaiting = audioDecoder->packetBufferIsEmpty();
+    }else{
+        decoderWaiting = subtitleDecoder->packetBufferIsEmpty();
+    }
+    
+    if (decoderWaiting || packetRunSize == TFMPPacketRunMaxSize) {
+        handOffPacketRun();
+    }
+}
+
+void PlayController::handOffPacketRun(){
+    if (packetRunSize == 0) {
+        return;
+    }
+    
+    MediaDecoder *decoder = subtitleDecoder;
+    if (packetRunStream == videoStrem) {
+        decoder = videoDecoder;
+    }else if (packetRunStream == audioStream){
+        decoder = audioDecoder;
+    }
+    
+    /* A full packet buffer blocks the reading, so the buffering must be checked while waiting,
+     * otherwise it waits for the displaying which is paused by the buffering.
+     */
+    int handed = 0;
+    double timeout = 0;
+    while (handed < packetRunSize) {
+        handed += decoder->insertPackets(packetRun+handed, packetRunSize-handed, timeout);
+        if (handed < packetRunSize && buffering) checkBuffering();
+        timeout = TFMPPacketHandOffWait;
+    }
+    
+    if (packetRunStream == videoStrem) {
+        myStateObserver.timeMark("video frame in");
+    }else if (packetRunStream == audioStream){
+        myStateObserver.timeMark("audio frame in");
+    }
+    
+    packetRunSize = 0;
+}
+
+void PlayController::freePacketRun(){
+    for (int i = 0; i<packetRunSize; i++) {
+        TFMPPacketPool::release(&packetRun[i]);
+    }
+    packetRunSize = 0;
+}
+
+#pragma mark - live
+
+void PlayController::trackLivePacket(AVPacket *packet){
+    
+    int majorStream = isAudioMajor ? audioStream : videoStrem;
+    if (packet->stream_index == majorStream && packet->pts != AV_NOPTS_VALUE) {
+        double endTime = (packet->pts+packet->duration)*av_q2d(fmtCtx->streams[majorStream]->time_base);
+        if (endTime > liveEdgeTime) liveEdgeTime = endTime;
+    }
+    
+    //without video every packet is a keyframe, nothing to keep.
+    if (!(realDisplayMediaType & TFMP_MEDIA_TYPE_VIDEO)) {
+        return;
+    }
+    
+    if (packet->stream_index == videoStrem && (packet->flags & AV_PKT_FLAG_KEY)) {
+        clearGOPCache();
+        gopCacheValid = true;
+    }
+    if (!gopCacheValid) {
+        return;
+    }
+    
+    //the GOP is too long to keep, wait for the next keyframe.
+    if (gopCache.size() >= TFMPLiveGOPCacheMaxSize) {
+        clearGOPCache();
+        return;
+    }
+    
+    AVPacket *refPkt = TFMPPacketPool::acquire();
+    if (av_packet_ref(refPkt, packet) < 0) {
+        TFMPPacketPool::release(&refPkt);
+        clearGOPCache();
+        return;
+    }
+    gopCache.push_back(refPkt);
+}
+
+void PlayController::clearGOPCache(){
+    for (auto &cachedPkt : gopCache) {
+        TFMPPacketPool::release(&cachedPkt);
+    }
+    gopCache.clear();
+    gopCacheValid = false;
+}
+
+void PlayController::checkLiveLatency(){
+    
+    if (seeking || prepareForSeeking || buffering || paused || liveEdgeTime < 0) {
+        return;
+    }
+    
+    double playTime = displayer->getPlayTime();
+    if (playTime < 0) {
+        return;
+    }
+    
+    double latency = liveEdgeTime - playTime;
+    
+    pthread_mutex_lock(&buffering_mutex);
+    liveStats.latency = latency;
+    pthread_mutex_unlock(&buffering_mutex);
+    
+    if (latency > liveConfig.dropLatency) {
+        TFMPDLOG_C("live latency %.3fs, drop to the latest keyframe\n", latency);
+        dropToLatestKeyframe();
+        return;
+    }
+    
+    double speed = displayer->getPlaybackSpeed();
+    double newSpeed = speed;
+    if (latency > liveConfig.catchUpLatency) {
+        newSpeed = liveConfig.catchUpSpeed;
+    }else if (latency <= liveConfig.targetLatency){
+        newSpeed = 1;
+    }
+    
+    if (newSpeed != speed) {
+        displayer->setPlaybackSpeed(newSpeed);
+        pthread_mutex_lock(&buffering_mutex);
+        liveStats.speed = newSpeed;
+        pthread_mutex_unlock(&buffering_mutex);
+    }
+}
+
+//It's called by the read thread, so unlike seeking, reading needn't be stopped.
+void PlayController::dropToLatestKeyframe(){
+    
+    //buffering checks are skipped while the buffers are flushed, the same as seeking.
+    prepareForSeeking = true;
+    
+    freePacketRun();
+    
+    if (videoDecoder) videoDecoder->activeBlock(false);
+    if (audioDecoder) audioDecoder->activeBlock(false);
+    if (subtitleDecoder) subtitleDecoder->activeBlock(false);
+    
+    if (videoDecoder) videoDecoder->flush();
+    if (audioDecoder) audioDecoder->flush();
+    if (subtitleDecoder) subtitleDecoder->flush();
+    displayer->flush();
+    
+    //restart from the latest keyframe, or only from the packets coming next if there isn't one.
+    double restartTime = liveEdgeTime;
+    if (!gopCache.empty()) {
+        AVPacket *keyframe = gopCache.front();
+        if (keyframe->pts != AV_NOPTS_VALUE) {
+            restartTime = keyframe->pts*av_q2d(fmtCtx->streams[videoStrem]->time_base);
+        }
+    }
+    if (videoDecoder) {
+        videoDecoder->mediaTimeFilter->enable = true;
+        videoDecoder->mediaTimeFilter->minMediaTime = restartTime;
+    }
+    if (audioDecoder) {
+        audioDecoder->mediaTimeFilter->enable = true;
+        audioDecoder->mediaTimeFilter->minMediaTime = restartTime;
+    }
+    
+    if (videoDecoder) videoDecoder->activeBlock(true);
+    if (audioDecoder) audioDecoder->activeBlock(true);
+    if (subtitleDecoder) subtitleDecoder->activeBlock(true);
+    
+    displayer->pause(true);
+    displayer->resetPlayTime();
+    displayer->setPlaybackSpeed(1);
+    
+    //the cache keeps its packets, the decoders take new references.
+    for (auto cachedPkt : gopCache) {
+        AVPacket *refPkt = TFMPPacketPool::acquire();
+        if (av_packet_ref(refPkt, cachedPkt) < 0) {
+            TFMPPacketPool::release(&refPkt);
+            continue;
+        }
+        appendPacketRun(refPkt);
+    }
+    handOffPacketRun();
+    
+    prepareForSeeking = false;
+    
+    pthread_mutex_lock(&buffering_mutex);
+    liveStats.speed = 1;
+    liveStats.dropCount++;
+    pthread_mutex_unlock(&buffering_mutex);
+    
+    startBuffering(true);
+}
+
 /** file has reach the end, if the data in packet buffer and frame buffer are used, all resources is showed then now it's need to stop.*/
 void PlayController::startCheckPlayFinish(){
     
@@ -625,6 +1325,31 @@ void *PlayController::signalPlayFinished(void *context){
     return 0;
 }
 
+void PlayController::videoFrameTimed(bool late, bool onTime, void *context){
+    PlayController *controller = (PlayController *)context;
+    if (controller->videoDecoder) {
+        controller->videoDecoder->getDegrader()->reportFrame(late, onTime);
+    }
+}
+
+void PlayController::firstFramePresentedAfterSeek(void *context){
+    PlayController *controller = (PlayController *)context;
+    
+    pthread_mutex_lock(&controller->buffering_mutex);
+    if (controller->seekStartTime >= 0) {
+        double latency = av_gettime_relative()/1000000.0 - controller->seekStartTime;
+        controller->seekStartTime = -1;
+        
+        TFMPSeekStats *stats = &controller->seekStats;
+        stats->seekCount++;
+        stats->lastLatency = latency;
+        stats->totalLatency += latency;
+        if (latency > stats->maxLatency) stats->maxLatency = latency;
+        TFMPDLOG_C("seek to first frame: %.3fs\n", latency);
+    }
+    pthread_mutex_unlock(&controller->buffering_mutex);
+}
+
 #pragma mark -
 
 
@@ -632,30 +1357,17 @@ bool tfmpcore::videoFrameSizeNotified(RecycleBuffer<TFMPFrame *> *buffer, int cu
     
     PlayController *controller = (PlayController *)observer;
     
-    if (curSize <= bufferEmptySize) {
-        
-        if (controller->checkingEnd){
-            TFMPCondSignal(controller->read_cond, controller->read_mutex);
-            
-            pthread_create(&controller->signalThread, nullptr, PlayController::signalPlayFinished, controller);
-            pthread_detach(controller->signalThread);
-        }else{
-            
-            if (controller->prepareForSeeking) {
-                return false;
-            }
-            
-            //buffer has ran out.We must stop playing until buffer is full again.
-            if (controller->bufferingStateChanged) {
-                controller->bufferingStateChanged(controller, true);
-            }
-        }
-
-    }else if (curSize >= playResumeSize){
+    //frames have ran out.
+    if (controller->checkingEnd){
+        TFMPCondSignal(controller->read_cond, controller->read_mutex);
         
-        controller->bufferDone();
+        pthread_create(&controller->signalThread, nullptr, PlayController::signalPlayFinished, controller);
+        pthread_detach(controller->signalThread);
+    }else{
         
+        //We must stop playing until buffer is enough again, if there is few packets left.
+        controller->checkBuffering();
     }
-
+    
     return false;
 }
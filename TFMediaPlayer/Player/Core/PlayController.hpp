@@ -17,7 +17,7 @@ extern "C"{
 #include <stdio.h>
 #include <string>
 #include "Decoder.hpp"
-#include "VTBDecoder.h"
+#include "DecoderRegistry.hpp"
 #include <pthread.h>
 #include <functional>
 #include "DisplayController.hpp"
@@ -25,14 +25,102 @@ extern "C"{
 #include "AudioResampler.hpp"
 #include "TFMPDebugFuncs.h"
 #include "TFMPFrame.h"
+#include "KeyframeIndex.hpp"
+#include "ReadAheadIO.hpp"
+#include "MappedFileIO.hpp"
+#include "ProbeCache.hpp"
+#include <vector>
+#include <atomic>
+
+#define TFMPPacketRunMaxSize    8
+//how long the reading waits for a full packet buffer before checking buffering again, unit is second.
+#define TFMPPacketHandOffWait   0.1
+#define TFMPLiveGOPCacheMaxSize 1024
+//the short probe with a cached probe result.
+#define TFMPProbeCacheProbeSize         (32*1024)
+#define TFMPProbeCacheAnalyzeDuration   (AV_TIME_BASE/10)
 
 namespace tfmpcore {
     
     bool videoFrameSizeNotified(RecycleBuffer<TFMPFrame *> *buffer, int curSize, bool isGreater,void *observer);
     typedef int (*FillAudioBufferFunc)(void *buffer, int64_t size, void *context);
     
-    static int playResumeSize = 20;
-    static int bufferEmptySize = 1;
+    /** Watermarks of buffering, unit is second of buffered media of the major stream, including packets and frames. */
+    typedef struct{
+        double startupDuration;   //buffered duration to start playing after play or seek.
+        double rebufferDuration;  //buffered duration to resume playing after running out, it should be greater than lowDuration.
+        double lowDuration;       //start rebuffering when frames run out and buffered duration is less than it.
+        bool fastStartup;         //start playing as soon as the first frame is decoded, optimizing time to first frame.
+    }TFMPBufferingConfig;
+    
+    typedef struct{
+        int rebufferCount;
+        double rebufferTime;      //total time of rebuffering, unit is second.
+        double lastStartupTime;   //time from play or seek to start playing, unit is second.
+        bool isBuffering;
+    }TFMPBufferingStats;
+    
+    /** Latency from calling seekTo to presenting the first frame, unit is second.
+     * A seek called before the former one presents a frame is counted with it, from the first call.
+     */
+    typedef struct{
+        int seekCount;
+        double lastLatency;
+        double maxLatency;
+        double totalLatency;
+    }TFMPSeekStats;
+    
+    /** Low-latency playing of live streams, unit is second.
+     * Latency is measured from the newest packet read to the media being presented, the delay before the packet arrives isn't included.
+     * Playing goes catchUpSpeed times faster above catchUpLatency until it's back to targetLatency,
+     * and above dropLatency the buffered media is dropped and playing restarts from the latest keyframe.
+     */
+    typedef struct{
+        bool enabled;
+        double targetLatency;
+        double catchUpLatency;
+        double dropLatency;
+        double catchUpSpeed;
+    }TFMPLiveConfig;
+    
+    typedef struct{
+        double latency;           //the last measured, negative before playing.
+        double speed;
+        int dropCount;
+    }TFMPLiveStats;
+    
+    /** Where the time of connectAndOpenMedia goes, unit is second. */
+    typedef struct{
+        double openTime;          //avformat_open_input, connecting and reading the header.
+        double probeTime;         //avformat_find_stream_info.
+        double decoderTime;       //finding and opening the decoders.
+        double totalTime;
+        bool probeCacheHit;       //the probe was short and the cached result was used.
+        double probeTimeSaved;    //the cached full probe time minus the short probe time, 0 if the cache isn't used.
+    }TFMPStartupStats;
+    
+    /** The backend decoding a stream, fallbackCount counts the times it fell back to the next backend while playing. */
+    typedef struct{
+        const char *name;         //empty if the stream has no decoder.
+        int fallbackCount;
+    }TFMPDecoderBackendInfo;
+    
+    /** Counters of the decoders' queues and frame pools, a missing stream leaves its part zero.
+     * Where stalls come from:
+     * packet queues blocked empty and frame queues running out -> I/O is slow;
+     * packet queues full or blocked full while frame queues are blocked empty -> decoding is slow;
+     * frame queues blocked full -> rendering or audio output is slow.
+     */
+    typedef struct{
+        RecycleBufferTelemetry videoPacket;
+        RecycleBufferTelemetry videoFrame;
+        RecycleBufferTelemetry audioPacket;
+        RecycleBufferTelemetry audioFrame;
+        TFMPFramePoolStats videoFramePool;
+        TFMPFramePoolStats audioFramePool;
+        TFMPPacketPoolStats packetPool;  //shared by all players.
+        TFMPDegradeStats videoDegrade;
+    }TFMPQueueTelemetry;
     
     class PlayController{
         
@@ -45,20 +133,31 @@ namespace tfmpcore {
         int audioStream = -1;
         int subTitleStream = -1;
         
-#if EnableVTBDecode
-        VTBDecoder *videoDecoder = nullptr;
-#else
-        Decoder *videoDecoder = nullptr;
-#endif
-        Decoder *audioDecoder = nullptr;
-        Decoder *subtitleDecoder = nullptr;
+        MediaDecoder *videoDecoder = nullptr;
+        MediaDecoder *audioDecoder = nullptr;
+        MediaDecoder *subtitleDecoder = nullptr;
+        
+        //Decoders are created by the backends which can decode their streams, tried in order.
+        TFMPDecoderConfig streamDecoderConfig;
+        RecycleBufferBudget streamPacketBudget;
+        MediaDecoder *openDecoder(int streamIndex, std::vector<TFMPDecoderBackend> &backends, int firstBackend, int *usedBackend);
+        //The video decoder falls back to the next backend when it keeps failing, and the stream is read again from the keyframe.
+        std::vector<TFMPDecoderBackend> videoBackends;
+        int videoBackendIndex = -1;
+        int videoFallbackCount = 0;
+        bool videoFallbackRequested = false;
+        bool fallbackVideoDecoder();
         
         DisplayController *displayer = nullptr;
         
         TFMPMediaType desiredDisplayMediaType = TFMP_MEDIA_TYPE_ALL_AVIABLE;
         TFMPMediaType realDisplayMediaType = TFMP_MEDIA_TYPE_NONE;
         void calculateRealDisplayMediaType();
-
+        //Streams which aren't displayed are discarded by the demuxer, their packets aren't read or allocated.
+        //It's applied by the read thread when the display type changes while playing, the flag is set after realDisplayMediaType.
+        std::atomic<bool> streamDiscardChanged{false};
+        void updateStreamDiscard();
+        
         double duration = 0;
         
         
@@ -76,6 +175,13 @@ namespace tfmpcore {
         void startReadingFrames();
         pthread_t readThread;
         static void * readFrame(void *context);
+        //Packets of one stream are handed off to the decoder in runs, it's done at once when the decoder is waiting.
+        AVPacket *packetRun[TFMPPacketRunMaxSize];
+        int packetRunSize = 0;
+        int packetRunStream = -1;
+        void appendPacketRun(AVPacket *packet);
+        void handOffPacketRun();
+        void freePacketRun();
         
         //2. pause and resume
         bool paused = false;   //It's order from outerside, not state of player. In other word, it's a mark.
@@ -94,9 +200,30 @@ namespace tfmpcore {
         pthread_t signalThread;
         static void *signalPlayFinished(void *context);
         
+        //the displayer reports video frames' lateness to the video decoder.
+        static void videoFrameTimed(bool late, bool onTime, void *context);
+        static void firstFramePresentedAfterSeek(void *context);
+        
         //5. seek
         pthread_t seekThread;
         static void * seekOperation(void *context);
+        void startSeekOperation(double time);
+        //Keyframes of the video stream, seeking jumps to the indexed keyframe by bytes.
+        KeyframeIndex *keyframeIndex = nullptr;
+        KeyframeIndex::Cursor readCursor = {KeyframeIndex::CursorStart};
+        std::string keyframeIndexPath;
+        void setupKeyframeIndex();
+        
+        //a short probe with the cached result if there is one, or a full probe which is then cached.
+        int probeStreams();
+        TFMPStartupStats startupStats = {0, 0, 0, 0, false, 0};
+        
+        //The demuxer reads from one of them instead of the url: a local file is mapped,
+        //others are read ahead by an I/O thread while reading frames is blocked.
+        MappedFileIO *mappedFileIO = nullptr;
+        ReadAheadIO *readAheadIO = nullptr;
+        void openCustomIO();
+        void freeCustomIO();
         /**
          * The state of seeking.
          * It becomes true when the user drags the progressBar and loose fingers.
@@ -106,6 +233,31 @@ namespace tfmpcore {
         bool prepareForSeeking = false;
         double markTime = 0;  //The media time that seek to or start to pause.
         
+        //7. buffering. Displaying is paused while buffering, the read thread and running out of frames drive the state.
+        bool buffering = false;
+        bool startupBuffering = false;  //buffering for play or seek, not for running out.
+        double bufferingStartTime = 0;
+        TFMPBufferingStats bufferingStats = {0, 0, 0, false};
+        //seek stats are guarded by buffering_mutex too, seekStartTime is negative without pending seek.
+        double seekStartTime = -1;
+        TFMPSeekStats seekStats = {0, 0, 0, 0};
+        pthread_mutex_t buffering_mutex = PTHREAD_MUTEX_INITIALIZER;
+        void startBuffering(bool startup);
+        void checkBuffering();
+        double majorBufferedDuration();
+        bool anyPacketBufferFull();
+        TFMPBufferingConfig activeBufferingConfig();
+        
+        //8. live. Packets since the latest video keyframe are kept, so dropping to the live edge doesn't wait for the next keyframe.
+        std::vector<AVPacket *> gopCache;
+        bool gopCacheValid = false;
+        double liveEdgeTime = -1;
+        TFMPLiveStats liveStats = {-1, 1, 0};  //guarded by buffering_mutex.
+        void trackLivePacket(AVPacket *packet);
+        void checkLiveLatency();
+        void dropToLatestKeyframe();
+        void clearGOPCache();
+        
         //6. free
         pthread_t freeThread;
         static void * freeResources(void *context);
@@ -113,7 +265,7 @@ namespace tfmpcore {
         bool reading = false;
         pthread_cond_t waitLoopCond = PTHREAD_COND_INITIALIZER;
         pthread_mutex_t waitLoopMutex = PTHREAD_MUTEX_INITIALIZER;
-
+    
     public:
         
         ~PlayController(){
@@ -147,6 +299,19 @@ namespace tfmpcore {
         
         std::function<void(PlayController*, bool)> bufferingStateChanged;
         
+        TFMPBufferingConfig bufferingConfig = {1, 3, 0.5, false};
+        TFMPBufferingStats getBufferingStats();
+        TFMPSeekStats getSeekStats();
+        
+        /** Set it before connectAndOpenMedia. It probes less, decodes with low delay and keeps short buffers,
+         * and bufferingConfig is replaced by watermarks from targetLatency.
+         */
+        TFMPLiveConfig liveConfig = {false, 1, 2, 5, 1.1};
+        TFMPLiveStats getLiveStats();
+        
+        /** A snapshot of the queue counters, it's lock-free and can be called from any thread while playing. */
+        TFMPQueueTelemetry getQueueTelemetry();
+        
         /** properties **/
         
         double getDuration();
@@ -155,6 +320,55 @@ namespace tfmpcore {
         //the real value is affect by realDisplayMediaType. For example, there is no audio stream, isAudioMajor couldn't be true.
         bool isAudioMajor = true;
         
+        /** Budgets of the decoders' buffers, set them before connectAndOpenMedia. 0 means no limit.
+         * The packet budget is for every stream.
+         */
+        RecycleBufferBudget packetBufferBudget = {0, 5};
+        RecycleBufferBudget videoFrameBufferBudget = {200*1024*1024, 0};
+        RecycleBufferBudget audioFrameBufferBudget = {0, 1};
+        
+        /** Options of software decoders, set it before connectAndOpenMedia. Hardware decoding ignores it. */
+        TFMPDecoderConfig decoderConfig = {0, TFMPDecodeThreadAuto, false, false, 0.1};
+        /** The threading which the software decoder of video or audio really uses, valid after connectAndOpenMedia. */
+        TFMPDecodeThreadInfo getDecodeThreadInfo(TFMPMediaType mediaType);
+        /** The backend which decodes video or audio, see DecoderRegistry for choosing backends. */
+        TFMPDecoderBackendInfo getDecoderBackendInfo(TFMPMediaType mediaType);
+        
+        /** Skip more and more video decoding work while frames are displayed late, and go back while they're on time.
+         * Set it before connectAndOpenMedia.
+         */
+        bool decodeDegradeEnabled = true;
+        
+        /** Index keyframes of the video while reading, and seek to them by bytes. It's only for containers which can seek by bytes,
+         * and helps those with sparse or no index, e.g. MPEG-TS and FLV. Set them before connectAndOpenMedia.
+         */
+        bool keyframeIndexEnabled = true;
+        bool keyframeIndexScan = false;  //read the whole file in background to complete the index, it costs a second stream of I/O.
+        std::string keyframeIndexDir;    //directory of the sidecar files of indexes, empty means they're not saved.
+        
+        /** Read the media ahead into a memory cache of readAheadCacheSize bytes on an I/O thread, independent of the packet buffers.
+         * It's off for live streams, see liveConfig. Set them before connectAndOpenMedia.
+         */
+        bool readAheadEnabled = true;
+        int readAheadCacheSize = 8*1024*1024;
+        /** Read local files through a memory mapping, it goes before reading ahead. Set it before connectAndOpenMedia. */
+        bool mappedFileEnabled = true;
+        /** Keep the bytes of network media in files of diskCacheDir, so playing again and seeking back read them from disk.
+         * It works with reading ahead, for media with a known size. Empty means no disk cache, set them before connectAndOpenMedia.
+         */
+        std::string diskCacheDir;
+        int64_t diskCacheBudget = 512*1024*1024;  //bytes of all files in the directory, least recently played ones are evicted.
+        /** Directory of the cached results of probing streams, empty means probing fully every time. Set it before connectAndOpenMedia. */
+        std::string probeCacheDir;
+        /** The breakdown of the last connectAndOpenMedia. */
+        TFMPStartupStats getStartupStats();
+        
+        /** Throughput of the I/O thread and the hit rate of the demuxer's reading, all 0 if reading ahead isn't used. */
+        TFMPReadAheadStats getReadAheadStats();
+        
+        /** Free unused storages of the buffers, call it on memory warning. Buffered values are kept. */
+        void releaseUnusedMemory();
+        
         void setDesiredDisplayMediaType(TFMPMediaType desiredDisplayMediaType);
         TFMPMediaType getRealDisplayMediaType(){
             return realDisplayMediaType;
@@ -163,9 +377,12 @@ namespace tfmpcore {
         
         void *displayContext = nullptr;
         TFMPVideoFrameDisplayFunc displayVideoFrame = nullptr;
-
+        
         TFMPFillAudioBufferStruct getFillAudioBufferStruct();
         
+        /** Display the last video frame again, e.g. the view is redrawn while paused. */
+        bool redisplayVideoFrame();
+        
         DisplayController *getDisplayer();
         /** The source part inputs source audio stream desc, the platform-special part return a audio stream desc that will be fine for both parts. */
         std::function<TFMPAudioStreamDescription(TFMPAudioStreamDescription)> negotiateAdoptedPlayAudioDesc;
@@ -0,0 +1,278 @@
+//
+//  ProbeCache.cpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/28.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#include "ProbeCache.hpp"
+#include "TFMPDebugFuncs.h"
+#include <stdio.h>
+#include <string.h>
+
+#define TFMPProbeCacheMagic     "TFPC"
+#define TFMPProbeCacheVersion   1
+//a stream with more extradata than it is taken as broken.
+#define TFMPProbeCacheMaxExtradata  (1024*1024)
+
+using namespace tfmpcore;
+
+static inline void writeInt64(std::vector<uint8_t> &bytes, int64_t value){
+    for (int i = 0; i<8; i++) {
+        bytes.push_back((uint8_t)((uint64_t)value >> (i*8)));
+    }
+}
+
+static inline void writeBytes(std::vector<uint8_t> &bytes, const uint8_t *data, int64_t size){
+    writeInt64(bytes, size);
+    if (size > 0) bytes.insert(bytes.end(), data, data+size);
+}
+
+//reading fails softly, every read after running out gives 0 and ok becomes false.
+typedef struct{
+    const uint8_t *data;
+    const uint8_t *end;
+    bool ok;
+}TFMPProbeCacheReader;
+
+static inline int64_t readInt64(TFMPProbeCacheReader *reader){
+    if (reader->end-reader->data < 8) {
+        reader->ok = false;
+        return 0;
+    }
+    uint64_t value = 0;
+    for (int i = 0; i<8; i++) {
+        value |= (uint64_t)reader->data[i] << (i*8);
+    }
+    reader->data += 8;
+    return (int64_t)value;
+}
+
+static inline std::vector<uint8_t> readBytes(TFMPProbeCacheReader *reader, int64_t maxSize){
+    int64_t size = readInt64(reader);
+    if (size < 0 || size > maxSize || reader->end-reader->data < size) {
+        reader->ok = false;
+        return {};
+    }
+    std::vector<uint8_t> bytes(reader->data, reader->data+size);
+    reader->data += size;
+    return bytes;
+}
+
+uint64_t ProbeCache::mediaIdentity(AVFormatContext *fmtCtx){
+    uint64_t hash = 14695981039346656037ULL;  //FNV-1a
+    
+    std::string key = fmtCtx->filename;
+    key += fmtCtx->iformat ? fmtCtx->iformat->name : "";
+    int64_t size = fmtCtx->pb ? avio_size(fmtCtx->pb) : -1;
+    key.append((const char *)&size, sizeof(size));
+    
+    for (char c : key) {
+        hash ^= (uint8_t)c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * "TFPC", version, url, probe time in microsecond, duration, start time, bit rate, count of streams, then streams.
+ * Numbers are 8 bytes, little-endian, and bytes are led by their size.
+ */
+bool ProbeCache::save(std::string path, AVFormatContext *fmtCtx, double probeTime){
+    std::vector<uint8_t> bytes;
+    
+    bytes.insert(bytes.end(), TFMPProbeCacheMagic, TFMPProbeCacheMagic+4);
+    bytes.push_back(TFMPProbeCacheVersion);
+    writeBytes(bytes, (const uint8_t *)fmtCtx->filename, strlen(fmtCtx->filename));
+    writeInt64(bytes, (int64_t)(probeTime*1000000));
+    writeInt64(bytes, fmtCtx->duration);
+    writeInt64(bytes, fmtCtx->start_time);
+    writeInt64(bytes, fmtCtx->bit_rate);
+    writeInt64(bytes, fmtCtx->nb_streams);
+    
+    for (int i = 0; i<fmtCtx->nb_streams; i++) {
+        AVStream *stream = fmtCtx->streams[i];
+        AVCodecParameters *codecpar = stream->codecpar;
+        writeInt64(bytes, codecpar->codec_type);
+        writeInt64(bytes, codecpar->codec_id);
+        writeInt64(bytes, codecpar->codec_tag);
+        writeInt64(bytes, codecpar->format);
+        writeInt64(bytes, codecpar->bit_rate);
+        writeInt64(bytes, codecpar->bits_per_coded_sample);
+        writeInt64(bytes, codecpar->profile);
+        writeInt64(bytes, codecpar->level);
+        writeInt64(bytes, codecpar->width);
+        writeInt64(bytes, codecpar->height);
+        writeInt64(bytes, codecpar->sample_aspect_ratio.num);
+        writeInt64(bytes, codecpar->sample_aspect_ratio.den);
+        writeInt64(bytes, codecpar->channel_layout);
+        writeInt64(bytes, codecpar->channels);
+        writeInt64(bytes, codecpar->sample_rate);
+        writeInt64(bytes, codecpar->frame_size);
+        writeInt64(bytes, stream->avg_frame_rate.num);
+        writeInt64(bytes, stream->avg_frame_rate.den);
+        writeInt64(bytes, stream->r_frame_rate.num);
+        writeInt64(bytes, stream->r_frame_rate.den);
+        writeInt64(bytes, stream->start_time);
+        writeInt64(bytes, stream->duration);
+        writeBytes(bytes, codecpar->extradata, codecpar->extradata_size);
+    }
+    
+    std::string tempPath = path+".tmp";
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if (file == nullptr) {
+        printf("open probe cache file error: %s\n", tempPath.c_str());
+        return false;
+    }
+    bool succeed = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+    succeed = fclose(file) == 0 && succeed;
+    if (succeed) {
+        succeed = rename(tempPath.c_str(), path.c_str()) == 0;
+    }
+    if (!succeed) {
+        remove(tempPath.c_str());
+        printf("write probe cache file error: %s\n", path.c_str());
+    }
+    
+    return succeed;
+}
+
+bool ProbeCache::load(std::string path){
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    
+    std::vector<uint8_t> bytes;
+    uint8_t buffer[4096];
+    size_t readSize = 0;
+    while ((readSize = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        bytes.insert(bytes.end(), buffer, buffer+readSize);
+    }
+    fclose(file);
+    
+    if (bytes.size() < 5 || memcmp(bytes.data(), TFMPProbeCacheMagic, 4) != 0 || bytes[4] != TFMPProbeCacheVersion) {
+        return false;
+    }
+    
+    TFMPProbeCacheReader reader = {bytes.data()+5, bytes.data()+bytes.size(), true};
+    std::vector<uint8_t> urlBytes = readBytes(&reader, bytes.size());
+    url.assign(urlBytes.begin(), urlBytes.end());
+    probeTime = readInt64(&reader)/1000000.0;
+    duration = readInt64(&reader);
+    startTime = readInt64(&reader);
+    bitRate = readInt64(&reader);
+    int64_t count = readInt64(&reader);
+    if (!reader.ok || count < 0 || count > bytes.size()) {
+        return false;
+    }
+    
+    streams.clear();
+    for (int64_t i = 0; i<count && reader.ok; i++) {
+        StreamParams params;
+        params.codecType = (AVMediaType)readInt64(&reader);
+        params.codecId = (AVCodecID)readInt64(&reader);
+        params.codecTag = (uint32_t)readInt64(&reader);
+        params.format = (int)readInt64(&reader);
+        params.bitRate = readInt64(&reader);
+        params.bitsPerCodedSample = (int)readInt64(&reader);
+        params.profile = (int)readInt64(&reader);
+        params.level = (int)readInt64(&reader);
+        params.width = (int)readInt64(&reader);
+        params.height = (int)readInt64(&reader);
+        params.sampleAspectRatio.num = (int)readInt64(&reader);
+        params.sampleAspectRatio.den = (int)readInt64(&reader);
+        params.channelLayout = (uint64_t)readInt64(&reader);
+        params.channels = (int)readInt64(&reader);
+        params.sampleRate = (int)readInt64(&reader);
+        params.frameSize = (int)readInt64(&reader);
+        params.avgFrameRate.num = (int)readInt64(&reader);
+        params.avgFrameRate.den = (int)readInt64(&reader);
+        params.rFrameRate.num = (int)readInt64(&reader);
+        params.rFrameRate.den = (int)readInt64(&reader);
+        params.startTime = readInt64(&reader);
+        params.duration = readInt64(&reader);
+        params.extradata = readBytes(&reader, TFMPProbeCacheMaxExtradata);
+        streams.push_back(params);
+    }
+    
+    return reader.ok && reader.data == reader.end;
+}
+
+bool ProbeCache::matches(AVFormatContext *fmtCtx){
+    //another media with the same hash.
+    if (url != fmtCtx->filename || streams.size() != fmtCtx->nb_streams) {
+        return false;
+    }
+    
+    for (int i = 0; i<fmtCtx->nb_streams; i++) {
+        AVCodecParameters *codecpar = fmtCtx->streams[i]->codecpar;
+        StreamParams &params = streams[i];
+        
+        if (codecpar->codec_type != params.codecType) {
+            return false;
+        }
+        if (codecpar->codec_id != AV_CODEC_ID_NONE && codecpar->codec_id != params.codecId) {
+            return false;
+        }
+        //what the short probe has found must be the same.
+        if ((codecpar->width && codecpar->width != params.width) ||
+            (codecpar->height && codecpar->height != params.height) ||
+            (codecpar->sample_rate && codecpar->sample_rate != params.sampleRate) ||
+            (codecpar->channels && codecpar->channels != params.channels)) {
+            return false;
+        }
+        if (codecpar->extradata_size > 0 &&
+            (codecpar->extradata_size != params.extradata.size() || memcmp(codecpar->extradata, params.extradata.data(), params.extradata.size()) != 0)) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+bool ProbeCache::restore(AVFormatContext *fmtCtx){
+    if (!matches(fmtCtx)) {
+        return false;
+    }
+    
+    for (int i = 0; i<fmtCtx->nb_streams; i++) {
+        AVStream *stream = fmtCtx->streams[i];
+        AVCodecParameters *codecpar = stream->codecpar;
+        StreamParams &params = streams[i];
+        
+        if (codecpar->codec_id == AV_CODEC_ID_NONE) codecpar->codec_id = params.codecId;
+        if (codecpar->codec_tag == 0) codecpar->codec_tag = params.codecTag;
+        if (codecpar->format < 0) codecpar->format = params.format;
+        if (codecpar->bit_rate == 0) codecpar->bit_rate = params.bitRate;
+        if (codecpar->bits_per_coded_sample == 0) codecpar->bits_per_coded_sample = params.bitsPerCodedSample;
+        if (codecpar->profile < 0) codecpar->profile = params.profile;
+        if (codecpar->level < 0) codecpar->level = params.level;
+        if (codecpar->width == 0) codecpar->width = params.width;
+        if (codecpar->height == 0) codecpar->height = params.height;
+        if (codecpar->sample_aspect_ratio.num == 0) codecpar->sample_aspect_ratio = params.sampleAspectRatio;
+        if (codecpar->channel_layout == 0) codecpar->channel_layout = params.channelLayout;
+        if (codecpar->channels == 0) codecpar->channels = params.channels;
+        if (codecpar->sample_rate == 0) codecpar->sample_rate = params.sampleRate;
+        if (codecpar->frame_size == 0) codecpar->frame_size = params.frameSize;
+        if (stream->avg_frame_rate.num == 0) stream->avg_frame_rate = params.avgFrameRate;
+        if (stream->r_frame_rate.num == 0) stream->r_frame_rate = params.rFrameRate;
+        if (stream->start_time == AV_NOPTS_VALUE) stream->start_time = params.startTime;
+        if (stream->duration == AV_NOPTS_VALUE) stream->duration = params.duration;
+        
+        if (codecpar->extradata_size == 0 && !params.extradata.empty()) {
+            codecpar->extradata = (uint8_t *)av_mallocz(params.extradata.size()+AV_INPUT_BUFFER_PADDING_SIZE);
+            if (codecpar->extradata) {
+                memcpy(codecpar->extradata, params.extradata.data(), params.extradata.size());
+                codecpar->extradata_size = (int)params.extradata.size();
+            }
+        }
+    }
+    
+    if (fmtCtx->duration == AV_NOPTS_VALUE) fmtCtx->duration = duration;
+    if (fmtCtx->start_time == AV_NOPTS_VALUE) fmtCtx->start_time = startTime;
+    if (fmtCtx->bit_rate == 0) fmtCtx->bit_rate = bitRate;
+    
+    return true;
+}
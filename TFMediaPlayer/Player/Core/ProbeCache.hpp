@@ -0,0 +1,76 @@
+//
+//  ProbeCache.hpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/28.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#ifndef ProbeCache_hpp
+#define ProbeCache_hpp
+
+extern "C"{
+#include <libavformat/avformat.h>
+}
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace tfmpcore {
+    
+    /**
+     * What avformat_find_stream_info found in a media: the layout of streams and their codec parameters, extradata included.
+     *
+     * It's saved to a file after a full probe, and when the media is opened again, a short probe runs and the cached parameters
+     * fill what the short probe misses. The cache is only used if the streams found by the short probe agree with it.
+     */
+    class ProbeCache{
+        
+        typedef struct{
+            AVMediaType codecType;
+            AVCodecID codecId;
+            uint32_t codecTag;
+            int format;
+            int64_t bitRate;
+            int bitsPerCodedSample;
+            int profile;
+            int level;
+            int width;
+            int height;
+            AVRational sampleAspectRatio;
+            uint64_t channelLayout;
+            int channels;
+            int sampleRate;
+            int frameSize;
+            AVRational avgFrameRate;
+            AVRational rFrameRate;
+            int64_t startTime;
+            int64_t duration;
+            std::vector<uint8_t> extradata;
+        }StreamParams;
+        
+        std::string url;
+        int64_t duration = AV_NOPTS_VALUE;
+        int64_t startTime = AV_NOPTS_VALUE;
+        int64_t bitRate = 0;
+        std::vector<StreamParams> streams;
+        
+        bool matches(AVFormatContext *fmtCtx);
+    
+    public:
+    
+        double probeTime = 0;   //seconds the full probe took when it was saved.
+        
+        /** An identity of the media from its url, format and size, which are known before probing. Used to name its file. */
+        static uint64_t mediaIdentity(AVFormatContext *fmtCtx);
+        
+        static bool save(std::string path, AVFormatContext *fmtCtx, double probeTime);
+        bool load(std::string path);
+        
+        /** Fill the parameters the probe missed from the cache, false and nothing changed if the streams don't agree with it. */
+        bool restore(AVFormatContext *fmtCtx);
+    };
+}
+
+#endif /* ProbeCache_hpp */
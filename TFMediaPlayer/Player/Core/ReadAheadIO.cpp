@@ -0,0 +1,342 @@
+//
+//  ReadAheadIO.cpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/25.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#include "ReadAheadIO.hpp"
+#include "TFMPDebugFuncs.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+extern "C"{
+#include <libavutil/time.h>
+}
+
+#define TFMPReadAheadIOBufferSize   (32*1024)
+
+using namespace tfmpcore;
+
+ReadAheadIO::ReadAheadIO(int cacheSize, int blockSize):blockSize(blockSize),abortRequest(false){
+    maxBlocks = std::max(cacheSize/blockSize, 4);
+    behindBlocks = maxBlocks/4;
+}
+
+int ReadAheadIO::interrupted(void *context){
+    return ((ReadAheadIO *)context)->abortRequest.load();
+}
+
+bool ReadAheadIO::open(const char *url, DiskCache *diskCache){
+    
+    this->diskCache = diskCache;
+    
+    AVIOInterruptCB interruptCB = {interrupted, this};
+    int retval = avio_open2(&source, url, AVIO_FLAG_READ, &interruptCB, NULL);
+    if (retval < 0) {
+        printf("read ahead open %s error: %d\n", url, retval);
+        close();
+        return false;
+    }
+    sourceSize = avio_size(source);
+    
+    if (diskCache && !diskCache->open(url, sourceSize)) {
+        delete diskCache;
+        this->diskCache = nullptr;
+    }
+    
+    uint8_t *buffer = (uint8_t *)av_malloc(TFMPReadAheadIOBufferSize);
+    ioCtx = avio_alloc_context(buffer, TFMPReadAheadIOBufferSize, 0, this, readPacket, NULL, seek);
+    if (ioCtx == nullptr) {
+        av_free(buffer);
+        avio_closep(&source);
+        return false;
+    }
+    ioCtx->seekable = source->seekable;
+    
+    abortRequest = false;
+    ioThreadStarted = pthread_create(&ioThread, NULL, ioLoop, this) == 0;
+    if (!ioThreadStarted) {
+        close();
+        return false;
+    }
+    
+    return true;
+}
+
+void ReadAheadIO::abort(){
+    pthread_mutex_lock(&mutex);
+    abortRequest = true;
+    pthread_cond_signal(&fillCond);
+    pthread_cond_broadcast(&readCond);
+    pthread_mutex_unlock(&mutex);
+}
+
+void ReadAheadIO::close(){
+    if (ioThreadStarted) {
+        abort();
+        pthread_join(ioThread, NULL);
+        ioThreadStarted = false;
+    }
+    
+    if (source) avio_closep(&source);
+    if (ioCtx) {
+        av_freep(&ioCtx->buffer);
+        avio_context_free(&ioCtx);
+    }
+    
+    for (auto &pair : blocks) {
+        av_free(pair.second.data);
+    }
+    blocks.clear();
+    
+    if (diskCache) {
+        delete diskCache;
+        diskCache = nullptr;
+    }
+    
+    readPos = 0;
+    endPos = -1;
+    sourceError = 0;
+}
+
+#pragma mark - I/O thread
+
+int64_t ReadAheadIO::nextFillBlock(){
+    if (sourceError != 0) {
+        return -1;
+    }
+    
+    int64_t block = readPos/blockSize;
+    int64_t windowEnd = block+maxBlocks-behindBlocks;
+    auto iter = blocks.lower_bound(block);
+    for (; block < windowEnd; block++) {
+        if (endPos >= 0 && block*blockSize >= endPos) {
+            return -1;
+        }
+        if (iter == blocks.end() || iter->first != block) {
+            return block;
+        }
+        iter++;
+    }
+    
+    return -1;
+}
+
+bool ReadAheadIO::evictBlock(int64_t fillBlock){
+    //blocks far behind first, then those after the block to fill, which are left by seeking and farthest ahead.
+    auto first = blocks.begin();
+    if (first != blocks.end() && first->first < readPos/blockSize-behindBlocks) {
+        av_free(first->second.data);
+        blocks.erase(first);
+        return true;
+    }
+    
+    auto last = blocks.rbegin();
+    if (last != blocks.rend() && last->first > fillBlock) {
+        av_free(last->second.data);
+        blocks.erase(std::next(last).base());
+        return true;
+    }
+    
+    return false;
+}
+
+void *ReadAheadIO::ioLoop(void *context){
+    
+    ReadAheadIO *io = (ReadAheadIO *)context;
+    int64_t sourcePos = 0;
+    
+    pthread_mutex_lock(&io->mutex);
+    while (!io->abortRequest) {
+        
+        int64_t fillBlock = io->nextFillBlock();
+        if (fillBlock < 0 || (io->blocks.size() >= io->maxBlocks && !io->evictBlock(fillBlock))) {
+            pthread_cond_wait(&io->fillCond, &io->mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&io->mutex);
+        
+        int64_t startTime = av_gettime_relative();
+        int64_t offset = fillBlock*io->blockSize;
+        uint8_t *data = (uint8_t *)av_malloc(io->blockSize);
+        int size = 0;
+        int retval = 0;
+        
+        //the whole block is on disk, the source isn't touched.
+        bool fromDisk = false;
+        if (io->diskCache) {
+            int blockLength = (int)std::min((int64_t)io->blockSize, io->sourceSize-offset);
+            if (blockLength > 0 && io->diskCache->cachedLength(offset) >= blockLength) {
+                fromDisk = io->diskCache->read(offset, data, blockLength) == blockLength;
+                if (fromDisk) {
+                    size = blockLength;
+                    if (offset+size == io->sourceSize) retval = AVERROR_EOF;
+                }
+            }
+        }
+        
+        if (!fromDisk) {
+            if (offset != sourcePos) {
+                int64_t pos = avio_seek(io->source, offset, SEEK_SET);
+                if (pos < 0) {
+                    retval = (int)pos;
+                }else{
+                    sourcePos = pos;
+                }
+            }
+            if (retval == 0) {
+                while (size < io->blockSize) {
+                    int readSize = avio_read(io->source, data+size, io->blockSize-size);
+                    if (readSize <= 0) {
+                        retval = readSize == 0 ? AVERROR_EOF : readSize;
+                        break;
+                    }
+                    size += readSize;
+                }
+                sourcePos += size;
+            }
+            if (io->diskCache && size > 0 && (retval == 0 || retval == AVERROR_EOF)) {
+                io->diskCache->write(offset, data, size);
+            }
+        }
+        
+        int64_t cost = av_gettime_relative()-startTime;
+        
+        pthread_mutex_lock(&io->mutex);
+        
+        if (fromDisk) {
+            io->diskCacheBytes += size;
+        }else{
+            io->readBytes += size;
+            io->readTime += cost;
+        }
+        
+        //a block cut by an error isn't kept, only the last block of the source is short.
+        if (size > 0 && (retval == 0 || retval == AVERROR_EOF)) {
+            io->blocks[fillBlock] = {data, size};
+        }else{
+            av_free(data);
+        }
+        
+        if (retval == AVERROR_EOF) {
+            io->endPos = offset+size;
+        }else if (retval < 0 && !io->abortRequest) {
+            printf("read ahead error at %lld: %d\n", (long long)(offset+size), retval);
+            io->sourceError = retval;
+            //the position of the source is unknown after the error.
+            sourcePos = -1;
+        }
+        
+        pthread_cond_broadcast(&io->readCond);
+    }
+    pthread_mutex_unlock(&io->mutex);
+    
+    return 0;
+}
+
+#pragma mark - demuxer side
+
+int ReadAheadIO::readPacket(void *opaque, uint8_t *buf, int buf_size){
+    
+    ReadAheadIO *io = (ReadAheadIO *)opaque;
+    bool waited = false;
+    int retval = 0;
+    
+    pthread_mutex_lock(&io->mutex);
+    while (true) {
+        if (io->abortRequest) {
+            retval = AVERROR_EXIT;
+            break;
+        }
+        if (io->endPos >= 0 && io->readPos >= io->endPos) {
+            retval = AVERROR_EOF;
+            break;
+        }
+        
+        int64_t blockIndex = io->readPos/io->blockSize;
+        auto iter = io->blocks.find(blockIndex);
+        if (iter != io->blocks.end()) {
+            int offset = (int)(io->readPos-blockIndex*io->blockSize);
+            retval = std::min(buf_size, iter->second.size-offset);
+            memcpy(buf, iter->second.data+offset, retval);
+            io->readPos += retval;
+            
+            if (waited) {
+                io->missBytes += retval;
+            }else{
+                io->hitBytes += retval;
+            }
+            //the window of reading ahead moves.
+            if (io->readPos/io->blockSize != blockIndex) {
+                pthread_cond_signal(&io->fillCond);
+            }
+            break;
+        }
+        
+        if (io->sourceError != 0) {
+            retval = io->sourceError;
+            break;
+        }
+        
+        waited = true;
+        pthread_cond_signal(&io->fillCond);
+        pthread_cond_wait(&io->readCond, &io->mutex);
+    }
+    pthread_mutex_unlock(&io->mutex);
+    
+    return retval;
+}
+
+int64_t ReadAheadIO::seek(void *opaque, int64_t offset, int whence){
+    
+    ReadAheadIO *io = (ReadAheadIO *)opaque;
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE) {
+        return io->sourceSize;
+    }
+    
+    pthread_mutex_lock(&io->mutex);
+    
+    int64_t pos = -1;
+    if (whence == SEEK_SET) {
+        pos = offset;
+    }else if (whence == SEEK_CUR){
+        pos = io->readPos+offset;
+    }else if (whence == SEEK_END && io->sourceSize >= 0){
+        pos = io->sourceSize+offset;
+    }
+    
+    if (pos >= 0) {
+        io->readPos = pos;
+        //try the source again from the new position.
+        io->sourceError = 0;
+        pthread_cond_signal(&io->fillCond);
+    }
+    
+    pthread_mutex_unlock(&io->mutex);
+    
+    return pos >= 0 ? pos : AVERROR(EINVAL);
+}
+
+TFMPReadAheadStats ReadAheadIO::getStats(){
+    pthread_mutex_lock(&mutex);
+    
+    TFMPReadAheadStats stats;
+    stats.readBytes = readBytes;
+    stats.diskCacheBytes = diskCacheBytes;
+    stats.throughput = readTime > 0 ? readBytes/(readTime/1000000.0) : 0;
+    stats.hitBytes = hitBytes;
+    stats.missBytes = missBytes;
+    stats.hitRate = hitBytes+missBytes > 0 ? hitBytes/(double)(hitBytes+missBytes) : 0;
+    stats.cachedBytes = 0;
+    for (auto &pair : blocks) {
+        stats.cachedBytes += pair.second.size;
+    }
+    
+    pthread_mutex_unlock(&mutex);
+    
+    return stats;
+}
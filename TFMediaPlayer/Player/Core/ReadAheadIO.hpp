@@ -0,0 +1,111 @@
+//
+//  ReadAheadIO.hpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/25.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#ifndef ReadAheadIO_hpp
+#define ReadAheadIO_hpp
+
+extern "C"{
+#include <libavformat/avformat.h>
+}
+
+#include <stdint.h>
+#include <pthread.h>
+#include <map>
+#include <atomic>
+#include "DiskCache.hpp"
+
+namespace tfmpcore {
+    
+    typedef struct{
+        int64_t readBytes;        //bytes read from the source by the I/O thread.
+        int64_t diskCacheBytes;   //bytes read from the disk cache instead of the source.
+        double throughput;        //bytes per second of reading from the source, the time waiting for space isn't counted.
+        int64_t hitBytes;         //bytes the demuxer got from the cache at once.
+        int64_t missBytes;        //bytes the demuxer waited for.
+        double hitRate;           //hitBytes of all bytes the demuxer got.
+        int64_t cachedBytes;
+    }TFMPReadAheadStats;
+    
+    /**
+     * An AVIOContext for the demuxer which reads from a cache of blocks, while its own I/O thread keeps reading the source
+     * ahead of the demuxer into the cache. So reading goes on when the read thread is blocked by full packet buffers,
+     * and demuxing doesn't wait for storage or network when the bytes have been read.
+     *
+     * The cache keeps some blocks behind the reading position, so seeking back a little or within the read ahead
+     * range is served from the cache without touching the source. A seek out of the cache moves the I/O thread there.
+     */
+    class ReadAheadIO{
+        
+        typedef struct{
+            uint8_t *data;
+            int size;       //less than blockSize only for the last block of the source.
+        }Block;
+        
+        int blockSize;
+        int maxBlocks;
+        int behindBlocks;   //blocks kept behind the reading position for seeking back.
+        
+        AVIOContext *source = nullptr;
+        AVIOContext *ioCtx = nullptr;
+        int64_t sourceSize = -1;
+        //blocks cached on disk are read from it, and blocks read from the source are written to it. It's used by the I/O thread.
+        DiskCache *diskCache = nullptr;
+        
+        std::map<int64_t, Block> blocks;  //keyed by the index of block.
+        int64_t readPos = 0;              //the position of the demuxer.
+        int64_t endPos = -1;              //where the source ends, -1 for unknown.
+        int sourceError = 0;              //error of reading the source except the end, cleared by seeking.
+        std::atomic<bool> abortRequest;
+        static int interrupted(void *context);
+        
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        pthread_cond_t fillCond = PTHREAD_COND_INITIALIZER;  //the I/O thread waits for the reading position to move.
+        pthread_cond_t readCond = PTHREAD_COND_INITIALIZER;  //the demuxer waits for a block.
+        
+        pthread_t ioThread;
+        bool ioThreadStarted = false;
+        static void *ioLoop(void *context);
+        
+        //called with the mutex locked.
+        int64_t nextFillBlock();
+        bool evictBlock(int64_t fillBlock);
+        
+        int64_t readBytes = 0;
+        int64_t diskCacheBytes = 0;
+        int64_t readTime = 0;             //microsecond
+        int64_t hitBytes = 0;
+        int64_t missBytes = 0;
+        
+        static int readPacket(void *opaque, uint8_t *buf, int buf_size);
+        static int64_t seek(void *opaque, int64_t offset, int whence);
+    
+    public:
+    
+        /** The cache is of cacheSize bytes in blocks of blockSize, a quarter of it is kept behind the reading position. */
+        ReadAheadIO(int cacheSize, int blockSize = 64*1024);
+        ~ReadAheadIO(){
+            close();
+        }
+        
+        /** Open the source and start reading ahead. The disk cache can be null, it's owned by this and freed in closing. */
+        bool open(const char *url, DiskCache *diskCache = nullptr);
+        /** Fail the reading of the demuxer and the source, so a read thread blocked in it returns. */
+        void abort();
+        /** Stop the I/O thread and free everything, close the format context using it before. */
+        void close();
+        
+        /** Set it to the pb of the format context before avformat_open_input. */
+        AVIOContext *ioContext(){
+            return ioCtx;
+        }
+        
+        TFMPReadAheadStats getStats();
+    };
+}
+
+#endif /* ReadAheadIO_hpp */
@@ -13,6 +13,12 @@
 #include <pthread.h>
 #include <limits.h>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <sched.h>
+#include <sys/time.h>
 
 #include "TFStateObserver.hpp"
 
@@ -20,7 +26,51 @@
 
 /* |->--front-----back------>|  The range of [front, back] contains all valid nodes */
 
+/* SPSC mode: |--tail-----head--|  A power-of-two array, [tail, head) contains all valid values.
+ * head is only written by producer, tail only by consumer, so insert and getOut don't need the mutex.
+ */
+
 namespace tfmpcore {
+    
+    /** How many times and how long the producer and consumer were blocked. Time unit is seconds. */
+    typedef struct{
+        uint64_t insertBlockCount;
+        double insertBlockedTime;
+        uint64_t getOutBlockCount;
+        double getOutBlockedTime;
+    }RecycleBufferBlockStats;
+    
+    /** Allocations of nodes in linked mode or ring storages in SPSC mode. Capacity is counted in values. */
+    typedef struct{
+        uint64_t allocCount;   //values allocated, including the reserved and grown ones.
+        uint64_t freeCount;    //values freed by shrinking.
+        uint64_t growCount;
+        uint64_t shrinkCount;
+        long capacity;
+        long peakCapacity;
+    }RecycleBufferAllocStats;
+    
+    #define RecycleBufferHistogramBins 12
+    
+    /** Counters of a buffer since it's created. They are read without locking, so they may be a little inconsistent with each other.
+     * occupancyHistogram[i] counts the values which made the used size in [2^i, 2^(i+1)) when they were inserted, the last bin counts all above.
+     */
+    typedef struct{
+        uint64_t insertCount;
+        uint64_t getOutCount;
+        uint64_t flushCount;
+        uint64_t flushedCount;  //values freed by flushing.
+        long highWaterMark;
+        RecycleBufferBlockStats blockStats;  //time blocked full is insertBlockedTime, time blocked empty is getOutBlockedTime.
+        uint64_t occupancyHistogram[RecycleBufferHistogramBins];
+    }RecycleBufferTelemetry;
+    
+    /** Limits besides the node count. The buffer is full when any limit is reached. 0 means no limit. */
+    typedef struct{
+        long maxBytes;
+        double maxDuration;  //seconds
+    }RecycleBufferBudget;
+    
     template<typename T>
     class RecycleBuffer{
         
@@ -33,23 +83,19 @@ namespace tfmpcore {
         };
         
         /** Use this to observe the change of usedsize. It makes you know RecycleBuffer's status and helping you do specific things.
+         * It's called once when usedsize crosses the checkSize, not on every inserting or getting out.
          * if return true, observer'll be removed.
          */
         typedef bool (*ObserverNotifyFunc)(RecycleBuffer *buffer, int curSize, bool isGreater, void *context);
-        class UsedSizeObserver{
-            void *observer = nullptr;
-            int checkSize = defaultInitAllocSize;
-            bool isGreater = true;
-            ObserverNotifyFunc notifyFunc = nullptr;
-            
-            friend RecycleBuffer;
-            
-            UsedSizeObserver(void *observer, int checkSize, bool isGreater, ObserverNotifyFunc notifyFunc):observer(observer),checkSize(checkSize),isGreater(isGreater),notifyFunc(notifyFunc){};
-        };
+        typedef struct{
+            void *observer;
+            int checkSize;
+            bool isGreater;  //fire when usedsize becomes greater than checkSize, otherwise less than checkSize.
+            ObserverNotifyFunc notifyFunc;
+            bool armed;      //usedsize is on the other side of checkSize, so the next crossing fires.
+        }UsedSizeObserver;
         
         const static int defaultInitAllocSize = 8;
-        int outLimit = 3;
-        int inLimit = LONG_MAX;
         
         long limitSize = LONG_MAX;
         long allocedSize = 0;
@@ -63,23 +109,737 @@ namespace tfmpcore {
         
         pthread_cond_t inCond = PTHREAD_COND_INITIALIZER;
         pthread_cond_t outCond = PTHREAD_COND_INITIALIZER;
+        pthread_cond_t idleCond = PTHREAD_COND_INITIALIZER;  //signaled when the blocked inserting finished.
         pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
         
-        bool ioDisable = false;
+        //Changed only with the mutex locked, so the waiting threads never miss it. The fast paths read it without the mutex.
+        std::atomic<bool> ioDisable;
+        
+        //Time unit is microseconds, they are only written by the blocked thread.
+        std::atomic<uint64_t> insertBlockCount;
+        std::atomic<int64_t> insertBlockedTime;
+        std::atomic<uint64_t> getOutBlockCount;
+        std::atomic<int64_t> getOutBlockedTime;
+        
+        //Written only by flush with the mutex locked. flushCount is also the generation the waiting threads check.
+        std::atomic<uint64_t> flushCount;
+        std::atomic<uint64_t> flushedCount;
+        
+        /* Observers are evaluated only when usedsize leaves the quiet range [observerLow, observerLow+observerSpan],
+         * in which no observer can fire or be armed, so the hot path is one compare.
+         */
+        std::vector<UsedSizeObserver> observers;
+        pthread_mutex_t observerMutex = PTHREAD_MUTEX_INITIALIZER;
+        std::atomic<long> observerLow;
+        std::atomic<long> observerSpan;
+        
+        inline void checkObservers(long curSize){
+            if ((unsigned long)(curSize - observerLow.load(std::memory_order_relaxed)) > (unsigned long)observerSpan.load(std::memory_order_relaxed)) {
+                crossObservers();
+            }
+        }
+        
+        //The limits of the budget, duration in microseconds. They're read by both sides without the mutex.
+        std::atomic<long> budgetBytes;
+        std::atomic<int64_t> budgetDuration;
+        
+        //The bytes and media duration(microseconds) of the valid values, measured by valueBytesFunc and valueDurationFunc.
+        std::atomic<int64_t> usedBytes;
+        std::atomic<int64_t> usedDuration;
+        
+        inline void measureValue(T &val, int64_t *bytes, int64_t *duration){
+            *bytes = valueBytesFunc ? valueBytesFunc(val, measureContext) : 0;
+            *duration = valueDurationFunc ? (int64_t)(valueDurationFunc(val, measureContext)*1000000) : 0;
+        }
+        
+        inline void addMeasure(T &val){
+            if (valueBytesFunc == nullptr && valueDurationFunc == nullptr) return;
+            int64_t bytes, duration;
+            measureValue(val, &bytes, &duration);
+            usedBytes.fetch_add(bytes);
+            usedDuration.fetch_add(duration);
+        }
+        
+        inline void subMeasure(T &val){
+            if (valueBytesFunc == nullptr && valueDurationFunc == nullptr) return;
+            int64_t bytes, duration;
+            measureValue(val, &bytes, &duration);
+            usedBytes.fetch_sub(bytes);
+            usedDuration.fetch_sub(duration);
+        }
+        
+        /** An empty buffer is never over budget, so one big value can always get in. */
+        inline bool overBudget(){
+            long maxBytes = budgetBytes.load(std::memory_order_relaxed);
+            int64_t maxDuration = budgetDuration.load(std::memory_order_relaxed);
+            return (maxBytes > 0 && usedBytes.load() >= maxBytes) ||
+                   (maxDuration > 0 && usedDuration.load() >= maxDuration);
+        }
+        
+        /***** single-producer/single-consumer ring *****/
+        
+        typedef struct{
+            T *values;
+            long mask;
+        }RingStorage;
+        
+        bool singleProducerConsumer = false;
+        
+        /* The ring grows and shrinks by copying valid values to a new storage, it's done by the producer or with the producer waiting,
+         * always with the mutex locked. The consumer may still read the old storage, so old storages are retired and freed later
+         * with the mutex locked, except the one the consumer has published in consumerRing. The consumer never takes the mutex for it.
+         * Values at the same position are same in all storages, and the new storage is published before head moves on,
+         * so loading head before the storage always gets a storage containing the position.
+         */
+        std::atomic<RingStorage *> ringStorage;
+        std::vector<RingStorage *> retiredRings;  //guarded by the mutex.
+        std::atomic<bool> hasRetiredRings;  //the producer frees retired storages when it sees it.
+        
+        //head and tail are written by different threads, keep them in different cache lines to avoid false sharing.
+        alignas(64) std::atomic<long> ringHead;
+        long cachedTail = 0;  //producer's copy of tail, only reload tail when the buffer seems to be full.
+        bool producerWaiting = false;  //linked mode uses it too, guarded by the mutex.
+        
+        //Telemetry written by the inserting side, it's in the producer's cache line in SPSC mode.
+        std::atomic<uint64_t> insertCount;
+        std::atomic<long> highWaterMark;
+        std::atomic<uint64_t> occupancyHistogram[RecycleBufferHistogramBins];
+        
+        alignas(64) std::atomic<long> ringTail;
+        long cachedHead = 0;  //consumer's copy of head, only reload head when the buffer seems to be empty.
+        bool consumerWaiting = false;
+        std::atomic<RingStorage *> consumerRing;  //the storage the consumer is using, nullptr when it's waiting.
+        std::atomic<bool> consumerDraining;  //the consumer reads values before claiming them, flush mustn't free them meanwhile.
+        std::atomic<uint64_t> getOutCount;
+        
+        alignas(64) std::atomic<bool> waitingFlag;  //true when any side is waiting on condition.
+        std::atomic<bool> releaseRequested;  //memory pressure, the producer shrinks the ring at next inserting.
+        
+        /* Every counter has one writer at a time: the producer or the consumer in SPSC mode, the thread holding the mutex in linked mode,
+         * so a relaxed load and store is enough, no locked adding on the hot path.
+         */
+        static inline void addCounter(std::atomic<uint64_t> &counter, uint64_t count){
+            counter.store(counter.load(std::memory_order_relaxed)+count, std::memory_order_relaxed);
+        }
+        
+        //curSize is the used size after inserting, in SPSC mode it's from cachedTail and may be a little greater than the real one.
+        inline void recordInserted(long count, long curSize){
+            addCounter(insertCount, count);
+            if (curSize > highWaterMark.load(std::memory_order_relaxed)) {
+                highWaterMark.store(curSize, std::memory_order_relaxed);
+            }
+            int bin = curSize > 0 ? 63 - __builtin_clzll((unsigned long long)curSize) : 0;
+            addCounter(occupancyHistogram[std::min(bin, RecycleBufferHistogramBins-1)], count);
+        }
+        
+        inline long ringUsedSize(){
+            return ringHead.load(std::memory_order_acquire) - ringTail.load(std::memory_order_acquire);
+        }
+        
+        static long ringCapacityFor(long size){
+            long capacity = defaultInitAllocSize;
+            while (capacity < size) capacity <<= 1;
+            return capacity;
+        }
+        
+        void initRing(long capacity){
+            RingStorage *ring = new RingStorage();
+            ring->values = new T[capacity];
+            ring->mask = capacity-1;
+            ringStorage.store(ring, std::memory_order_release);
+            
+            recordAlloc(capacity, 0);
+            setAllocedSize(capacity);
+        }
+        
+        static void freeRing(RingStorage *ring){
+            delete[] ring->values;
+            delete ring;
+        }
+        
+        /* It must be called with the mutex locked, after the new storage is published.
+         * The consumer publishes its storage before checking that it's still the current one, so with seq_cst either
+         * we see its storage here, or it sees the new storage and doesn't read the retired one.
+         */
+        void freeRetiredRings(){
+            RingStorage *inUse = consumerRing.load(std::memory_order_seq_cst);
+            for (auto iter = retiredRings.begin(); iter != retiredRings.end();) {
+                if (*iter == inUse) {
+                    iter++;
+                    continue;
+                }
+                recordAlloc(0, (*iter)->mask+1);
+                freeRing(*iter);
+                iter = retiredRings.erase(iter);
+            }
+            hasRetiredRings.store(!retiredRings.empty(), std::memory_order_relaxed);
+        }
+        
+        /** Copy valid values to a new storage, it must be called with the mutex locked, by the producer or with the producer waiting. */
+        void resizeRingLocked(long capacity){
+            RingStorage *old = ringStorage.load(std::memory_order_relaxed);
+            long head = ringHead.load(std::memory_order_relaxed);
+            long tail = ringTail.load(std::memory_order_acquire);
+            
+            capacity = ringCapacityFor(std::max(capacity, head-tail));
+            if (capacity == old->mask+1) {
+                return;
+            }
+            
+            RingStorage *ring = new RingStorage();
+            ring->values = new T[capacity];
+            ring->mask = capacity-1;
+            for (long i = tail; i<head; i++) {
+                ring->values[i & ring->mask] = old->values[i & old->mask];
+            }
+            ringStorage.store(ring, std::memory_order_seq_cst);
+            
+            if (capacity > allocedSize) {
+                allocStats.growCount++;
+            }else{
+                allocStats.shrinkCount++;
+            }
+            recordAlloc(capacity, 0);
+            setAllocedSize(capacity);
+            
+            retiredRings.push_back(old);
+            freeRetiredRings();
+            RecycleBufferLog("resize ring: %s %ld\n",name,capacity);
+        }
+        
+        /* The producer samples the occupancy every 16 inserting, and shrinks the ring after sustained low occupancy.
+         * It also frees the storages the consumer has left since the last resizing.
+         */
+        inline void ringTrackOccupancy(long head){
+            if ((head & 15) != 0) return;
+            
+            if (hasRetiredRings.load(std::memory_order_relaxed)) {
+                pthread_mutex_lock(&mutex);
+                freeRetiredRings();
+                pthread_mutex_unlock(&mutex);
+            }
+            
+            cachedTail = ringTail.load(std::memory_order_acquire);
+            trackOccupancy(head - cachedTail);
+        }
+        
+        //The producer grows the ring when it's full and smaller than limitSize.
+        bool ringGrow(){
+            pthread_mutex_lock(&mutex);
+            RingStorage *ring = ringStorage.load(std::memory_order_relaxed);
+            bool grown = ring->mask+1 < limitSize;
+            if (grown) {
+                resizeRingLocked(std::min((ring->mask+1)*2, limitSize));
+            }
+            pthread_mutex_unlock(&mutex);
+            return grown;
+        }
+        
+        bool ringInsert(T val){
+            if (releaseRequested.load(std::memory_order_relaxed)) {
+                pthread_mutex_lock(&mutex);
+                releaseUnusedLocked();
+                pthread_mutex_unlock(&mutex);
+            }
+            
+            long head = ringHead.load(std::memory_order_relaxed);
+            RingStorage *ring = ringStorage.load(std::memory_order_acquire);
+            if (ring == nullptr) {
+                return false;
+            }
+            long limit = std::min(limitSize, ring->mask+1);
+            if (head - cachedTail >= limit) {
+                cachedTail = ringTail.load(std::memory_order_acquire);
+                if (head - cachedTail >= limit) {
+                    if (limit == limitSize || !ringGrow()) {
+                        return false;
+                    }
+                    ring = ringStorage.load(std::memory_order_acquire);
+                }
+            }
+            if (overBudget()) {
+                return false;
+            }
+            
+            ring->values[head & ring->mask] = val;
+            addMeasure(val);
+            ringHead.store(head+1, std::memory_order_seq_cst);
+            
+            //Only touch the mutex when the consumer is waiting for the empty buffer.
+            if (waitingFlag.load(std::memory_order_seq_cst)) {
+                pthread_mutex_lock(&mutex);
+                if (consumerWaiting) pthread_cond_signal(&outCond);
+                pthread_mutex_unlock(&mutex);
+            }
+            
+            ringTrackOccupancy(head+1);
+            
+            long curSize = head+1 - cachedTail;
+            recordInserted(1, curSize);
+#if DEBUG
+            myStateObserver.mark(name, (int)curSize, false);
+#endif
+            RecycleBufferLog("insert: %s[%ld]\n",name,curSize);
+            
+            checkObservers(curSize);
+            
+            return true;
+        }
+        
+        /* The consumer must load the storage after head. When the storage has changed, it publishes the new one and loads again,
+         * the storage is safe to read only if it's still the current one after publishing. It's lock-free for the real-time consumer.
+         */
+        inline RingStorage *consumerLoadRing(){
+            RingStorage *ring = ringStorage.load(std::memory_order_acquire);
+            while (ring != consumerRing.load(std::memory_order_relaxed)) {
+                consumerRing.store(ring, std::memory_order_seq_cst);
+                ring = ringStorage.load(std::memory_order_seq_cst);
+            }
+            return ring;
+        }
+        
+        bool ringGetOut(T *valP){
+            long tail = ringTail.load(std::memory_order_relaxed);
+            if (cachedHead - tail <= 0) {
+                cachedHead = ringHead.load(std::memory_order_acquire);
+                if (cachedHead - tail <= 0) {
+                    return false;
+                }
+            }
+            
+            RingStorage *ring = consumerLoadRing();
+            T val = ring->values[tail & ring->mask];
+            
+            //flush may claim the values from the other thread, CAS makes sure one value is taken only once.
+            if (!ringTail.compare_exchange_strong(tail, tail+1, std::memory_order_seq_cst)) {
+                return false;
+            }
+            subMeasure(val);
+            if (valP) *valP = val;
+            addCounter(getOutCount, 1);
+            
+            if (waitingFlag.load(std::memory_order_seq_cst)) {
+                pthread_mutex_lock(&mutex);
+                if (producerWaiting) pthread_cond_signal(&inCond);
+                pthread_mutex_unlock(&mutex);
+            }
+            
+            long curSize = cachedHead - (tail+1);
+#if DEBUG
+            myStateObserver.mark(name, (int)curSize, false);
+#endif
+            RecycleBufferLog("getout: %s[%ld]\n",name,curSize);
+            
+            checkObservers(curSize);
+            
+            return true;
+        }
+        
+        int ringInsertBatch(T *vals, int count){
+            if (releaseRequested.load(std::memory_order_relaxed)) {
+                pthread_mutex_lock(&mutex);
+                releaseUnusedLocked();
+                pthread_mutex_unlock(&mutex);
+            }
+            
+            long head = ringHead.load(std::memory_order_relaxed);
+            RingStorage *ring = ringStorage.load(std::memory_order_acquire);
+            if (ring == nullptr) {
+                return false;
+            }
+            long limit = std::min(limitSize, ring->mask+1);
+            if (head - cachedTail + count > limit) {
+                cachedTail = ringTail.load(std::memory_order_acquire);
+                
+                //grow for the whole batch at once.
+                while (head - cachedTail + count > limit && limit < limitSize && ringGrow()) {
+                    ring = ringStorage.load(std::memory_order_acquire);
+                    limit = std::min(limitSize, ring->mask+1);
+                }
+            }
+            
+            int inserted = 0;
+            while (inserted < count && head+inserted - cachedTail < limit && !overBudget()) {
+                ring->values[(head+inserted) & ring->mask] = vals[inserted];
+                addMeasure(vals[inserted]);
+                inserted++;
+            }
+            if (inserted == 0) {
+                return 0;
+            }
+            
+            //publish all values at once.
+            ringHead.store(head+inserted, std::memory_order_seq_cst);
+            
+            if (waitingFlag.load(std::memory_order_seq_cst)) {
+                pthread_mutex_lock(&mutex);
+                if (consumerWaiting) pthread_cond_signal(&outCond);
+                pthread_mutex_unlock(&mutex);
+            }
+            
+            if ((head >> 4) != ((head+inserted) >> 4)) {
+                cachedTail = ringTail.load(std::memory_order_acquire);
+                trackOccupancy(head+inserted - cachedTail);
+            }
+            
+            long curSize = head+inserted - cachedTail;
+            recordInserted(inserted, curSize);
+#if DEBUG
+            myStateObserver.mark(name, (int)curSize, false);
+#endif
+            RecycleBufferLog("insert batch: %s[%ld] +%d\n",name,curSize,inserted);
+            
+            checkObservers(curSize);
+            
+            return inserted;
+        }
+        
+        /* The predicate reads the values before the CAS claims them, so consumerDraining is set first.
+         * Either flush sees it and waits before freeing, or we load the tail after flush has moved it and don't see the values.
+         */
+        int ringDrain(T *vals, int maxCount, bool (*predicate)(T &val, void *context), void *context){
+            consumerDraining.store(true, std::memory_order_seq_cst);
+            long tail = ringTail.load(std::memory_order_seq_cst);
+            if (cachedHead - tail < maxCount) {
+                cachedHead = ringHead.load(std::memory_order_acquire);
+            }
+            
+            RingStorage *ring = consumerLoadRing();
+            int count = 0;
+            long available = cachedHead - tail;
+            while (count < maxCount && count < available) {
+                T &val = ring->values[(tail+count) & ring->mask];
+                if (predicate && !predicate(val, context)) {
+                    break;
+                }
+                vals[count] = val;
+                count++;
+            }
+            
+            bool claimed = count > 0 && ringTail.compare_exchange_strong(tail, tail+count, std::memory_order_seq_cst);
+            consumerDraining.store(false, std::memory_order_release);
+            if (!claimed) {
+                return 0;
+            }
+            for (int i = 0; i<count; i++) {
+                subMeasure(vals[i]);
+            }
+            addCounter(getOutCount, count);
+            
+            if (waitingFlag.load(std::memory_order_seq_cst)) {
+                pthread_mutex_lock(&mutex);
+                if (producerWaiting) pthread_cond_signal(&inCond);
+                pthread_mutex_unlock(&mutex);
+            }
+            
+            long curSize = cachedHead - (tail+count);
+#if DEBUG
+            myStateObserver.mark(name, (int)curSize, false);
+#endif
+            RecycleBufferLog("drain: %s[%ld] -%d\n",name,curSize,count);
+            
+            checkObservers(curSize);
+            
+            return count;
+        }
+        
+        /***** capacity policy *****/
+        
+        /* Nodes or ring slots are reserved on open, grow on demand, and shrink back when the peak occupancy of
+         * shrinkAfterLowWindows windows in a row is less than a quarter of the capacity, or on memory pressure.
+         */
+        const static int occupancyWindowSize = 512;
+        const static int shrinkAfterLowWindows = 4;
+        
+        long reservedSize = 0;       //don't shrink below it for low occupancy.
+        long occupancyPeak = 0;      //the max used size in current window.
+        int occupancyCount = 0;
+        int lowOccupancyWindows = 0;
+        
+        RecycleBufferAllocStats allocStats = {0, 0, 0, 0, 0, 0};  //guarded by the mutex.
+        
+        inline void recordAlloc(long allocCount, long freeCount){
+            allocStats.allocCount += allocCount;
+            allocStats.freeCount += freeCount;
+        }
+        
+        inline void setAllocedSize(long size){
+            allocedSize = size;
+            allocStats.capacity = size;
+            allocStats.peakCapacity = std::max(allocStats.peakCapacity, size);
+        }
+        
+        //Free unused nodes until there are keepSize nodes at least, it must be called with the mutex locked.
+        void shrinkNodesLocked(long keepSize){
+            keepSize = std::max(std::max(keepSize, usedSize), 1L);
+            if (frontNode == nullptr || allocedSize <= keepSize) {
+                return;
+            }
+            
+            long freeCount = allocedSize - keepSize;
+            for (long i = 0; i<freeCount; i++) {
+                //unused nodes are after backNode, all nodes except frontNode are unused if the buffer is empty.
+                RecycleNode *node = usedSize > 0 ? backNode->next : frontNode->next;
+                node->pre->next = node->next;
+                node->next->pre = node->pre;
+                delete node;
+            }
+            if (usedSize == 0) {
+                backNode = frontNode->pre;
+            }
+            
+            recordAlloc(0, freeCount);
+            setAllocedSize(keepSize);
+            allocStats.shrinkCount++;
+            RecycleBufferLog("shrink nodes: %s %ld\n",name,keepSize);
+        }
+        
+        //Shrink to the used size on memory pressure, it must be called with the mutex locked.
+        void releaseUnusedLocked(){
+            releaseRequested.store(false, std::memory_order_relaxed);
+            if (singleProducerConsumer) {
+                resizeRingLocked(ringUsedSize());
+            }else{
+                shrinkNodesLocked(defaultInitAllocSize);
+            }
+            lowOccupancyWindows = 0;
+        }
+        
+        /** The size is the used size before getting out in linked mode, it's called with the mutex locked and the nodes in order.
+         * SPSC mode calls it in producer without the mutex.
+         */
+        void trackOccupancy(long size){
+            if (size > occupancyPeak) occupancyPeak = size;
+            
+            //SPSC mode samples every 16 inserting.
+            occupancyCount += singleProducerConsumer ? 16 : 1;
+            if (occupancyCount < occupancyWindowSize) {
+                return;
+            }
+            
+            long floorSize = std::max(reservedSize, (long)defaultInitAllocSize);
+            if (occupancyPeak*4 <= allocedSize && allocedSize > floorSize) {
+                lowOccupancyWindows++;
+            }else{
+                lowOccupancyWindows = 0;
+            }
+            
+            if (lowOccupancyWindows >= shrinkAfterLowWindows) {
+                long keepSize = std::max(occupancyPeak*2, floorSize);
+                if (singleProducerConsumer) {
+                    pthread_mutex_lock(&mutex);
+                    resizeRingLocked(keepSize);
+                    pthread_mutex_unlock(&mutex);
+                }else{
+                    shrinkNodesLocked(keepSize);
+                }
+                lowOccupancyWindows = 0;
+            }
+            
+            occupancyPeak = 0;
+            occupancyCount = 0;
+        }
+        
+        //Insert one value in linked mode, it must be called with the mutex locked.
+        bool insertLocked(T val){
+            if (overBudget()) {
+                return false;
+            }
+            if (usedSize >= allocedSize) {
+                if (!expand()) {
+                    //stop pushing until there is unused node.
+                    return false;
+                }
+            }
+            
+            frontNode->pre->val = val;
+            frontNode = frontNode->pre;
+            addMeasure(val);
+            
+            usedSize++;
+            recordInserted(1, usedSize);
+            if (usedSize > 1 && valueCompFunc) {
+                RecycleNode *cur = frontNode->next;
+                
+                //If the new value is less than cur node's, compare next node until cur node is greater than the new value.
+                while (cur != backNode->next &&
+                       valueCompFunc(frontNode->val, cur->val) < 0) {
+                    cur = cur->next;
+                }
+                
+                //unbind front node and move it to right position where is previous position of cur.
+                if (cur != frontNode->next) {
+                    
+                    auto moveNode = frontNode;
+                    frontNode = frontNode->next;
+                    
+                    moveNode->next->pre = moveNode->pre;
+                    moveNode->pre->next = moveNode->next;
+                    
+                    moveNode->pre = cur->pre;
+                    cur->pre->next = moveNode;
+                    moveNode->next = cur;
+                    cur->pre = moveNode;
+                    
+                    if (moveNode == backNode->next) {
+                        backNode = moveNode;
+                    }
+                }
+            }
+            
+            return true;
+        }
+        
+        /** The size for deciding whether to wait, it must be called with the mutex locked.
+         * In SPSC mode, the waiting flag has been set before, the seq_cst loads make sure that either we see the new size or the other side sees the flag.
+         */
+        inline long sizeForWaiting(){
+            if (singleProducerConsumer) {
+                return ringHead.load(std::memory_order_seq_cst) - ringTail.load(std::memory_order_seq_cst);
+            }
+            return usedSize;
+        }
+        
+        inline bool insertBlocked(){
+            return !ioDisable && (sizeForWaiting() >= limitSize || overBudget());
+        }
+        
+        inline bool getOutBlocked(){
+            return !ioDisable && sizeForWaiting() <= 0;
+        }
         
-        std::vector<UsedSizeObserver *> observers;
+        static void deadlineAfter(double timeout, struct timespec *deadline){
+            struct timeval now;
+            gettimeofday(&now, nullptr);
+            
+            long long nsec = now.tv_usec*1000LL + (long long)(timeout*1e9);
+            deadline->tv_sec = now.tv_sec + (time_t)(nsec/1000000000LL);
+            deadline->tv_nsec = (long)(nsec%1000000000LL);
+        }
         
-        bool expand(){
+        /** Wait on cond while the buffer is blocked. It must be called with the mutex locked.
+         * flush turns ioDisable back before unlocking, so a flush while waiting is found by its count.
+         * @param deadline nullptr means waiting forever.
+         * @return false if time out or the buffer is flushed.
+         */
+        bool waitWhileBlocked(bool isInserting, struct timespec *deadline){
+            bool *waiting = isInserting ? &producerWaiting : &consumerWaiting;
+            pthread_cond_t *cond = isInserting ? &inCond : &outCond;
+            
+            *waiting = true;
+            waitingFlag.store(true, std::memory_order_seq_cst);
+            
+            bool blocked = isInserting ? insertBlocked() : getOutBlocked();
+            if (!blocked) {
+                *waiting = false;
+                waitingFlag.store(producerWaiting || consumerWaiting, std::memory_order_seq_cst);
+                return true;
+            }
+            
+            //the waiting consumer doesn't use any ring storage.
+            if (!isInserting && singleProducerConsumer) {
+                consumerRing.store(nullptr, std::memory_order_seq_cst);
+                freeRetiredRings();
+            }
+            
+            RecycleBufferLog("***************************lock %s %s\n",isInserting?"full":"empty",name);
+            auto start = std::chrono::steady_clock::now();
+            uint64_t generation = flushCount.load(std::memory_order_relaxed);
+            bool timeout = false;
+            bool flushed = false;
+            while (blocked) {
+                if (deadline == nullptr) {
+                    pthread_cond_wait(cond, &mutex);
+                }else if (pthread_cond_timedwait(cond, &mutex, deadline) == ETIMEDOUT){
+                    blocked = isInserting ? insertBlocked() : getOutBlocked();
+                    timeout = blocked;
+                    break;
+                }
+                if (flushCount.load(std::memory_order_relaxed) != generation) {
+                    flushed = true;
+                    break;
+                }
+                blocked = isInserting ? insertBlocked() : getOutBlocked();
+            }
+            
+            *waiting = false;
+            waitingFlag.store(producerWaiting || consumerWaiting, std::memory_order_seq_cst);
+            
+            int64_t blockedTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-start).count();
+            if (isInserting) {
+                insertBlockCount.fetch_add(1, std::memory_order_relaxed);
+                insertBlockedTime.fetch_add(blockedTime, std::memory_order_relaxed);
+            }else{
+                getOutBlockCount.fetch_add(1, std::memory_order_relaxed);
+                getOutBlockedTime.fetch_add(blockedTime, std::memory_order_relaxed);
+            }
+            RecycleBufferLog("---------------------------unlock %s %s\n",isInserting?"full":"empty",name);
+            
+            return !timeout && !flushed;
+        }
+        
+        inline long exactSize(){
+            return singleProducerConsumer ? ringUsedSize() : usedSize;
+        }
+        
+        /** Fire the observers whose checkSize is crossed, rearm the others and compute the new quiet range. */
+        void crossObservers(){
+            std::vector<UsedSizeObserver> fired;
+            
+            pthread_mutex_lock(&observerMutex);
+            long curSize = exactSize();
+            for (auto iter = observers.begin(); iter != observers.end(); iter++) {
+                bool reached = iter->isGreater ? (curSize > iter->checkSize) : (curSize < iter->checkSize);
+                if (reached && iter->armed) {
+                    fired.push_back(*iter);
+                }
+                iter->armed = !reached;
+            }
+            updateObserverRange();
+            pthread_mutex_unlock(&observerMutex);
+            
+            //call outside of the lock, so observers can be added or removed in notifyFunc.
+            for (auto iter = fired.begin(); iter != fired.end(); iter++) {
+                if (iter->notifyFunc(this, (int)curSize, iter->isGreater, iter->observer)) {
+                    removeObserver(iter->observer, iter->checkSize, iter->isGreater);
+                }
+            }
+        }
+        
+        //It must be called with the observerMutex locked.
+        void updateObserverRange(){
+            long low = 0, high = LONG_MAX;
+            for (auto iter = observers.begin(); iter != observers.end(); iter++) {
+                if (iter->isGreater) {
+                    //armed: fire above checkSize; not armed: rearm at or below checkSize.
+                    if (iter->armed) high = std::min(high, (long)iter->checkSize);
+                    else low = std::max(low, (long)iter->checkSize+1);
+                }else{
+                    if (iter->armed) low = std::max(low, (long)iter->checkSize);
+                    else high = std::min(high, (long)iter->checkSize-1);
+                }
+            }
+            //The range is empty when usedsize has moved without a check, e.g. by flush. No size is quiet then, every operation checks until it's rebuilt.
+            if (high < low) {
+                low = LONG_MAX;
+                high = LONG_MAX;
+            }
+            observerLow.store(low, std::memory_order_relaxed);
+            observerSpan.store(high-low, std::memory_order_relaxed);
+        }
+        
+        /** Add expandSize nodes, 0 means doubling. It's limited by limitSize. */
+        bool expand(long expandSize = 0){
             if (allocedSize >= limitSize) {
                 return false;
             }
             if (allocedSize == 0) {
-                allocedSize = defaultInitAllocSize;
-                initAlloc();
+                initAlloc(std::min(std::max(expandSize, (long)defaultInitAllocSize), limitSize));
                 return true;
             }
             
-            long expandSize = allocedSize < (limitSize-allocedSize) ? allocedSize : (limitSize-allocedSize);
+            if (expandSize <= 0) expandSize = allocedSize;
+            expandSize = std::min(expandSize, limitSize-allocedSize);
             
             RecycleNode *nextNode = frontNode;
             RecycleNode *closeNode = frontNode->pre;
@@ -98,22 +858,26 @@ namespace tfmpcore {
                 nextNode = node;
             }
             
-            allocedSize += expandSize;
+            recordAlloc(expandSize, 0);
+            setAllocedSize(allocedSize + expandSize);
+            allocStats.growCount++;
             
             return true;
         }
         
-        void initAlloc(){
+        void initAlloc(long size){
             frontNode = new RecycleNode();
+            frontNode->pre = frontNode;
+            frontNode->next = frontNode;
             RecycleNode *lastNode = frontNode;
             
-            for (long i = 1; i<allocedSize; i++) {
+            for (long i = 1; i<size; i++) {
                 RecycleNode *node = new RecycleNode();
                 
                 lastNode->next = node;
                 node->pre = lastNode;
                 
-                if (i == allocedSize-1) { //link last node with the other node of break.
+                if (i == size-1) { //link last node with the other node of break.
                     node->next = frontNode;
                     frontNode->pre = node;
                 }
@@ -122,24 +886,40 @@ namespace tfmpcore {
             }
             
             backNode = frontNode->pre;
+            
+            recordAlloc(size, 0);
+            setAllocedSize(size);
         }
         
     public:
         
-        RecycleBuffer(long limitSize = 0, bool allocToLimit = false){
+        /**
+         * @param singleProducerConsumer Use a contiguous lock-free ring instead of linked nodes.
+         * Only one thread inserts and only one thread gets out, and the buffer can't be sorted by valueCompFunc.
+         * It needs a limitSize.
+         * @param allocToLimit Allocate nodes or ring slots for limitSize at once, otherwise they grow on demand. Prefer reserve() with a real estimate.
+         */
+        RecycleBuffer(long limitSize = 0, bool allocToLimit = false, bool singleProducerConsumer = false):ioDisable(false),insertBlockCount(0),insertBlockedTime(0),getOutBlockCount(0),getOutBlockedTime(0),flushCount(0),flushedCount(0),observerLow(0),observerSpan(LONG_MAX),budgetBytes(0),budgetDuration(0),usedBytes(0),usedDuration(0),ringStorage(nullptr),hasRetiredRings(false),ringHead(0),insertCount(0),highWaterMark(0),ringTail(0),consumerRing(nullptr),consumerDraining(false),getOutCount(0),waitingFlag(false),releaseRequested(false){
+            for (int i = 0; i<RecycleBufferHistogramBins; i++) {
+                occupancyHistogram[i].store(0, std::memory_order_relaxed);
+            }
+            
             if (limitSize > 0) {
                 this->limitSize = limitSize;
-                inLimit = limitSize-3;
             }
             
-            if (limitSize && allocToLimit) {
-                
-                allocedSize = limitSize;
-            }else{
-                allocedSize = defaultInitAllocSize; //init size
+            bool toLimit = limitSize && allocToLimit;
+            if (singleProducerConsumer && limitSize > 0) {
+                this->singleProducerConsumer = true;
+                initRing(ringCapacityFor(toLimit ? limitSize : defaultInitAllocSize));
+                return;
             }
             
-            initAlloc();
+            initAlloc(toLimit ? limitSize : defaultInitAllocSize);
+        }
+        
+        ~RecycleBuffer(){
+            flushAndFree();
         }
         
         /** name for identifying this RecycleNode */
@@ -151,128 +931,179 @@ namespace tfmpcore {
         /** The func for comparing values to reorder nodes; If it's null, don't sort buffer */
         int (*valueCompFunc)(T &val1, T &val2) = nullptr;
         
+        /** The funcs for measuring memory size and media duration(seconds) of one value, they are used by the budget.
+         * They must return the same result for the same value every time.
+         */
+        long (*valueBytesFunc)(T &val, void *context) = nullptr;
+        double (*valueDurationFunc)(T &val, void *context) = nullptr;
+        void *measureContext = nullptr;
+        
+        void setBudget(RecycleBufferBudget budget){
+            pthread_mutex_lock(&mutex);
+            budgetBytes.store(budget.maxBytes, std::memory_order_relaxed);
+            budgetDuration.store((int64_t)(budget.maxDuration*1000000), std::memory_order_relaxed);
+            //the limits may be raised, let the blocked producer check again.
+            pthread_cond_broadcast(&inCond);
+            pthread_mutex_unlock(&mutex);
+        }
+        
+        RecycleBufferBudget getBudget(){
+            return {budgetBytes.load(std::memory_order_relaxed), budgetDuration.load(std::memory_order_relaxed)/1000000.0};
+        }
+        
+        long getUsedBytes(){
+            return (long)usedBytes.load(std::memory_order_relaxed);
+        }
+        
+        /** The media duration of all valid values, unit is second. */
+        double getUsedDuration(){
+            return usedDuration.load(std::memory_order_relaxed)/1000000.0;
+        }
+        
+        /** Allocate nodes or ring slots for size values in advance, e.g. estimated from stream metadata, and don't shrink below it for low occupancy.
+         * In SPSC mode, call it before inserting starts or in the producer thread.
+         */
+        void reserve(long size){
+            pthread_mutex_lock(&mutex);
+            size = std::min(size, limitSize);
+            reservedSize = size;
+            if (size > allocedSize) {
+                if (singleProducerConsumer) {
+                    if (ringStorage.load(std::memory_order_relaxed)) resizeRingLocked(size);
+                }else{
+                    expand(size - allocedSize);
+                }
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+        
+        /** Free unused nodes or shrink the ring to the used size, e.g. on memory pressure. It can be called from any thread.
+         * In SPSC mode the ring is shrunk at once if the producer is waiting, otherwise at its next inserting.
+         */
+        void releaseUnused(){
+            pthread_mutex_lock(&mutex);
+            if (!singleProducerConsumer || producerWaiting) {
+                releaseUnusedLocked();
+            }else{
+                releaseRequested.store(true, std::memory_order_relaxed);
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+        
+        RecycleBufferAllocStats getAllocStats(){
+            pthread_mutex_lock(&mutex);
+            RecycleBufferAllocStats stats = allocStats;
+            pthread_mutex_unlock(&mutex);
+            return stats;
+        }
+        
         void disableIO(bool disable){
-            bool pre = ioDisable;
+            pthread_mutex_lock(&mutex);
             ioDisable = disable;
-            if (!pre) {
+            if (disable) {
                 pthread_cond_broadcast(&inCond);
                 pthread_cond_broadcast(&outCond);
             }
+            pthread_mutex_unlock(&mutex);
             RecycleBufferLog("%s ioDisable %s\n",name, disable?"true":"false");
         }
         
+        RecycleBufferBlockStats blockStats(){
+            RecycleBufferBlockStats stats;
+            stats.insertBlockCount = insertBlockCount.load(std::memory_order_relaxed);
+            stats.insertBlockedTime = insertBlockedTime.load(std::memory_order_relaxed)/1000000.0;
+            stats.getOutBlockCount = getOutBlockCount.load(std::memory_order_relaxed);
+            stats.getOutBlockedTime = getOutBlockedTime.load(std::memory_order_relaxed)/1000000.0;
+            return stats;
+        }
+        
+        /** A snapshot of the counters, it's lock-free and can be called from any thread. */
+        RecycleBufferTelemetry telemetry(){
+            RecycleBufferTelemetry result;
+            result.insertCount = insertCount.load(std::memory_order_relaxed);
+            result.getOutCount = getOutCount.load(std::memory_order_relaxed);
+            result.flushCount = flushCount.load(std::memory_order_relaxed);
+            result.flushedCount = flushedCount.load(std::memory_order_relaxed);
+            result.highWaterMark = highWaterMark.load(std::memory_order_relaxed);
+            result.blockStats = blockStats();
+            for (int i = 0; i<RecycleBufferHistogramBins; i++) {
+                result.occupancyHistogram[i] = occupancyHistogram[i].load(std::memory_order_relaxed);
+            }
+            return result;
+        }
+        
         bool isFull(){
-            return usedSize == limitSize;
+            if (singleProducerConsumer) return ringUsedSize() >= limitSize || overBudget();
+            return usedSize == limitSize || overBudget();
         };
         bool isEmpty(){
+            if (singleProducerConsumer) return ringUsedSize() <= 0;
             return usedSize == 0;
         }
         
+        bool isSingleProducerConsumer(){
+            return singleProducerConsumer;
+        }
+        
         bool insert(T val){
-            if (usedSize >= allocedSize) {
-                if (!expand()) {
-                    //stop pushing until there is unused node.
-                    return false;
-                }
+            if (singleProducerConsumer) {
+                return ringInsert(val);
             }
             
-            frontNode->pre->val = val;
-            frontNode = frontNode->pre;
-            
-            usedSize++;
-            myStateObserver.mark(name, usedSize, false);
-            if (usedSize > 1 && valueCompFunc) {
-                pthread_mutex_lock(&mutex);
-                RecycleNode *cur = frontNode->next;
-                
-                //If the new value is less than cur node's, compare next node until cur node is greater than the new value.
-                while (cur != backNode->next &&
-                       valueCompFunc(frontNode->val, cur->val) < 0) {
-                    cur = cur->next;
-                }
-                
-                //unbind front node and move it to right position where is previous position of cur.
-                if (cur != frontNode->next) {
-                    
-                    auto moveNode = frontNode;
-                    frontNode = frontNode->next;
-                    
-                    moveNode->next->pre = moveNode->pre;
-                    moveNode->pre->next = moveNode->next;
-                    
-                    moveNode->pre = cur->pre;
-                    cur->pre->next = moveNode;
-                    moveNode->next = cur;
-                    cur->pre = moveNode;
-                    
-                    if (moveNode == backNode->next) {
-                        backNode = moveNode;
-                    }
-                }
-                
+            pthread_mutex_lock(&mutex);
+            if (!insertLocked(val)) {
                 pthread_mutex_unlock(&mutex);
+                return false;
             }
             
             RecycleBufferLog("insert: %s[%ld],[%x->%x,%x->%x]\n",name,usedSize,frontNode,frontNode->val, backNode,backNode->val);
             
-            if (usedSize >= outLimit) {
+            if (consumerWaiting) {
                 pthread_cond_signal(&outCond);
             }
+            long curSize = usedSize;
+            pthread_mutex_unlock(&mutex);
             
-            if (!observers.empty()) {
-                for (auto iter = observers.begin(); iter != observers.end();) {
-                    UsedSizeObserver *ob = *iter;
-                    if (ob->isGreater && ob->checkSize < usedSize) {
-                        bool shouldRemove = ob->notifyFunc(this, ob->checkSize, ob->isGreater, ob->observer);
-                        if (shouldRemove) {
-                            iter = observers.erase(iter);
-                        }else{
-                            iter++;
-                        }
-                    }else{
-                        iter++;
-                    }
-                }
-            }
-            
+#if DEBUG
+            myStateObserver.mark(name, (int)curSize, false);
+#endif
+            checkObservers(curSize);
             
             return true;
         }
         
         bool getOut(T *valP){
+            if (singleProducerConsumer) {
+                return ringGetOut(valP);
+            }
             
+            pthread_mutex_lock(&mutex);
             if (usedSize == 0) {
+                pthread_mutex_unlock(&mutex);
                 return false;
             }
             
+            subMeasure(backNode->val);
             if (valP) *valP = backNode->val;
             
             backNode = backNode->pre;
             
             usedSize--;
-            myStateObserver.mark(name, usedSize, false);
+            trackOccupancy(usedSize+1);
+            addCounter(getOutCount, 1);
             
             RecycleBufferLog("getout: %s[%ld],[%x->%x,%x->%x]\n",name,usedSize,frontNode,frontNode->val, backNode,backNode->val);
             
-            if (usedSize <= inLimit) {
+            if (producerWaiting) {
                 pthread_cond_signal(&inCond);
             }
+            long curSize = usedSize;
+            pthread_mutex_unlock(&mutex);
             
-            if (!observers.empty()) {
-                for (auto iter = observers.begin(); iter != observers.end();) {
-                    UsedSizeObserver *ob = *iter;
-                    if (!ob->isGreater && ob->checkSize > usedSize) {
-                        bool shouldRemove = ob->notifyFunc(this, ob->checkSize, ob->isGreater, ob->observer);
-                        if (shouldRemove) {
-                            iter = observers.erase(iter);
-                        }else{
-                            iter++;
-                        }
-                    }else{
-                        iter++;
-                    }
-                }
-            }
+#if DEBUG
+            myStateObserver.mark(name, (int)curSize, false);
+#endif
+            checkObservers(curSize);
             
             return true;
         }
@@ -283,41 +1114,204 @@ namespace tfmpcore {
           * For every inserted node, RecycleBuffer take over it's memory management.
          */
         void blockInsert(T val){
+            blockInsertFor(val, -1);
+        }
+        
+        /** Same as blockInsert, but wait timeout seconds at most. A negative timeout means waiting forever.
+         * @return false if time out, and the val still belongs to the caller.
+         */
+        bool blockInsertFor(T val, double timeout){
             
-            if (!ioDisable && usedSize >= limitSize) {
-                RecycleBufferLog("***************************lock full %s\n",name);
-                insertingVal = &val;
-                pthread_mutex_lock(&mutex);
-                pthread_cond_wait(&inCond, &mutex);
-                pthread_mutex_unlock(&mutex);
-                RecycleBufferLog("---------------------------unlock full %s\n",name);
+            //fast path, don't touch the mutex in SPSC mode.
+            if (!ioDisable && insert(val)) {
+                return true;
             }
             
-            if (ioDisable) {
-                if (valueFreeFunc) valueFreeFunc(&val);
-            }else{
-                insert(val);
-//                pthread_cond_signal(&cond);
+            struct timespec deadline;
+            if (timeout >= 0) deadlineAfter(timeout, &deadline);
+            
+            pthread_mutex_lock(&mutex);
+            insertingVal = &val;
+            
+            bool takeOver = false;
+            while (true) {
+                bool ready = waitWhileBlocked(true, timeout >= 0 ? &deadline : nullptr);
+                if (ioDisable) {
+                    if (valueFreeFunc) valueFreeFunc(&val);
+                    takeOver = true;
+                    break;
+                }
+                if (!ready) {
+                    break;
+                }
+                
+                pthread_mutex_unlock(&mutex);
+                takeOver = insert(val);
+                pthread_mutex_lock(&mutex);
+                
+                if (takeOver) break;
             }
+            
             insertingVal = nullptr;
+            pthread_cond_broadcast(&idleCond);
+            pthread_mutex_unlock(&mutex);
+            
+            return takeOver;
         }
         
         void blockGetOut(T *valP){
-
-            if (!ioDisable && usedSize == 0) {
-                RecycleBufferLog("***************************lock empty %s\n",name);
+            blockGetOutFor(valP, -1);
+        }
+        
+        /** Same as blockGetOut, but wait timeout seconds at most. A negative timeout means waiting forever.
+         * @return false if time out, it's ioDisable or the buffer is flushed while waiting.
+         */
+        bool blockGetOutFor(T *valP, double timeout){
+            
+            struct timespec deadline;
+            bool hasDeadline = false;
+            
+            while (!ioDisable) {
+                if (getOut(valP)) {
+                    return true;
+                }
+                
+                if (timeout >= 0 && !hasDeadline) {
+                    deadlineAfter(timeout, &deadline);
+                    hasDeadline = true;
+                }
+                
                 pthread_mutex_lock(&mutex);
-                pthread_cond_wait(&outCond, &mutex);
+                bool ready = waitWhileBlocked(false, hasDeadline ? &deadline : nullptr);
                 pthread_mutex_unlock(&mutex);
-                RecycleBufferLog("---------------------------unlock empty %s[%d,%d]\n",name,usedSize,allocedSize);
+                
+                if (!ready) {
+                    return false;
+                }
+            }
+            
+            return false;
+        }
+        
+        /***** batch operations, moving many values with one synchronisation and one observer check *****/
+        
+        /** Insert values in order until the buffer is full.
+         * @return the count of inserted values, the rest still belong to the caller.
+         */
+        int insertBatch(T *vals, int count){
+            if (count <= 0 || ioDisable) {
+                return 0;
+            }
+            if (singleProducerConsumer) {
+                return ringInsertBatch(vals, count);
+            }
+            
+            pthread_mutex_lock(&mutex);
+            int inserted = 0;
+            while (inserted < count && insertLocked(vals[inserted])) {
+                inserted++;
+            }
+            
+            if (inserted > 0 && consumerWaiting) {
+                pthread_cond_signal(&outCond);
             }
+            long curSize = usedSize;
+            pthread_mutex_unlock(&mutex);
             
-            if (!ioDisable) {
-                getOut(valP);
+            if (inserted > 0) {
+                RecycleBufferLog("insert batch: %s[%ld] +%d\n",name,curSize,inserted);
+#if DEBUG
+                myStateObserver.mark(name, (int)curSize, false);
+#endif
+                checkObservers(curSize);
             }
+            
+            return inserted;
+        }
+        
+        /** Insert all values, wait if the buffer is full. Like blockInsert, the values are freed when it's ioDisable. */
+        void blockInsertBatch(T *vals, int count){
+            blockInsertBatchFor(vals, count, -1);
+        }
+        
+        /** Same as blockInsertBatch, but every wait for free space lasts timeout seconds at most.
+         * @return the count of values taken over, the rest still belong to the caller.
+         */
+        int blockInsertBatchFor(T *vals, int count, double timeout){
+            int inserted = 0;
+            while (inserted < count) {
+                inserted += insertBatch(vals+inserted, count-inserted);
+                if (inserted < count) {
+                    //wait for free space by inserting one value, then try a batch again.
+                    if (!blockInsertFor(vals[inserted], timeout)) break;
+                    inserted++;
+                }
+            }
+            return inserted;
+        }
+        
+        /** Get out at most maxCount values without waiting.
+         * @return the count of values put into vals.
+         */
+        int drainUpTo(T *vals, int maxCount){
+            return drainWhile(vals, maxCount, nullptr, nullptr);
+        }
+        
+        /** Get out values in order while predicate returns true for the next one, at most maxCount values. A null predicate accepts all values.
+         * @return the count of values put into vals.
+         */
+        int drainWhile(T *vals, int maxCount, bool (*predicate)(T &val, void *context), void *context){
+            if (maxCount <= 0 || ioDisable) {
+                return 0;
+            }
+            if (singleProducerConsumer) {
+                return ringDrain(vals, maxCount, predicate, context);
+            }
+            
+            pthread_mutex_lock(&mutex);
+            int count = 0;
+            while (count < maxCount && usedSize > 0) {
+                if (predicate && !predicate(backNode->val, context)) {
+                    break;
+                }
+                subMeasure(backNode->val);
+                vals[count] = backNode->val;
+                backNode = backNode->pre;
+                usedSize--;
+                trackOccupancy(usedSize+1);
+                count++;
+            }
+            
+            addCounter(getOutCount, count);
+            
+            if (count > 0 && producerWaiting) {
+                pthread_cond_signal(&inCond);
+            }
+            long curSize = usedSize;
+            pthread_mutex_unlock(&mutex);
+            
+            if (count > 0) {
+                RecycleBufferLog("drain: %s[%ld] -%d\n",name,curSize,count);
+#if DEBUG
+                myStateObserver.mark(name, (int)curSize, false);
+#endif
+                checkObservers(curSize);
+            }
+            
+            return count;
         }
         
         bool back(T *valP){
+            if (singleProducerConsumer) {
+                long tail = ringTail.load(std::memory_order_acquire);
+                if (ringHead.load(std::memory_order_acquire) - tail <= 0) {
+                    return false;
+                }
+                RingStorage *ring = consumerLoadRing();
+                *valP = ring->values[tail & ring->mask];
+                return true;
+            }
+            
             if (usedSize == 0) {
                 return false;
             }
@@ -327,6 +1321,16 @@ namespace tfmpcore {
         }
         
         bool front(T *valP){
+            if (singleProducerConsumer) {
+                long head = ringHead.load(std::memory_order_acquire);
+                if (head - ringTail.load(std::memory_order_acquire) <= 0) {
+                    return false;
+                }
+                RingStorage *ring = consumerLoadRing();
+                *valP = ring->values[(head-1) & ring->mask];
+                return true;
+            }
+            
             if (usedSize == 0) {
                 return false;
             }
@@ -335,53 +1339,120 @@ namespace tfmpcore {
             return true;
         }
         
+        /** It's safe to add or remove observers while other threads are inserting or getting out.
+         * If usedsize is already beyond checkSize, it fires after usedsize come back and cross checkSize again.
+         */
         void addObserver(void *observer, int checkSize, bool isGreater, ObserverNotifyFunc notifyFunc){
             if (notifyFunc == nullptr) {
                 return;
             }
-            observers.push_back(new UsedSizeObserver(observer, checkSize, isGreater, notifyFunc));
+            
+            pthread_mutex_lock(&observerMutex);
+            long curSize = exactSize();
+            bool reached = isGreater ? (curSize > checkSize) : (curSize < checkSize);
+            observers.push_back({observer, checkSize, isGreater, notifyFunc, !reached});
+            updateObserverRange();
+            pthread_mutex_unlock(&observerMutex);
         }
         
         void removeObserver(void *observer, int checkSize, bool isGreater){
             
+            pthread_mutex_lock(&observerMutex);
             for (auto iter = observers.begin(); iter != observers.end(); iter++) {
-                auto ob = *iter;
-                if (ob->observer == observer &&
-                    ob->checkSize == checkSize &&
-                    ob->isGreater == isGreater) {
+                if (iter->observer == observer &&
+                    iter->checkSize == checkSize &&
+                    iter->isGreater == isGreater) {
                     observers.erase(iter);
                     break;
                 }
             }
+            updateObserverRange();
+            pthread_mutex_unlock(&observerMutex);
+        }
+        
+        void removeAllObservers(){
+            pthread_mutex_lock(&observerMutex);
+            observers.clear();
+            updateObserverRange();
+            pthread_mutex_unlock(&observerMutex);
         }
         
         /** remove all inserted data */
         void flush(){
             RecycleBufferLog("signalAllBlock 1\n");
+            pthread_mutex_lock(&mutex);
             ioDisable = true;
             pthread_cond_broadcast(&inCond);
             pthread_cond_broadcast(&outCond);
             RecycleBufferLog("signalAllBlock 2\n");
             
+            //The blocked inserting thread frees its value when it wakes up, wait for it.
             while (insertingVal != nullptr) {
-                //sleep
+                pthread_cond_wait(&idleCond, &mutex);
+            }
+            
+            if (singleProducerConsumer) {
+                
+                /* claim all valid values at once, the consumer's CAS fails if it races with us.
+                 * The producer reuses the slots as soon as tail moves, so the values are copied out before claiming them.
+                 * If the consumer moves first, head is loaded again, so tail never goes back to a head loaded before.
+                 */
+                RingStorage *ring = ringStorage.load(std::memory_order_acquire);
+                std::vector<T> claimed;
+                long tail = ringTail.load(std::memory_order_seq_cst);
+                long head;
+                do {
+                    head = ringHead.load(std::memory_order_acquire);
+                    claimed.clear();
+                    for (long i = tail; ring != nullptr && i < head; i++) {
+                        claimed.push_back(ring->values[i & ring->mask]);
+                    }
+                } while (!ringTail.compare_exchange_weak(tail, head, std::memory_order_seq_cst));
+                
+                //a drain may be reading the values we claimed, it's short and never blocks.
+                while (consumerDraining.load(std::memory_order_seq_cst)) {
+                    sched_yield();
+                }
+                /* The measures of other values may be added or subtracted meanwhile by the producer and the consumer,
+                 * so only those of the claimed values are subtracted, before they're freed.
+                 */
+                for (T &val : claimed) {
+                    subMeasure(val);
+                    if (valueFreeFunc != nullptr) valueFreeFunc(&val);
+                }
+                addCounter(flushCount, 1);
+                addCounter(flushedCount, head - tail);
+                
+                ioDisable = false;
+                pthread_mutex_unlock(&mutex);
+#if DEBUG
+                myStateObserver.mark(name, 0);
+#endif
+                return;
             }
             
-            //free valid datas
-            if (usedSize > 0 && valueFreeFunc != nullptr) {
+            addCounter(flushCount, 1);
+            addCounter(flushedCount, usedSize);
+            
+            //free valid datas, their measures are subtracted like getting them out.
+            if (usedSize > 0) {
                 RecycleNode *curNode = frontNode;
                 do {
                     usedSize--;
-                    valueFreeFunc(&(curNode->val));
+                    subMeasure(curNode->val);
+                    if (valueFreeFunc != nullptr) valueFreeFunc(&(curNode->val));
                     curNode = curNode->next;
                 } while (curNode != backNode->next);
             }
             
             usedSize = 0;
-            backNode = frontNode->pre;
-            myStateObserver.mark(name, usedSize);
+            if (frontNode) backNode = frontNode->pre;
             
             ioDisable = false;
+            pthread_mutex_unlock(&mutex);
+#if DEBUG
+            myStateObserver.mark(name, 0);
+#endif
             RecycleBufferLog("ioDisable false\n");
         }
         
@@ -389,25 +1460,35 @@ namespace tfmpcore {
         void flushAndFree(){
             
             flush();
-            ioDisable = false;
             
-            //free all nodes
-            RecycleNode *curNode = frontNode;
-            do {
-                RecycleNode *next = curNode->next;
-                free(curNode);
-                curNode = next;
-            } while (curNode != backNode->next);
-            
-            frontNode = nullptr;
-            backNode = nullptr;
-            
-            allocedSize = 0;
-            
-            observers.clear();
+            pthread_mutex_lock(&mutex);
+            if (singleProducerConsumer) {
+                RingStorage *ring = ringStorage.exchange(nullptr);
+                if (ring) {
+                    recordAlloc(0, ring->mask+1);
+                    freeRing(ring);
+                }
+                consumerRing.store(nullptr);
+                freeRetiredRings();
+            }else if (frontNode) {
+                //free all nodes
+                RecycleNode *curNode = frontNode;
+                for (long i = 0; i<allocedSize; i++) {
+                    RecycleNode *next = curNode->next;
+                    delete curNode;
+                    curNode = next;
+                }
+                recordAlloc(0, allocedSize);
+                
+                frontNode = nullptr;
+                backNode = nullptr;
+            }
+            setAllocedSize(0);
             
             ioDisable = true;
-            RecycleBufferLog("ioDisable false\n");
+            pthread_mutex_unlock(&mutex);
+            
+            removeAllObservers();
             RecycleBufferLog("ioDisable end\n");
         }
     };
@@ -0,0 +1,132 @@
+//
+//  ReorderBuffer.hpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/12.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#ifndef ReorderBuffer_hpp
+#define ReorderBuffer_hpp
+
+#include <stdio.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+
+namespace tfmpcore {
+
+    /**
+     * Put values which come out of order back into order, e.g. frames output by a hardware decoder in decoding order.
+     * It's a bounded min-heap, a value is released when there are more than reorderDepth values held,
+     * because no later value can be less than it. Inserting and releasing are O(log n).
+     *
+     * If a value is less than the one released last, the depth is too small, it grows by one up to maxReorderDepth.
+     */
+    template<typename T>
+    class ReorderBuffer{
+
+        std::vector<T> heap;
+
+        int reorderDepth = 0;
+        int maxReorderDepth = 16;
+
+        bool hasReleased = false;
+        int64_t lastReleasedKey = 0;
+
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+        //std heap functions make a max-heap, so reverse it.
+        struct KeyGreater{
+            int64_t (*keyFunc)(T &val);
+            bool operator()(T &val1, T &val2) const{
+                return keyFunc(val1) > keyFunc(val2);
+            }
+        };
+
+        bool popLocked(T *valP){
+            if (heap.empty()) {
+                return false;
+            }
+
+            std::pop_heap(heap.begin(), heap.end(), KeyGreater{valueKeyFunc});
+            *valP = heap.back();
+            heap.pop_back();
+
+            hasReleased = true;
+            lastReleasedKey = valueKeyFunc(*valP);
+
+            return true;
+        }
+
+    public:
+
+        /** The key for ordering, e.g. pts of a frame. It must be set before pushing. */
+        int64_t (*valueKeyFunc)(T &val) = nullptr;
+
+        /** Use this func to free values when flushing. */
+        void (*valueFreeFunc)(T *val) = nullptr;
+
+        void setReorderDepth(int depth, int maxDepth = 16){
+            pthread_mutex_lock(&mutex);
+            maxReorderDepth = std::max(maxDepth, 0);
+            reorderDepth = std::min(std::max(depth, 0), maxReorderDepth);
+            heap.reserve(maxReorderDepth+1);
+            pthread_mutex_unlock(&mutex);
+        }
+
+        int getReorderDepth(){
+            return reorderDepth;
+        }
+
+        int size(){
+            return (int)heap.size();
+        }
+
+        /**
+         * Push a value in, and get out the least value if it's next in order.
+         * @return true if a value is released to releasedVal.
+         */
+        bool push(T val, T *releasedVal){
+            pthread_mutex_lock(&mutex);
+
+            if (hasReleased && valueKeyFunc(val) < lastReleasedKey && reorderDepth < maxReorderDepth) {
+                reorderDepth++;
+            }
+
+            heap.push_back(val);
+            std::push_heap(heap.begin(), heap.end(), KeyGreater{valueKeyFunc});
+
+            bool released = false;
+            if ((int)heap.size() > reorderDepth) {
+                released = popLocked(releasedVal);
+            }
+
+            pthread_mutex_unlock(&mutex);
+            return released;
+        }
+
+        /** Get out the least value without waiting for later values, use it at the end of stream. */
+        bool pop(T *valP){
+            pthread_mutex_lock(&mutex);
+            bool result = popLocked(valP);
+            pthread_mutex_unlock(&mutex);
+            return result;
+        }
+
+        /** Free all values and forget the last released one, e.g. for seeking. */
+        void flush(){
+            pthread_mutex_lock(&mutex);
+            if (valueFreeFunc) {
+                for (auto iter = heap.begin(); iter != heap.end(); iter++) {
+                    valueFreeFunc(&(*iter));
+                }
+            }
+            heap.clear();
+            hasReleased = false;
+            pthread_mutex_unlock(&mutex);
+        }
+    };
+}
+
+#endif /* ReorderBuffer_hpp */
@@ -37,7 +37,7 @@ double SyncClock::presentTimeForVideo(int64_t videoPts, AVRational timeBase){
     }
     
     
-    return ptsCorrection/timeDen+sourcePts;
+    return ptsCorrection/timeDen+sourcePts/speed;
 }
 
 double SyncClock::presentTimeForAudio(int64_t audioPts, AVRational timeBase){
@@ -52,7 +52,7 @@ double SyncClock::presentTimeForAudio(int64_t audioPts, AVRational timeBase){
     if (ptsCorrection < 0) {
         return av_gettime_relative()/timeDen;
     }
-    return ptsCorrection/timeDen+sourcePts;
+    return ptsCorrection/timeDen+sourcePts/speed;
 }
 
 //TODO: remain time is much bigger than the duration of frame, discard it and correct ptsCorrection's value.
@@ -70,7 +70,8 @@ void SyncClock::presentVideo(int64_t videoPts, AVRational timeBase){
         return;
     }
     
-    ptsCorrection = av_gettime_relative() - videoPts*av_q2d(timeBase)*timeDen;
+    speed = pendingSpeed.load(std::memory_order_relaxed);
+    ptsCorrection = av_gettime_relative() - videoPts*av_q2d(timeBase)/speed*timeDen;
 }
 
 void SyncClock::presentAudio(int64_t audioPts, AVRational timeBase, double delay){
@@ -78,5 +79,6 @@ void SyncClock::presentAudio(int64_t audioPts, AVRational timeBase, double delay
         return;
     }
     
-    ptsCorrection = av_gettime_relative() + delay - audioPts*av_q2d(timeBase)*timeDen;
+    speed = pendingSpeed.load(std::memory_order_relaxed);
+    ptsCorrection = av_gettime_relative() + delay - audioPts*av_q2d(timeBase)/speed*timeDen;
 }
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <libavutil/rational.h>
+#include <atomic>
 
 namespace tfmpcore {
     class SyncClock{
@@ -20,6 +21,11 @@ namespace tfmpcore {
         
         double minMediaTime = 0;
         
+        //media time runs speed times as fast as real time. It's only changed by the major side when presenting,
+        //together with ptsCorrection, so the clock never jumps.
+        double speed = 1;
+        std::atomic<double> pendingSpeed{1};
+        
     public:
         
         bool isAudioMajor = true;
@@ -42,6 +48,14 @@ namespace tfmpcore {
             this->minMediaTime = minMediaTime;
         }
         
+        /** Takes effect from the next presenting of the major stream. */
+        void setSpeed(double speed){
+            if (speed > 0) pendingSpeed.store(speed, std::memory_order_relaxed);
+        }
+        double getSpeed(){
+            return pendingSpeed.load(std::memory_order_relaxed);
+        }
+        
         void reset();
     };
 }
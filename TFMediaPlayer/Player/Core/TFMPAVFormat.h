@@ -31,7 +31,7 @@ typedef enum{
     TFMP_VIDEO_PIX_FMT_NV12_VTB,
 }TFMPVideoPixelFormat;
 
-typedef struct{
+typedef struct TFMPVideoFrameBuffer{
     int width;
     int height;
     TFMPVideoPixelFormat format;
@@ -41,10 +41,32 @@ typedef struct{
     uint8_t *pixels[8];
     int linesize[8];
     
+    //pixels to leave out at the edges of width x height, which aren't a part of the picture.
+    int cropLeft;
+    int cropTop;
+    int cropRight;
+    int cropBottom;
+    
     void *opaque;
     
+    /** A sink keeps the frame after the display callback by retaining it. retainFunc returns a new handle sharing the pixels
+     * without copying, which is given back by TFMPVideoFrameBufferRelease. Frames without retainFunc can't be kept.
+     */
+    struct TFMPVideoFrameBuffer *(*retainFunc)(struct TFMPVideoFrameBuffer *frameBuf);
+    void (*releaseFunc)(struct TFMPVideoFrameBuffer *frameBuf);
+    
 }TFMPVideoFrameBuffer;
 
+inline TFMPVideoFrameBuffer *TFMPVideoFrameBufferRetain(TFMPVideoFrameBuffer *frameBuf){
+    return frameBuf->retainFunc ? frameBuf->retainFunc(frameBuf) : NULL;
+}
+
+inline void TFMPVideoFrameBufferRelease(TFMPVideoFrameBuffer **frameBuf){
+    if (*frameBuf == NULL) return;
+    (*frameBuf)->releaseFunc(*frameBuf);
+    *frameBuf = NULL;
+}
+
 typedef int (*TFMPVideoFrameDisplayFunc)(TFMPVideoFrameBuffer *, void *context);
 
 /** audio */
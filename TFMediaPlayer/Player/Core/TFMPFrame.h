@@ -22,6 +22,8 @@ namespace tfmpcore {
         TFMPFrameTypeVTBVideo,
     }TFMPFrameType;
     
+    class TFMPFramePool;
+    
     class TFMPFrame{
         
     public:
@@ -34,6 +36,11 @@ namespace tfmpcore {
         void (*freeFrameFunc)(TFMPFrame **frame);
         
         TFMPVideoFrameBuffer *displayBuffer;
+        
+        /** Frames from a TFMPFramePool keep their display buffer in the same allocation, displayBuffer points to it. */
+        TFMPVideoFrameBuffer displayBufferStorage;
+        TFMPFramePool *pool = nullptr;
+        TFMPFrame *poolNext = nullptr;
     };
 }
 
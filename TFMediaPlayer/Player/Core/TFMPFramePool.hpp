@@ -0,0 +1,127 @@
+//
+//  TFMPFramePool.hpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/18.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#ifndef TFMPFramePool_hpp
+#define TFMPFramePool_hpp
+
+extern "C"{
+#include <libavutil/frame.h>
+}
+
+#include <atomic>
+#include "TFMPFrame.h"
+
+namespace tfmpcore {
+    
+    /** hitCount counts frames reused from the pool, missCount counts frames newly allocated. */
+    typedef struct{
+        uint64_t hitCount;
+        uint64_t missCount;
+    }TFMPFramePoolStats;
+    
+    /**
+     * Recycle TFMPFrame objects with their AVFrame shells and embedded display buffers, so steady decoding doesn't allocate.
+     *
+     * Only one thread acquires frames, the decode thread, and frames can be recycled from any thread.
+     * Recycled frames are pushed to a lock-free list, and the acquiring thread takes the whole list at once when its own list runs out,
+     * so no one pops single nodes from the shared list and there is no ABA problem.
+     *
+     * The pool is refcounted by its owner and the frames out of it. The owner calls close() instead of deleting it,
+     * and it's deleted when the last frame comes back.
+     */
+    class TFMPFramePool{
+        
+        bool withAVFrame;
+        
+        std::atomic<TFMPFrame *> recycled;
+        TFMPFrame *freeList = nullptr;  //only touched by the acquiring thread.
+        
+        std::atomic<long> refCount;
+        
+        //only written by the acquiring thread.
+        std::atomic<uint64_t> hitCount;
+        std::atomic<uint64_t> missCount;
+        
+        ~TFMPFramePool(){
+            freeFrames(freeList);
+            freeFrames(recycled.exchange(nullptr, std::memory_order_acquire));
+        }
+        
+        static void freeFrames(TFMPFrame *frame){
+            while (frame) {
+                TFMPFrame *next = frame->poolNext;
+                if (frame->frame) av_frame_free(&frame->frame);
+                delete frame;
+                frame = next;
+            }
+        }
+        
+        inline void releaseRef(){
+            if (refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                delete this;
+            }
+        }
+    
+    public:
+    
+        /** @param withAVFrame Every frame owns an AVFrame shell, it's unreferenced before recycling and kept allocated. */
+        TFMPFramePool(bool withAVFrame):withAVFrame(withAVFrame),recycled(nullptr),refCount(1),hitCount(0),missCount(0){};
+        
+        /** Get a frame whose displayBuffer points to its own storage. It must be called from one thread only. */
+        TFMPFrame *acquire(){
+            if (freeList == nullptr) {
+                freeList = recycled.exchange(nullptr, std::memory_order_acquire);
+            }
+            
+            TFMPFrame *frame = freeList;
+            if (frame) {
+                freeList = frame->poolNext;
+                hitCount.store(hitCount.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+            }else{
+                frame = new TFMPFrame();
+                frame->pool = this;
+                if (withAVFrame) frame->frame = av_frame_alloc();
+                missCount.store(missCount.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+            }
+            
+            frame->poolNext = nullptr;
+            frame->displayBuffer = &frame->displayBufferStorage;
+            refCount.fetch_add(1, std::memory_order_relaxed);
+            
+            return frame;
+        }
+        
+        /** Give a frame back to its pool, its contents must have been released, e.g. av_frame_unref. It can be called from any thread. */
+        static void recycle(TFMPFrame *frame){
+            TFMPFramePool *pool = frame->pool;
+            
+            TFMPFrame *head = pool->recycled.load(std::memory_order_relaxed);
+            do {
+                frame->poolNext = head;
+            } while (!pool->recycled.compare_exchange_weak(head, frame, std::memory_order_release, std::memory_order_relaxed));
+            
+            pool->releaseRef();
+        }
+        
+        /** Free the recycled frames which the acquiring thread hasn't taken, e.g. on memory warning. It can be called from any thread before close(). */
+        void trim(){
+            freeFrames(recycled.exchange(nullptr, std::memory_order_acquire));
+        }
+        
+        /** The owner gives up the pool, no acquiring after it. */
+        void close(){
+            releaseRef();
+        }
+        
+        TFMPFramePoolStats getStats(){
+            return {hitCount.load(std::memory_order_relaxed), missCount.load(std::memory_order_relaxed)};
+        }
+    };
+}
+
+#endif /* TFMPFramePool_hpp */
@@ -0,0 +1,159 @@
+//
+//  TFMPPacketPool.hpp
+//  TFMediaPlayer
+//
+//  Created by shiwei on 2018/10/19.
+//  Copyright © 2018年 shiwei. All rights reserved.
+//
+
+#ifndef TFMPPacketPool_hpp
+#define TFMPPacketPool_hpp
+
+extern "C"{
+#include <libavcodec/avcodec.h>
+}
+
+#include <atomic>
+#include <stdint.h>
+
+#define TFMPPacketPoolCapacity  1024
+
+namespace tfmpcore {
+    
+    /** hitCount counts shells reused from the pool, missCount counts shells newly allocated, overflowCount counts shells freed because the pool was full. */
+    typedef struct{
+        uint64_t hitCount;
+        uint64_t missCount;
+        uint64_t overflowCount;
+    }TFMPPacketPoolStats;
+    
+    /**
+     * Recycle AVPacket shells between the read threads and the decoders of all players, so reading a packet doesn't allocate one.
+     * Only the shells are recycled, payloads are still allocated by the demuxer inside av_read_frame.
+     *
+     * It's a bounded lock-free queue with a sequence number in every cell, any thread can acquire and release.
+     * When it's full, released shells are freed, so the cached memory is limited to TFMPPacketPoolCapacity shells.
+     */
+    class TFMPPacketPool{
+        
+        typedef struct{
+            std::atomic<size_t> sequence;
+            AVPacket *packet;
+        }Cell;
+        
+        Cell cells[TFMPPacketPoolCapacity];
+        
+        //the positions are changed by different sides, keep them in different cache lines.
+        char pad0[64];
+        std::atomic<size_t> enqueuePos;
+        char pad1[64];
+        std::atomic<size_t> dequeuePos;
+        char pad2[64];
+        
+        std::atomic<uint64_t> hitCount;
+        std::atomic<uint64_t> missCount;
+        std::atomic<uint64_t> overflowCount;
+        
+        TFMPPacketPool():enqueuePos(0),dequeuePos(0),hitCount(0),missCount(0),overflowCount(0){
+            for (size_t i = 0; i<TFMPPacketPoolCapacity; i++) {
+                cells[i].sequence.store(i, std::memory_order_relaxed);
+                cells[i].packet = nullptr;
+            }
+        }
+        
+        //It's never deleted, the read threads and decoders may still release packets at exit.
+        static TFMPPacketPool *sharedPool(){
+            static TFMPPacketPool *pool = new TFMPPacketPool();
+            return pool;
+        }
+        
+        bool push(AVPacket *packet){
+            const size_t mask = TFMPPacketPoolCapacity-1;
+            size_t pos = enqueuePos.load(std::memory_order_relaxed);
+            Cell *cell;
+            while (true) {
+                cell = &cells[pos & mask];
+                intptr_t diff = (intptr_t)cell->sequence.load(std::memory_order_acquire) - (intptr_t)pos;
+                if (diff == 0) {
+                    if (enqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+                }else if (diff < 0) {
+                    return false;  //full
+                }else{
+                    pos = enqueuePos.load(std::memory_order_relaxed);
+                }
+            }
+            cell->packet = packet;
+            cell->sequence.store(pos+1, std::memory_order_release);
+            return true;
+        }
+        
+        bool pop(AVPacket **packetP){
+            const size_t mask = TFMPPacketPoolCapacity-1;
+            size_t pos = dequeuePos.load(std::memory_order_relaxed);
+            Cell *cell;
+            while (true) {
+                cell = &cells[pos & mask];
+                intptr_t diff = (intptr_t)cell->sequence.load(std::memory_order_acquire) - (intptr_t)(pos+1);
+                if (diff == 0) {
+                    if (dequeuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+                }else if (diff < 0) {
+                    return false;  //empty
+                }else{
+                    pos = dequeuePos.load(std::memory_order_relaxed);
+                }
+            }
+            *packetP = cell->packet;
+            cell->sequence.store(pos+mask+1, std::memory_order_release);
+            return true;
+        }
+    
+    public:
+    
+        /** Get an empty packet, use it as one from av_packet_alloc. */
+        static AVPacket *acquire(){
+            TFMPPacketPool *pool = sharedPool();
+            AVPacket *packet = nullptr;
+            if (pool->pop(&packet)) {
+                pool->hitCount.fetch_add(1, std::memory_order_relaxed);
+                return packet;
+            }
+            pool->missCount.fetch_add(1, std::memory_order_relaxed);
+            return av_packet_alloc();
+        }
+        
+        /** Use it instead of av_packet_free for packets from acquire(), the payload is unreferenced and the shell is kept for reusing. */
+        static void release(AVPacket **packetP){
+            AVPacket *packet = *packetP;
+            if (packet == nullptr) {
+                return;
+            }
+            *packetP = nullptr;
+            
+            av_packet_unref(packet);
+            
+            TFMPPacketPool *pool = sharedPool();
+            if (!pool->push(packet)) {
+                pool->overflowCount.fetch_add(1, std::memory_order_relaxed);
+                av_packet_free(&packet);
+            }
+        }
+        
+        /** Free all cached shells, e.g. on memory warning. */
+        static void trim(){
+            TFMPPacketPool *pool = sharedPool();
+            AVPacket *packet = nullptr;
+            while (pool->pop(&packet)) {
+                av_packet_free(&packet);
+            }
+        }
+        
+        static TFMPPacketPoolStats getStats(){
+            TFMPPacketPool *pool = sharedPool();
+            return {pool->hitCount.load(std::memory_order_relaxed),
+                    pool->missCount.load(std::memory_order_relaxed),
+                    pool->overflowCount.load(std::memory_order_relaxed)};
+        }
+    };
+}
+
+#endif /* TFMPPacketPool_hpp */
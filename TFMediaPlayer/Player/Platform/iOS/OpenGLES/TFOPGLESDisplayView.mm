@@ -279,7 +279,7 @@ const GLchar *TFVideoDisplay_nv12_fs_es2 = TFGLShaderSource
 }
 
 -(TFMPVideoFrameBuffer)TFMPFrameBufferFromPixelBuffer:(CVPixelBufferRef)pixelBuffer{
-    TFMPVideoFrameBuffer frame;
+    TFMPVideoFrameBuffer frame = {};
     frame.width = (int)CVPixelBufferGetWidth(pixelBuffer);
     frame.height = (int)CVPixelBufferGetHeight(pixelBuffer);
     
@@ -334,8 +334,18 @@ const GLchar *TFVideoDisplay_nv12_fs_es2 = TFGLShaderSource
         [self configRenderData];
     }
     
-    float width = frameBuf->width;
-    float height = frameBuf->height;
+    //the chroma planes of these formats are subsampled by 2 in both directions.
+    float width = frameBuf->width - frameBuf->cropLeft - frameBuf->cropRight;
+    float height = frameBuf->height - frameBuf->cropTop - frameBuf->cropBottom;
+    uint8_t *pixels[3] = {
+        frameBuf->pixels[0] + frameBuf->cropTop*frameBuf->linesize[0] + frameBuf->cropLeft,
+    };
+    if (frameBuf->format == TFMP_VIDEO_PIX_FMT_YUV420P) {
+        pixels[1] = frameBuf->pixels[1] + frameBuf->cropTop/2*frameBuf->linesize[1] + frameBuf->cropLeft/2;
+        pixels[2] = frameBuf->pixels[2] + frameBuf->cropTop/2*frameBuf->linesize[2] + frameBuf->cropLeft/2;
+    }else if (frameBuf->format == TFMP_VIDEO_PIX_FMT_NV12){
+        pixels[1] = frameBuf->pixels[1] + frameBuf->cropTop/2*frameBuf->linesize[1] + frameBuf->cropLeft/2*2;
+    }
     
     //TODO: view mode must be runed on main thread
     if (width != _lastFrameSize.width || height != _lastFrameSize.height) {
@@ -344,9 +354,9 @@ const GLchar *TFVideoDisplay_nv12_fs_es2 = TFGLShaderSource
     }
 
     if (frameBuf->format == TFMP_VIDEO_PIX_FMT_YUV420P) {
-        genTextures_YUV420P(frameBuf, textures, width, height, frameBuf->linesize);
+        genTextures_YUV420P(pixels, textures, width, height, frameBuf->linesize);
     }else if (frameBuf->format == TFMP_VIDEO_PIX_FMT_NV12){
-        genTextures_NV12(frameBuf, textures, width, height, frameBuf->linesize);
+        genTextures_NV12(pixels, textures, width, height, frameBuf->linesize);
     }else if (frameBuf->format == TFMP_VIDEO_PIX_FMT_NV12_VTB){
         if (!CVTextureCache) {
             CVOpenGLESTextureCacheCreate(kCFAllocatorDefault, NULL, self.context, NULL, &CVTextureCache);
@@ -395,25 +405,25 @@ const GLchar *TFVideoDisplay_nv12_fs_es2 = TFGLShaderSource
 
 #pragma mark - display different format
 
-inline void genTextures_YUV420P(TFMPVideoFrameBuffer *frameBuf, GLuint *textures, int width, int height, int *linesize){
+inline void genTextures_YUV420P(uint8_t **pixels, GLuint *textures, int width, int height, int *linesize){
     //yuv420p has 3 planes: y u v. U plane and v plane have half width and height of y plane.
     
     glPixelStorei(GL_UNPACK_ROW_LENGTH, linesize[0]);  //linesize may isn't equal to width.
     
     glBindTexture(GL_TEXTURE_2D, textures[0]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, frameBuf->pixels[0]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, pixels[0]);
     
     
     glPixelStorei(GL_UNPACK_ROW_LENGTH, linesize[1]);
     
     glBindTexture(GL_TEXTURE_2D, textures[1]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width/2.0, height/2, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, frameBuf->pixels[1]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width/2.0, height/2, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, pixels[1]);
     
     
     glPixelStorei(GL_UNPACK_ROW_LENGTH, linesize[2]);
     
     glBindTexture(GL_TEXTURE_2D, textures[2]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width/2.0, height/2, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, frameBuf->pixels[2]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width/2.0, height/2, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, pixels[2]);
     
     glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 }
@@ -424,20 +434,20 @@ inline void useTexturesForProgram_YUV420P(TFOPGLProgram *program, GLuint *textur
     program->setTexture("vPlaneTex", GL_TEXTURE_2D, textures[2], 2);
 }
 
-inline void genTextures_NV12(TFMPVideoFrameBuffer *frameBuf, GLuint *textures, int width, int height, int *linesize){
+inline void genTextures_NV12(uint8_t **pixels, GLuint *textures, int width, int height, int *linesize){
     //nv12 has 2 planes: y and interleaved u v. U plane and v plane have half width and height of y plane.
     
     glPixelStorei(GL_UNPACK_ROW_LENGTH, linesize[0]);  //linesize may isn't equal to width.
     
     glBindTexture(GL_TEXTURE_2D, textures[0]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, frameBuf->pixels[0]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE, width, height, 0, GL_LUMINANCE, GL_UNSIGNED_BYTE, pixels[0]);
 
 
     glPixelStorei(GL_UNPACK_ROW_LENGTH, linesize[1]);
 
     //using GL_LUMINANCE_ALPHA to generate dual channel texture.
     glBindTexture(GL_TEXTURE_2D, textures[1]);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA, width/2, height/2, 0, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, frameBuf->pixels[1]);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA, width/2, height/2, 0, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, pixels[1]);
 
     glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 }
@@ -65,6 +65,11 @@
         _playController->displayContext = (__bridge void *)self;
         _playController->displayVideoFrame = displayVideoFrame_iOS;
         
+        NSString *indexDir = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES).firstObject stringByAppendingPathComponent:@"TFMPKeyframeIndex"];
+        if ([[NSFileManager defaultManager] createDirectoryAtPath:indexDir withIntermediateDirectories:YES attributes:nil error:nil]) {
+            _playController->keyframeIndexDir = indexDir.UTF8String;
+        }
+        
         _playController->playStoped = [self](tfmpcore::PlayController *playController, int reason){
             
             if (reason == 0 && _state != TFMediaPlayerStateStoping) {
@@ -112,11 +117,21 @@
         };
         
         [self setupDefaultPlayControlView];
+        
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(didReceiveMemoryWarning:) name:UIApplicationDidReceiveMemoryWarningNotification object:nil];
     }
     
     return self;
 }
 
+-(void)dealloc{
+    [[NSNotificationCenter defaultCenter] removeObserver:self name:UIApplicationDidReceiveMemoryWarningNotification object:nil];
+}
+
+-(void)didReceiveMemoryWarning:(NSNotification *)notification{
+    _playController->releaseUnusedMemory();
+}
+
 -(void)setupDefaultPlayControlView{
     _defaultControlView = [[TFMPPlayControlView alloc] init];
     _defaultControlView.autoresizingMask = UIViewAutoresizingFlexibleWidth | UIViewAutoresizingFlexibleHeight;
@@ -20,24 +20,38 @@ extern "C"{
 #include <VideoToolbox/VideoToolbox.h>
 
 #include "RecycleBuffer.hpp"
+#include "ReorderBuffer.hpp"
 #include "MediaTimeFilter.hpp"
 #include "TFMPAVFormat.h"
 #include "TFMPFrame.h"
+#include "TFMPFramePool.hpp"
+#include "TFMPPacketPool.hpp"
+#include "DecodeDegrader.hpp"
+#include "MediaDecoder.hpp"
+#include "DecoderRegistry.hpp"
 
 using namespace std;
 
 //An video & audio decoder based on VideoToolBox and ffmpeg.
 namespace tfmpcore {
     
-    class VTBDecoder{
+    class VTBDecoder : public MediaDecoder{
         
         AVFormatContext *fmtCtx;
         int steamIndex;
-        AVCodecContext *codecCtx;
+        AVCodecContext *codecCtx = nullptr;
         AVRational timebase;
         
-        RecycleBuffer<AVPacket*> pktBuffer = RecycleBuffer<AVPacket*>(30, true);
-        RecycleBuffer<TFMPFrame*> frameBuffer = RecycleBuffer<TFMPFrame*>(30, true);
+        RecycleBuffer<AVPacket*> pktBuffer{2000, false, true};
+        //frames are put in order by reorderBuffer before inserting.
+        RecycleBuffer<TFMPFrame*> frameBuffer{30, false, true};
+        
+        /** Reserve the buffers for their budgets with the rate and size of the stream. */
+        void reserveBuffers();
+        
+        //VideoToolBox outputs frames in decoding order.
+        ReorderBuffer<TFMPFrame*> reorderBuffer;
+        void releaseReorderedFrames();
         
         pthread_t decodeThread;
         static void *decodeLoop(void *context);
@@ -55,69 +69,141 @@ namespace tfmpcore {
         pthread_mutex_t pauseMutex = PTHREAD_MUTEX_INITIALIZER;
         
         
-        VTDecompressionSessionRef _decodeSession;
-        CMFormatDescriptionRef _videoFmtDesc;
+        VTDecompressionSessionRef _decodeSession = nullptr;
+        CMFormatDescriptionRef _videoFmtDesc = nullptr;
         
         uint8_t *_sps;
         uint8_t *_pps;
         uint32_t _spsSize = 0;
         uint32_t _ppsSize = 0;
+        //the bytes of the length before every nalu, from avcC.
+        int _nalLengthSize = 4;
+        
+        //VideoToolBox has no skip options, so packets of frames which aren't needed are not decoded at higher levels.
+        DecodeDegrader degrader;
+        int appliedDegradeLevel = 0;
         
         void decodePacket(AVPacket *pkt);
         
         void static decodeCallback(void * CM_NULLABLE decompressionOutputRefCon,void * CM_NULLABLE sourceFrameRefCon,OSStatus status,VTDecodeInfoFlags infoFlags,CM_NULLABLE CVImageBufferRef imageBuffer,CMTime presentationTimeStamp,CMTime presentationDuration );
         
         inline static void freePacket(AVPacket **pkt){
-            av_packet_free(pkt);
+            TFMPPacketPool::release(pkt);
         }
         
+        //Frames are acquired from it in the decode callback, which is called on the decode thread as decoding is synchronous.
+        TFMPFramePool *framePool = nullptr;
+        
         inline static void freeFrame(TFMPFrame **frameP){
             TFMPFrame *frame = *frameP;
             
             CVPixelBufferRef pixelBuffer = (CVPixelBufferRef)frame->displayBuffer->opaque;
             CVPixelBufferRelease(pixelBuffer);
+            frame->displayBuffer->opaque = nullptr;
             
-            delete frame->displayBuffer;
-            
-            delete frame;
+            TFMPFramePool::recycle(frame);
             *frameP = nullptr;
             myStateObserver.mark("VTBFrame", -1, true);
         }
         
-        inline static int frameCompare(TFMPFrame *&frame1, TFMPFrame *&frame2){
-            if (frame1->pts < frame2->pts) {
-                return -1;
-            }else{
-                return 1;
-            }
+        inline static long packetBytes(AVPacket *&pkt, void *context){
+            return pkt->size;
+        }
+        
+        inline static double packetDuration(AVPacket *&pkt, void *context){
+            VTBDecoder *decoder = (VTBDecoder *)context;
+            return pkt->duration * av_q2d(decoder->timebase);
+        }
+        
+        //the duration of VTB frame is unknown, so frames are only limited by bytes.
+        inline static long frameBytes(TFMPFrame *&frame, void *context){
+            return CVPixelBufferGetDataSize((CVPixelBufferRef)frame->displayBuffer->opaque);
+        }
+        
+        inline static int64_t framePts(TFMPFrame *&frame){
+            return (int64_t)frame->pts;
         }
         
-        static TFMPVideoFrameBuffer *displayBufferFromPixelBuffer(CVPixelBufferRef pixelBuffer);
+        static void fillDisplayBuffer(TFMPVideoFrameBuffer *frame, CVPixelBufferRef pixelBuffer);
+        //A retained display buffer holds its own retain of the pixel buffer in opaque.
+        static TFMPVideoFrameBuffer *retainDisplayBuffer(TFMPVideoFrameBuffer *frameBuf);
+        static void releaseDisplayBuffer(TFMPVideoFrameBuffer *frameBuf);
+        
+        static bool canDecode(AVStream *stream);
+        static MediaDecoder *create(AVFormatContext *fmtCtx, int streamIndex, AVMediaType type);
         
     protected:
         void flushContext();
         
     public:
-        string name;
-        AVMediaType type;
-        VTBDecoder(AVFormatContext *fmtCtx, int steamIndex, AVMediaType type):fmtCtx(fmtCtx),steamIndex(steamIndex),type(type){
+        VTBDecoder(AVFormatContext *fmtCtx, int steamIndex, AVMediaType type):MediaDecoder(type),fmtCtx(fmtCtx),steamIndex(steamIndex){
             timebase = fmtCtx->streams[steamIndex]->time_base;
         };
         
+        /** H.264 in avcC, the Annex B streams, e.g. MPEG-TS, go to FFmpeg. */
+        static TFMPDecoderBackend backend(){
+            return {"VideoToolBox", canDecode, create};
+        }
+        
         RecycleBuffer<TFMPFrame*> * sharedFrameBuffer(){
             return &frameBuffer;
         };
         
-        MediaTimeFilter * mediaTimeFilter;
+        /** Limit the packet and frame buffers by bytes and media duration. */
+        void setBufferBudget(RecycleBufferBudget packetBudget, RecycleBufferBudget frameBudget);
+        
+        /** Free the unused storages of the buffers, e.g. on memory warning. */
+        void releaseUnusedMemory();
+        RecycleBufferAllocStats packetAllocStats();
+        RecycleBufferAllocStats frameAllocStats();
         
         bool prepareDecode();
         void startDecode();
         void stopDecode();
         
         void insertPacket(AVPacket *packet);
+        /** Insert a run of packets with one synchronisation, the packets are taken over. */
+        int insertPackets(AVPacket **packets, int count, double timeout);
+        /** An empty packet makes it output the frames held for reordering. */
+        void insertEndPacket();
         
         bool bufferIsEmpty();
         
+        /** The count of frames which may be held for reordering. */
+        int reorderDepth(){
+            return reorderBuffer.getReorderDepth();
+        }
+        
+        /** The media duration of waiting packets, unit is second. The duration of frames is unknown. */
+        double bufferedDuration(){
+            return pktBuffer.getUsedDuration();
+        }
+        
+        bool packetBufferIsFull(){
+            return pktBuffer.isFull();
+        }
+        
+        bool packetBufferIsEmpty(){
+            return pktBuffer.isEmpty();
+        }
+        
+        RecycleBufferTelemetry packetTelemetry(){
+            return pktBuffer.telemetry();
+        }
+        
+        RecycleBufferTelemetry frameTelemetry(){
+            return frameBuffer.telemetry();
+        }
+        
+        TFMPFramePoolStats framePoolStats(){
+            return framePool ? framePool->getStats() : TFMPFramePoolStats{0, 0};
+        }
+        
+        /** Report the lateness of displayed frames to it. */
+        DecodeDegrader *getDegrader(){
+            return &degrader;
+        }
+        
         void activeBlock(bool flag);
         void flush();
         void freeResources();
@@ -14,9 +14,8 @@ using namespace tfmpcore;
 
 #pragma mark -
 
-TFMPVideoFrameBuffer * VTBDecoder::displayBufferFromPixelBuffer(CVPixelBufferRef pixelBuffer){
+void VTBDecoder::fillDisplayBuffer(TFMPVideoFrameBuffer *frame, CVPixelBufferRef pixelBuffer){
     
-    TFMPVideoFrameBuffer *frame = new TFMPVideoFrameBuffer();
     frame->opaque = CVPixelBufferRetain(pixelBuffer);
     
     frame->width = (int)CVPixelBufferGetWidth(pixelBuffer);
@@ -29,12 +28,25 @@ TFMPVideoFrameBuffer * VTBDecoder::displayBufferFromPixelBuffer(CVPixelBufferRef
     frame->pixels[0] = (uint8_t*)CVPixelBufferGetBaseAddressOfPlane(pixelBuffer, 0);
     frame->pixels[1] = (uint8_t*)CVPixelBufferGetBaseAddressOfPlane(pixelBuffer, 1);
     
-    frame->linesize[0] = (int)CVPixelBufferGetWidthOfPlane(pixelBuffer, 0);
-    frame->linesize[1] = (int)CVPixelBufferGetWidthOfPlane(pixelBuffer, 1);
+    frame->linesize[0] = (int)CVPixelBufferGetBytesPerRowOfPlane(pixelBuffer, 0);
+    frame->linesize[1] = (int)CVPixelBufferGetBytesPerRowOfPlane(pixelBuffer, 1);
     
     CVPixelBufferUnlockBaseAddress(pixelBuffer, 0);
     
-    return frame;
+    frame->cropLeft = frame->cropTop = frame->cropRight = frame->cropBottom = 0;
+    frame->retainFunc = retainDisplayBuffer;
+    frame->releaseFunc = releaseDisplayBuffer;
+}
+
+TFMPVideoFrameBuffer *VTBDecoder::retainDisplayBuffer(TFMPVideoFrameBuffer *frameBuf){
+    TFMPVideoFrameBuffer *retained = new TFMPVideoFrameBuffer(*frameBuf);
+    CVPixelBufferRetain((CVPixelBufferRef)frameBuf->opaque);
+    return retained;
+}
+
+void VTBDecoder::releaseDisplayBuffer(TFMPVideoFrameBuffer *frameBuf){
+    CVPixelBufferRelease((CVPixelBufferRef)frameBuf->opaque);
+    delete frameBuf;
 }
 
 static void CFDictionarySetSInt32(CFMutableDictionaryRef dictionary, CFStringRef key, SInt32 numberSInt32)
@@ -68,34 +80,118 @@ static void CFDictionarySetData(CFMutableDictionaryRef dict, CFStringRef key, ui
 
 void VTBDecoder::decodeCallback(void * CM_NULLABLE decompressionOutputRefCon,void * CM_NULLABLE sourceFrameRefCon,OSStatus status,VTDecodeInfoFlags infoFlags,CM_NULLABLE CVImageBufferRef imageBuffer,CMTime presentationTimeStamp,CMTime presentationDuration ){
     
+    VTBDecoder *decoder = (VTBDecoder *)decompressionOutputRefCon;
     
     if (status != 0) {
+        decoder->countDecodeResult(false);
         return;
     }
+    decoder->countDecodeResult(true);
     
-    VTBDecoder *decoder = (VTBDecoder *)decompressionOutputRefCon;
+    //a frame dropped by VideoToolBox comes without image.
+    if (imageBuffer == nullptr) {
+        return;
+    }
     
     if (decoder->shouldDecode) {
         AVPacket *pkt = (AVPacket*)sourceFrameRefCon;
+        if (!decoder->mediaTimeFilter->checkPts(pkt->pts)) {
+            return;
+        }
         
-        TFMPFrame *tfmpFrame = new TFMPFrame();
+        TFMPFrame *tfmpFrame = decoder->framePool->acquire();
         tfmpFrame->type = TFMPFrameTypeVTBVideo;
         tfmpFrame->pts = pkt->pts;
         tfmpFrame->freeFrameFunc = VTBDecoder::freeFrame;
-        tfmpFrame->displayBuffer = VTBDecoder::displayBufferFromPixelBuffer(imageBuffer);
-        
-//        if (!decoder->mediaTimeFilter->checkFrame(frame, false)) {
-//            av_frame_unref(frame);
-//            return;
-//        }
+        VTBDecoder::fillDisplayBuffer(tfmpFrame->displayBuffer, imageBuffer);
         
         myStateObserver.mark("VTBFrame", 1, true);
-        decoder->frameBuffer.blockInsert(tfmpFrame);
+        decoder->degrader.countFrame(decoder->appliedDegradeLevel);
+        TFMPFrame *orderedFrame = nullptr;
+        if (decoder->reorderBuffer.push(tfmpFrame, &orderedFrame)) {
+            decoder->frameBuffer.blockInsert(orderedFrame);
+        }
+    }
+}
+
+void VTBDecoder::releaseReorderedFrames(){
+    if (_decodeSession) {
+        VTDecompressionSessionWaitForAsynchronousFrames(_decodeSession);
+    }
+    
+    TFMPFrame *frame = nullptr;
+    while (reorderBuffer.pop(&frame)) {
+        frameBuffer.blockInsert(frame);
     }
 }
 
 #pragma mark -
 
+static inline bool readBit(const uint8_t *data, int size, int *bitPos, int *bit){
+    if (*bitPos >= size*8) return false;
+    *bit = (data[*bitPos/8] >> (7-*bitPos%8)) & 1;
+    (*bitPos)++;
+    return true;
+}
+
+//exp-Golomb code of h264.
+static bool readUE(const uint8_t *data, int size, int *bitPos, uint32_t *value){
+    int zeros = 0, bit = 0;
+    while (true) {
+        if (!readBit(data, size, bitPos, &bit)) return false;
+        if (bit) break;
+        if (++zeros > 31) return false;
+    }
+    uint32_t suffix = 0;
+    for (int i = 0; i<zeros; i++) {
+        if (!readBit(data, size, bitPos, &bit)) return false;
+        suffix = (suffix << 1) | bit;
+    }
+    *value = (1u << zeros) - 1 + suffix;
+    return true;
+}
+
+/**
+ * Whether a packet can be left undecoded, the same as skip_frame of ffmpeg with AVDISCARD_NONREF or AVDISCARD_BIDIR.
+ * The slice header is read without removing emulation prevention bytes, they can't appear in its first two fields.
+ */
+static bool canSkipPacket(AVPacket *pkt, int nalLengthSize, bool skipNonRef, bool skipBidir){
+    if (!skipNonRef && !skipBidir) return false;
+    
+    const uint8_t *data = pkt->data;
+    int remain = pkt->size;
+    while (remain > nalLengthSize) {
+        uint32_t nalSize = 0;
+        for (int i = 0; i<nalLengthSize; i++) {
+            nalSize = (nalSize << 8) | data[i];
+        }
+        data += nalLengthSize;
+        remain -= nalLengthSize;
+        if (nalSize == 0 || nalSize > (uint32_t)remain) return false;
+        
+        int nalType = data[0] & 0x1f;
+        if (nalType == 5) {
+            return false;
+        }else if (nalType == 1) {
+            //the first slice decides, all slices of a picture have the same reference and type.
+            if (skipNonRef && ((data[0] >> 5) & 3) == 0) return true;
+            if (!skipBidir) return false;
+            
+            int bitPos = 0;
+            uint32_t firstMb = 0, sliceType = 0;
+            if (!readUE(data+1, nalSize-1, &bitPos, &firstMb) ||
+                !readUE(data+1, nalSize-1, &bitPos, &sliceType)) {
+                return false;
+            }
+            return sliceType%5 == 1;
+        }
+        
+        data += nalSize;
+        remain -= nalSize;
+    }
+    return false;
+}
+
 static CMFormatDescriptionRef CreateFormatDescriptionFromCodecData(CMVideoCodecType format_id, int width, int height, const uint8_t *extradata, int extradata_size, uint32_t atom)
 {
     CMFormatDescriptionRef fmt_desc = NULL;
@@ -143,6 +239,33 @@ static CMFormatDescriptionRef CreateFormatDescriptionFromCodecData(CMVideoCodecT
         return NULL;
 }
 
+bool VTBDecoder::canDecode(AVStream *stream){
+    AVCodecParameters *codecpar = stream->codecpar;
+    if (codecpar->codec_type != AVMEDIA_TYPE_VIDEO || codecpar->codec_id != AV_CODEC_ID_H264) {
+        return false;
+    }
+    
+    //only avcC is passed to VideoToolBox, whose first byte is the version 1.
+    if (codecpar->extradata == nullptr || codecpar->extradata_size < 7 || codecpar->extradata[0] != 1) {
+        return false;
+    }
+    
+    //the hardware of iOS devices decodes H.264 up to 4096x2304.
+    if (codecpar->width <= 0 || codecpar->height <= 0 || codecpar->width > 4096 || codecpar->height > 4096) {
+        return false;
+    }
+    
+    if (@available(iOS 11.0, *)) {
+        if (!VTIsHardwareDecodeSupported(kCMVideoCodecType_H264)) return false;
+    }
+    
+    return true;
+}
+
+MediaDecoder *VTBDecoder::create(AVFormatContext *fmtCtx, int streamIndex, AVMediaType type){
+    return new VTBDecoder(fmtCtx, streamIndex, type);
+}
+
 bool VTBDecoder::prepareDecode(){
     
     AVCodec *codec = avcodec_find_decoder(fmtCtx->streams[steamIndex]->codecpar->codec_id);
@@ -162,8 +285,9 @@ bool VTBDecoder::prepareDecode(){
     AVCodecParameters *codecpar = fmtCtx->streams[steamIndex]->codecpar;
     uint8_t *extradata = codecpar->extradata;
     
-    if (extradata[0] == 1) {
+    if (extradata && extradata[0] == 1) {
         TFMPDLOG_C("nalu start with nalu length");
+        if (codecpar->extradata_size > 4) _nalLengthSize = (extradata[4] & 3)+1;
         _videoFmtDesc = CreateFormatDescriptionFromCodecData(kCMVideoCodecType_H264, codecpar->width, codecpar->height, codecpar->extradata, codecpar->extradata_size, 0);
     }else{
         TFMPDLOG_C("nalu start with start code");
@@ -182,16 +306,30 @@ bool VTBDecoder::prepareDecode(){
     
     VTDecompressionOutputCallbackRecord callback = {decodeCallback, this};
     
-    VTDecompressionSessionCreate(
+    if (_videoFmtDesc == nullptr) {
+        CFRelease(destImageAttris);
+        TFMPDLOG_C("create format description error\n");
+        return false;
+    }
+    
+    OSStatus status = VTDecompressionSessionCreate(
                                   kCFAllocatorDefault,
                                   _videoFmtDesc,
                                   NULL,
                                   destImageAttris,
                                   &callback,
                                   &_decodeSession);
+    CFRelease(destImageAttris);
+    if (status != 0 || _decodeSession == nullptr) {
+        TFMPDLOG_C("create decompression session error: %d\n", (int)status);
+        _decodeSession = nullptr;
+        return false;
+    }
     
     shouldDecode = true;
     
+    if (framePool == nullptr) framePool = new TFMPFramePool(false);
+    
 #if DEBUG
     if (type == AVMEDIA_TYPE_AUDIO) {
         strcpy(frameBuffer.name, "audio_frame");
@@ -207,11 +345,54 @@ bool VTBDecoder::prepareDecode(){
     
     pktBuffer.valueFreeFunc = freePacket;
     frameBuffer.valueFreeFunc = freeFrame;
-    frameBuffer.valueCompFunc = frameCompare;
+    
+    reorderBuffer.valueFreeFunc = freeFrame;
+    reorderBuffer.valueKeyFunc = framePts;
+    reorderBuffer.setReorderDepth(codecpar->video_delay);
+    
+    pktBuffer.valueBytesFunc = packetBytes;
+    pktBuffer.valueDurationFunc = packetDuration;
+    pktBuffer.measureContext = this;
+    frameBuffer.valueBytesFunc = frameBytes;
+    
+    reserveBuffers();
     
     return true;
 }
 
+void VTBDecoder::reserveBuffers(){
+    AVStream *stream = fmtCtx->streams[steamIndex];
+    
+    RecycleBufferBudget packetBudget = pktBuffer.getBudget();
+    pktBuffer.reserve(valueCountForDuration(stream, std::max(packetBudget.maxDuration, 1.0)));
+    
+    //the pixel buffers are nv12.
+    RecycleBufferBudget frameBudget = frameBuffer.getBudget();
+    long frameBytes = stream->codecpar->width*stream->codecpar->height*3/2;
+    if (frameBudget.maxBytes > 0 && frameBytes > 0) {
+        frameBuffer.reserve(frameBudget.maxBytes/frameBytes);
+    }
+}
+
+void VTBDecoder::setBufferBudget(RecycleBufferBudget packetBudget, RecycleBufferBudget frameBudget){
+    pktBuffer.setBudget(packetBudget);
+    frameBuffer.setBudget(frameBudget);
+}
+
+void VTBDecoder::releaseUnusedMemory(){
+    pktBuffer.releaseUnused();
+    frameBuffer.releaseUnused();
+    if (framePool) framePool->trim();
+}
+
+RecycleBufferAllocStats VTBDecoder::packetAllocStats(){
+    return pktBuffer.getAllocStats();
+}
+
+RecycleBufferAllocStats VTBDecoder::frameAllocStats(){
+    return frameBuffer.getAllocStats();
+}
+
 void VTBDecoder::startDecode(){
     pthread_create(&decodeThread, NULL, decodeLoop, this);
     pthread_detach(decodeThread);
@@ -255,11 +436,20 @@ void *VTBDecoder::decodeLoop(void *context){
         if (pkt == nullptr) continue;
         
         myStateObserver.mark(name, 4);
-        if (decoder->_decodeSession) {
-            decoder->decodePacket(pkt);
+        if (pkt->size == 0 && pkt->buf == nullptr) {
+            //end of stream, no more frames to reorder with.
+            decoder->releaseReorderedFrames();
+        }else if (decoder->_decodeSession) {
+            //Degrade levels 1, 2 and 5 skip deblocking and IDCT in ffmpeg, VideoToolBox has nothing like them.
+            int level = decoder->degrader.getLevel();
+            decoder->appliedDegradeLevel = level;
+            bool skipNonRef = level >= 3 || decoder->mediaTimeFilter->isBeforeTarget(pkt);
+            if (!canSkipPacket(pkt, decoder->_nalLengthSize, skipNonRef, level >= 4)) {
+                decoder->decodePacket(pkt);
+            }
         }
         
-        if (pkt != nullptr)  av_packet_free(&pkt);
+        if (pkt != nullptr)  TFMPPacketPool::release(&pkt);
     }
     
     myStateObserver.mark(name, 9);
@@ -299,12 +489,13 @@ void VTBDecoder::decodePacket(AVPacket *pkt){
     status = VTDecompressionSessionDecodeFrame(_decodeSession, sample, 0, pkt, &outFlags);
     if (status) {
         TFMPDLOG_C("decode frame error: %d",status);
+        countDecodeResult(false);
     }
 }
 
 void VTBDecoder::insertPacket(AVPacket *packet){
     
-    AVPacket *refPkt = av_packet_alloc();
+    AVPacket *refPkt = TFMPPacketPool::acquire();
     av_packet_ref(refPkt, packet);
     
     pktBuffer.blockInsert(refPkt);
@@ -312,6 +503,21 @@ void VTBDecoder::insertPacket(AVPacket *packet){
     myStateObserver.mark("video packet", 1, true);
 }
 
+void VTBDecoder::insertEndPacket(){
+    //insertPacket would ref it, and av_packet_ref allocates a padded buffer for a packet without one, so it isn't empty any more.
+    AVPacket *endPacket = TFMPPacketPool::acquire();
+    pktBuffer.blockInsert(endPacket);
+}
+
+int VTBDecoder::insertPackets(AVPacket **packets, int count, double timeout){
+    
+    //unlike insertPacket, the packets are taken over without copying.
+    int inserted = pktBuffer.blockInsertBatchFor(packets, count, timeout);
+    
+    myStateObserver.mark("video packet", 1, true);
+    return inserted;
+}
+
 void VTBDecoder::activeBlock(bool flag){
     pktBuffer.disableIO(!flag);
     frameBuffer.disableIO(!flag);
@@ -341,6 +547,9 @@ void VTBDecoder::flush(){
     pthread_mutex_unlock(&waitLoopMutex);
     myStateObserver.mark(stateName, 5);
     
+    degrader.resetStreaks();
+    resetFailures();
+    
     //4. flush all reserved buffers
     pktBuffer.flush();
     myStateObserver.mark(stateName, 6);
@@ -363,7 +572,10 @@ void VTBDecoder::flush(){
 }
 
 void VTBDecoder::flushContext(){
-    
+    if (_decodeSession) {
+        VTDecompressionSessionWaitForAsynchronousFrames(_decodeSession);
+    }
+    reorderBuffer.flush();
 }
 
 bool VTBDecoder::bufferIsEmpty(){
@@ -392,6 +604,23 @@ void VTBDecoder::freeResources(){
     frameBuffer.flush();
     myStateObserver.mark(name+" free", 5);
     flushContext();
+    
+    if (_decodeSession) {
+        VTDecompressionSessionInvalidate(_decodeSession);
+        CFRelease(_decodeSession);
+        _decodeSession = nullptr;
+    }
+    if (_videoFmtDesc) {
+        CFRelease(_videoFmtDesc);
+        _videoFmtDesc = nullptr;
+    }
+    if (codecCtx) avcodec_free_context(&codecCtx);
+    
+    //frames still held by the displayer come back later, the pool is deleted after them.
+    if (framePool) {
+        framePool->close();
+        framePool = nullptr;
+    }
 }
 
 
@@ -106,6 +106,28 @@ inline uint64_t channelLayoutForChannels(int channels){
     return av_get_default_channel_layout(channels);
 }
 
+#pragma mark - buffer estimating funcs
+
+/** Packets or frames per second of a stream from its metadata. Audio without frame_size is taken as 1024 samples per frame. */
+inline double valueRateOfStream(AVStream *stream){
+    AVCodecParameters *codecpar = stream->codecpar;
+    if (codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+        if (codecpar->sample_rate <= 0) return 0;
+        int frameSize = codecpar->frame_size > 0 ? codecpar->frame_size : 1024;
+        return codecpar->sample_rate/(double)frameSize;
+    }else if (codecpar->codec_type == AVMEDIA_TYPE_VIDEO){
+        double rate = av_q2d(stream->avg_frame_rate);
+        if (rate <= 0) rate = av_q2d(stream->r_frame_rate);
+        return rate > 0 ? rate : 25;
+    }
+    return 0;
+}
+
+/** The count of values in duration seconds of a stream, with a quarter more for the jitter of rates. */
+inline long valueCountForDuration(AVStream *stream, double duration){
+    return (long)(valueRateOfStream(stream)*duration*1.25);
+}
+
 #define TFMPCondWait(cond, mutex) \
     pthread_mutex_lock(&mutex);\
     pthread_cond_wait(&cond, &mutex);\
@@ -14,7 +14,12 @@
 #include <stdio.h>
 #include <string>
 #include <map>
+#include <pthread.h>
+#ifdef __APPLE__
 #include <mach/mach_time.h>
+#else
+#include <chrono>
+#endif
 
 #define myStateObserver (*TFStateObserver::shareInstance())
 
@@ -25,54 +30,75 @@ class TFStateObserver {
     map<string, double> timeMarks;
     map<string, string> labels;
     
+    //marks come from all threads of the player, and the shower reads them on main thread.
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    
 public:
     
     double currentTime(){
+#ifdef __APPLE__
         uint64_t cur = mach_absolute_time();
         
         mach_timebase_info_data_t timebase;
         mach_timebase_info(&timebase);
         
         return cur*1e-9*(double)timebase.numer/timebase.denom;
+#else
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
     }
     
     static TFStateObserver* shareInstance(){
         
-        static TFStateObserver *instance;
-        
-        if (instance == nullptr) {
-            instance = new TFStateObserver();
-        }
+        //initializing a static local is thread-safe.
+        static TFStateObserver *instance = new TFStateObserver();
         
         return instance;
     };
     
-    map<string, int>& getCounts(){
-        return counts;
+    /** The getters return copies, so reading them doesn't race with marking. */
+    map<string, int> getCounts(){
+        pthread_mutex_lock(&mutex);
+        map<string, int> result = counts;
+        pthread_mutex_unlock(&mutex);
+        return result;
     }
     
-    map<string, double>& getTimeMarks(){
-        return timeMarks;
+    map<string, double> getTimeMarks(){
+        pthread_mutex_lock(&mutex);
+        map<string, double> result = timeMarks;
+        pthread_mutex_unlock(&mutex);
+        return result;
     }
     
-    map<string, string>& getLabels(){
-        return labels;
+    map<string, string> getLabels(){
+        pthread_mutex_lock(&mutex);
+        map<string, string> result = labels;
+        pthread_mutex_unlock(&mutex);
+        return result;
     }
     
     void mark(string name, int count, bool additive = false){
+        pthread_mutex_lock(&mutex);
         if (additive) {
             counts[name] += count;
         }else{
             counts[name] = count;
         }
+        pthread_mutex_unlock(&mutex);
     }
     
     void timeMark(string name){
-        timeMarks[name] = currentTime();
+        double time = currentTime();
+        pthread_mutex_lock(&mutex);
+        timeMarks[name] = time;
+        pthread_mutex_unlock(&mutex);
     }
     
     void labelMark(string name, string label){
+        pthread_mutex_lock(&mutex);
         labels[name] = label;
+        pthread_mutex_unlock(&mutex);
     }
 };
 
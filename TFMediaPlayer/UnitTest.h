@@ -1,15 +0,0 @@
-//
-//  UnitTest.h
-//  TFMediaPlayer
-//
-//  Created by shiwei on 17/12/29.
-//  Copyright © 2017年 shiwei. All rights reserved.
-//
-
-#import <Foundation/Foundation.h>
-
-@interface UnitTest : NSObject
-
--(void)testRecycleBuffer;
-
-@end